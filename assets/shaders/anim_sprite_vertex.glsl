@@ -0,0 +1,64 @@
+#version 330 core
+
+// one instance per sprite, the quad is generated from gl_VertexID
+layout(location = 0) in ivec4 pos_anim;
+layout(location = 1) in vec2 size;
+layout(location = 2) in float start_time;
+
+out vec3 f_pos;
+out vec3 f_normal;
+out vec2 f_tpos;
+flat out int f_layer;
+uniform vec3 camera;
+uniform float near_z;
+uniform float far_z;
+uniform vec2 nearsize;
+uniform float pos_scale;
+uniform float time;
+
+#define MAX_ANIMATIONS 32
+uniform vec4 anim_rect[MAX_ANIMATIONS];
+uniform vec4 anim_step[MAX_ANIMATIONS];
+uniform float anim_frame_time[MAX_ANIMATIONS];
+
+// two triangles, abc and acd, the same as render_quad
+const int corners[6] = int[6](0, 1, 2, 0, 2, 3);
+const vec2 offsets[4] = vec2[4](vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(0, 1));
+const vec3 normals[4] = vec3[4](
+  vec3(-0.70710678, 0, 0.70710678),
+  vec3(0, -0.70710678, 0.70710678),
+  vec3(0.70710678, 0, 0.70710678),
+  vec3(0, 0.70710678, 0.70710678)
+);
+
+void main() {
+  int corner = corners[gl_VertexID];
+  // the animation in the low byte, the atlas layer in the high one
+  int anim = pos_anim.w & 0xff;
+  vec4 rect = anim_rect[anim];
+  vec4 step = anim_step[anim];
+  float frame_time = anim_frame_time[anim];
+  int columns = max(int(step.z), 1);
+  int n = 0;
+
+  // pick the frame, same as render_animation_frame
+  if (step.w > 0.0 && frame_time > 0.0)
+    n = int(mod(max(time - start_time, 0.0), step.w*frame_time) / frame_time);
+  vec2 frame = rect.xy + vec2(n % columns, -(n / columns)) * step.xy;
+
+  // translate to camera
+  f_pos = vec3(pos_anim.xyz) * pos_scale;
+  f_pos.xy += (offsets[corner] - 0.5) * size * pos_scale;
+  vec3 p = f_pos - camera;
+
+  // normalize to frustum
+  p.x *= near_z / p.z / nearsize.x * 2;
+  p.y *= near_z / p.z / nearsize.y * 2;
+  p.z = (p.z - near_z) / (far_z - near_z) * 2 - 1;
+
+  // output
+  gl_Position = vec4(p, 1);
+  f_tpos = frame + offsets[corner] * rect.zw;
+  f_normal = normals[corner];
+  f_layer = (pos_anim.w >> 8) & 0xff;
+}
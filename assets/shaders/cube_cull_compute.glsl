@@ -0,0 +1,66 @@
+#version 430 core
+
+// one invocation per cube, writes the indirect draw command of every cube in first..first+count
+layout(local_size_x = 64) in;
+
+// same layout as CubeInstance
+struct Cube {
+  vec3 x0;
+  uint tex;
+  vec3 x1;
+  int layer;
+};
+
+// same layout as GpuCullCommand
+struct DrawCommand {
+  uint count;
+  uint instance_count;
+  uint first_index;
+  int base_vertex;
+  uint base_instance;
+};
+
+layout(std430, binding = 0) readonly buffer Cubes {
+  Cube cubes[];
+};
+
+layout(std430, binding = 1) writeonly buffer Commands {
+  DrawCommand commands[];
+};
+
+uniform vec3 camera;
+uniform float near_z;
+uniform float far_z;
+uniform vec2 nearsize;
+uniform int first;
+uniform int count;
+
+void main() {
+  int i = int(gl_GlobalInvocationID.x);
+  if (i >= count)
+    return;
+  i += first;
+
+  // the same planes as frustum_create, p is inside if dot(plane.xyz, p) + plane.w >= 0
+  float tx = nearsize.x / (-2.0 * near_z);
+  float ty = nearsize.y / (-2.0 * near_z);
+  vec4 planes[6] = vec4[6](
+    vec4(0, 0, -1, camera.z + near_z),
+    vec4(0, 0, 1, -camera.z - far_z),
+    vec4(1, 0, -tx, -camera.x + tx*camera.z),
+    vec4(-1, 0, -tx, camera.x + tx*camera.z),
+    vec4(0, 1, -ty, -camera.y + ty*camera.z),
+    vec4(0, -1, -ty, camera.y + ty*camera.z)
+  );
+
+  // only the corner furthest along each normal needs to be inside
+  Cube c = cubes[i];
+  bool visible = true;
+  for (int j = 0; j < 6; ++j) {
+    vec3 p = mix(c.x0, c.x1, greaterThan(planes[j].xyz, vec3(0)));
+    visible = visible && dot(planes[j].xyz, p) + planes[j].w >= 0.0;
+  }
+
+  // 36 indices of the unit cube, and the base instance picks the cube
+  commands[i] = DrawCommand(36u, visible ? 1u : 0u, 0u, 0, uint(i));
+}
@@ -0,0 +1,47 @@
+#version 330 core
+
+// the unit cube
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec2 normal;
+
+// one instance per cube, see CubeInstance
+layout(location = 2) in vec3 x0;
+layout(location = 3) in vec3 x1;
+layout(location = 4) in vec2 tpos;
+layout(location = 5) in int layer;
+
+out vec3 f_pos;
+out vec3 f_normal;
+out vec2 f_tpos;
+flat out int f_layer;
+uniform vec3 camera;
+uniform float near_z;
+uniform float far_z;
+uniform vec2 nearsize;
+uniform float pos_scale;
+
+vec3 oct_decode(vec2 e) {
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if (n.z < 0) {
+    vec2 s = vec2(n.x >= 0 ? 1.0 : -1.0, n.y >= 0 ? 1.0 : -1.0);
+    n.xy = (1.0 - abs(n.yx)) * s;
+  }
+  return normalize(n);
+}
+
+void main() {
+  // stretch the unit cube over the box, and translate to camera
+  f_pos = mix(x0, x1, pos * pos_scale);
+  vec3 p = f_pos - camera;
+
+  // normalize to frustum
+  p.x *= near_z / p.z / nearsize.x * 2;
+  p.y *= near_z / p.z / nearsize.y * 2;
+  p.z = (p.z - near_z) / (far_z - near_z) * 2 - 1;
+
+  // output
+  gl_Position = vec4(p, 1);
+  f_tpos = tpos;
+  f_normal = oct_decode(normal);
+  f_layer = layer;
+}
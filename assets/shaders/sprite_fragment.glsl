@@ -1,12 +1,54 @@
 #version 330 core
 
+in vec3 f_pos;
 in vec3 f_normal;
 in vec2 f_tpos;
+flat in int f_layer;
 out vec4 color;
 
-uniform sampler2D tex;
+uniform sampler2DArray tex;
+uniform vec3 camera;
+uniform float near_z;
+uniform float far_z;
+uniform vec2 nearsize;
+
+// see flat_gllights.cpp
+uniform samplerBuffer lights;
+uniform usamplerBuffer light_clusters;
+uniform usamplerBuffer light_indices;
+
+// same as flat_lights.cpp
+const int CLUSTERS_X = 16;
+const int CLUSTERS_Y = 9;
+const int CLUSTERS_Z = 24;
+
+// the sum of the lights of the cluster f_pos is in, falling off the same as swr__light
+vec3 light() {
+  vec3 p = f_pos - camera;
+  float d = -p.z;
+  float near_d = -near_z;
+  float far_d = -far_z;
+
+  // same tiles and slices as lights_bin
+  vec2 ndc = p.xy / d * 2 * near_d / nearsize;
+  ivec2 tile = ivec2(clamp((ndc + 1) * 0.5 * vec2(CLUSTERS_X, CLUSTERS_Y), vec2(0), vec2(CLUSTERS_X, CLUSTERS_Y) - 0.5));
+  int slice = clamp(int(log(d / near_d) / log(far_d / near_d) * CLUSTERS_Z), 0, CLUSTERS_Z - 1);
+  uvec2 cluster = texelFetch(light_clusters, (slice*CLUSTERS_Y + tile.y)*CLUSTERS_X + tile.x).xy;
+
+  vec3 sum = vec3(0);
+  for (uint i = 0u; i < cluster.y; ++i) {
+    int l = int(texelFetch(light_indices, int(cluster.x + i)).x);
+    vec4 pos_radius = texelFetch(lights, 2*l);
+    vec3 to_light = pos_radius.xyz - f_pos;
+    float dist = max(length(to_light), 0.0001);
+    float falloff = clamp(1 - dist / pos_radius.w, 0, 1);
+    sum += texelFetch(lights, 2*l + 1).rgb * max(dot(f_normal, to_light / dist), 0) * falloff*falloff;
+  }
+  return sum;
+}
 
 void main(){
-	color = vec4(f_normal, 1) + texture(tex, f_tpos);
-  // color = texture(tex, f_tpos);
+	color = vec4(f_normal, 1) + texture(tex, vec3(f_tpos, f_layer));
+  // color = texture(tex, vec3(f_tpos, f_layer));
+  color.rgb += light();
 }
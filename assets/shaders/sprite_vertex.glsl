@@ -2,18 +2,32 @@
 
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec2 tpos;
-layout(location = 2) in vec3 normal;
+layout(location = 2) in vec2 normal;
+layout(location = 3) in int layer;
 
+out vec3 f_pos;
 out vec3 f_normal;
 out vec2 f_tpos;
+flat out int f_layer;
 uniform vec3 camera;
 uniform float near_z;
 uniform float far_z;
 uniform vec2 nearsize;
+uniform float pos_scale;
+
+vec3 oct_decode(vec2 e) {
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if (n.z < 0) {
+    vec2 s = vec2(n.x >= 0 ? 1.0 : -1.0, n.y >= 0 ? 1.0 : -1.0);
+    n.xy = (1.0 - abs(n.yx)) * s;
+  }
+  return normalize(n);
+}
 
 void main() {
   // translate to camera
-  vec3 p = pos - camera;
+  f_pos = pos * pos_scale;
+  vec3 p = f_pos - camera;
 
   // normalize to frustum
   p.x *= near_z / p.z / nearsize.x * 2;
@@ -23,5 +37,6 @@ void main() {
   // output
   gl_Position = vec4(p, 1);
   f_tpos = tpos;
-  f_normal = normal;
+  f_normal = oct_decode(normal);
+  f_layer = layer;
 }
@@ -0,0 +1,46 @@
+#version 330 core
+
+in vec3 f_pos;
+in vec3 f_normal;
+in vec2 f_tpos;
+flat in int f_layer;
+out vec4 color;
+
+uniform sampler2DArray tex;
+
+// the distance fields, same as flat_glyphs.cpp
+const float SDF_ONEDGE = 128.0 / 255.0;
+const float SDF_SCALE = 20.0 / 255.0; // per texel
+
+// effects, in texels of the distance field, which has 6 of them around every glyph
+const vec4 TEXT_COLOR = vec4(1, 1, 1, 1);
+const vec4 OUTLINE_COLOR = vec4(0, 0, 0, 1);
+const float OUTLINE_WIDTH = 1.5;
+const vec4 SHADOW_COLOR = vec4(0, 0, 0, 0.5);
+const vec2 SHADOW_OFFSET = vec2(1.5, 1.5); // down and right
+
+// signed distance to the outline in texels, positive inside
+float dist(vec2 tpos) {
+  return (texture(tex, vec3(tpos, f_layer)).r - SDF_ONEDGE) / SDF_SCALE;
+}
+
+// how much of the pixel is inside the distance d, with edges aa texels wide
+float coverage(float d, float aa) {
+  return clamp(d / aa + 0.5, 0, 1);
+}
+
+void main() {
+  vec2 size = vec2(textureSize(tex, 0).xy);
+  vec2 texels = fwidth(f_tpos) * size;
+  float aa = max(max(texels.x, texels.y), 0.0001);
+  float d = dist(f_tpos);
+
+  float fill = coverage(d, aa);
+  float outline = coverage(d + OUTLINE_WIDTH, aa);
+  float shadow = coverage(dist(f_tpos - SHADOW_OFFSET / size) + OUTLINE_WIDTH, aa) * SHADOW_COLOR.a;
+
+  // the text and its outline, over the shadow
+  vec4 body = vec4(mix(OUTLINE_COLOR.rgb, TEXT_COLOR.rgb, fill), outline * mix(OUTLINE_COLOR.a, TEXT_COLOR.a, fill));
+  color.a = body.a + shadow * (1 - body.a);
+  color.rgb = (body.rgb * body.a + SHADOW_COLOR.rgb * shadow * (1 - body.a)) / max(color.a, 0.0001);
+}
@@ -10,3 +10,6 @@ del flat_*.pdb >NUL 2>NUL
 
 cl %compiler_flags% ..\..\src\flat.cpp     -LD -link -PDB:flat_%random%.pdb -EXPORT:main_loop -EXPORT:init %linker_flags% -debug
 cl %compiler_flags% ..\..\src\flat_sdl.cpp -I..\..\include -link %linker_flags% opengl32.lib ..\..\SDL2.lib -debug
+cl %compiler_flags% ..\..\src\flat_headless.cpp -I..\..\include -link %linker_flags% ..\..\SDL2.lib -debug
+cl %compiler_flags% ..\..\src\flat_fontbake.cpp -I..\..\include -link %linker_flags% opengl32.lib -debug
+cl %compiler_flags% ..\..\src\flat_packer.cpp -I..\..\include -link %linker_flags% opengl32.lib -debug
@@ -1,6 +1,10 @@
 #include "flat_math.hpp"
 #include "flat_utils.cpp"
 #include "flat_platform_api.hpp"
+#include "flat_cull.hpp"
+#include "flat_mesh.hpp"
+#include "flat_textcache.hpp"
+#include "flat_textlayout.hpp"
 
 #include <stdio.h>
 #include <string.h>
@@ -12,7 +16,7 @@
 
 struct State;
 struct Renderer;
-static void render_text(Renderer *r, const char *str, float pos_x, float pos_y, float pos_z, float height, bool center);
+static void render_text(Renderer *r, RenderArena *a, const char *str, float pos_x, float pos_y, float pos_z, float height, float max_width, int align);
 
 static State *state;
 
@@ -78,10 +82,29 @@ struct Entity {
 struct State {
   Entity entities[256];
   int num_entities;
+  float time;
+
+  /* culling */
+  CullBoxes cull_boxes;
+  u8 entity_visible[CULL_MAX_BOXES];
+
+  /* all walls in one mesh, rebuilt when a wall is added or removed */
+  BoxMesh wall_mesh;
+  bool wall_mesh_dirty;
+  CullBoxes wall_cull_boxes; /* the chunks of wall_mesh */
+  u8 wall_chunk_visible[CULL_MAX_BOXES];
+
+  /* meshes of the strings render_text has drawn lately */
+  TextCache text_cache;
+  TextLayout text_layout;
+
   Stack stack;
   char stack_data[128*1024*1024];
   Renderer *renderer;
+  Funs funs;
 };
+STATIC_ASSERT(ARRAY_LEN(((State*)0)->entities) <= CULL_MAX_BOXES, can_cull_all_entities);
+STATIC_ASSERT(MESH_MAX_CHUNKS <= CULL_MAX_BOXES, can_cull_all_wall_chunks);
 
 
 /* in: line, plane, plane origin */
@@ -267,12 +290,15 @@ static int entity_push(Entity e) {
     entity_evict(dest);
   }
 
+  if (e.type == ENTITY_TYPE_WALL || dest->type == ENTITY_TYPE_WALL)
+    state->wall_mesh_dirty = true;
   *dest = e;
   return 0;
 }
 
-static Glyph glyph_get(Renderer *r, char c) {
-  return r->glyphs[c - RENDERER_FIRST_CHAR];
+/* The platform rasterizes glyphs as they are asked for, so this is main thread only */
+static Glyph glyph_get(Renderer *r, u32 codepoint) {
+  return state->funs.glyph_get(r, codepoint);
 }
 
 enum AnimationState {
@@ -284,157 +310,300 @@ enum AnimationState {
   ANIMATION_STATE_COUNT
 };
 
+/* Frames are laid out in a grid in the sprite image, x and y are relative to the sprite */
 struct SpriteSheetAnimation {
+  SpriteId sprite;
   float x, y, w, h, dx, dy;
   int columns, num;
   float time;
 };
 
 static SpriteSheetAnimation spriteanim[] = {
-  {0},
-  {0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 1, 0.5f},
-  {0.25f, 0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 1, 0.5f},
-  {0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 4, 0.2f},
-  {0.0f, 0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 4, 0.2f}
+  {SPRITE_PLAYER, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0, 0, 0.0f},
+  {SPRITE_PLAYER, 0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 1, 0.5f},
+  {SPRITE_PLAYER, 0.25f, 0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 1, 0.5f},
+  {SPRITE_PLAYER, 0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 4, 0.2f},
+  {SPRITE_PLAYER, 0.0f, 0.0f, 0.25f, 0.25f, 0.25f, 0.25f, 4, 4, 0.2f}
 };
 
 STATIC_ASSERT(ANIMATION_STATE_COUNT == ARRAY_LEN(spriteanim), all_tex_pos_defined);
 
-static Rect get_anim_tex(AnimationState which, float time) {
-  SpriteSheetAnimation s;
-  int n;
-  Rect r;
+/* Maps a point in a sprite to where it ended up in the atlas */
+static v2 sprite_uv(Renderer *r, SpriteId sprite, float x, float y) {
+  Rect uv = r->sprites[sprite].uv;
+  v2 result;
+  result.x = uv.x0 + x*(uv.x1 - uv.x0);
+  result.y = uv.y0 + y*(uv.y1 - uv.y0);
+  return result;
+}
+
+static RenderTexture sprite_texture(Renderer *r, SpriteId sprite) {
+  return (RenderTexture)(RENDER_TEXTURE_SPRITES + r->sprites[sprite].page);
+}
+
+STATIC_ASSERT(ARRAY_LEN(spriteanim) <= RENDERER_MAX_ANIMATIONS, all_animations_fit_in_renderer);
 
-  ENUM_CHECK(ANIMATION_STATE, which);
+/* Maps the animations into the atlas, for the renderer to evaluate */
+static void render_animations_update(Renderer *r) {
+  int i;
 
-  s = spriteanim[which];
-  n = (int)(fmod(time, (s.num*s.time)) / s.time);
-  r.x0 = s.x + (n % s.columns)*s.dx;
-  r.y0 = s.y - (n / s.columns)*s.dy;
-  r.x1 = r.x0+s.w;
-  r.y1 = r.y0+s.h;
+  for (i = 0; i < ARRAY_LEN(spriteanim); ++i) {
+    SpriteSheetAnimation *s = spriteanim + i;
+    Rect uv = r->sprites[s->sprite].uv;
+    float sw = uv.x1 - uv.x0, sh = uv.y1 - uv.y0;
 
-  return r;
+    r->animations.rect[i] = v4{uv.x0 + s->x*sw, uv.y0 + s->y*sh, s->w*sw, s->h*sh};
+    r->animations.step[i] = v4{s->dx*sw, s->dy*sh, (float)s->columns, (float)s->num};
+    r->animations.frame_time[i] = s->time;
+  }
 }
 
-static float calc_string_width(Renderer *r, const char *str) {
-  float result = 0.0f;
+/* Draws count vertices, starting at first, in the vertex array used by the shader (or instances, for RENDER_SHADER_ANIM_SPRITE) */
+static void render_command(RenderArena *a, RenderLayer layer, RenderShader shader, RenderTexture texture, float depth, int first, int count) {
+  RenderCommand *c;
 
-  for (; *str; ++str)
-    result += glyph_get(r, *str).advance;
-  return result;
+  if (!count || a->num_commands >= ARRAY_LEN(a->commands))
+    return;
+
+  c = a->commands + a->num_commands++;
+  c->key = render_key(layer, shader, texture, depth);
+  c->first = first;
+  c->count = count;
 }
 
-static void render_text(Renderer *r, const char *str, float pos_x, float pos_y, float pos_z, float height, bool center) {
-  float h,w, scale, ipw,iph, x,y,z, tx0,ty0,tx1,ty1;
-  SpriteVertex *v;
+/**
+ * str is UTF-8, and is laid out by textlayout_build, wrapped at max_width if it is above 0, with pos at the point align picks.
+ * Strings that were drawn the same way lately are copied from the text cache. Main thread only
+ */
+static void render_text(Renderer *r, RenderArena *a, const char *str, float pos_x, float pos_y, float pos_z, float height, float max_width, int align) {
+  float h,w, scale, ipw,iph, x,y, tx0,ty0,tx1,ty1, depth;
+  TextLayout *l = &state->text_layout;
+  TextCacheEntry *cached;
+  TextVertex *v;
+  u16 *cells;
+  u64 key;
+  int first, missing, i, j, k;
+  bool complete;
+
+  textcache_validate(&state->text_cache, r->glyph_generation);
+  key = textcache_key(str, pos_x, pos_y, pos_z, height, max_width, align);
+  depth = length(v3{pos_x, pos_y, pos_z} - r->camera_pos);
+  first = a->num_text_vertices;
+
+  cached = textcache_find(&state->text_cache, key);
+  if (cached) {
+    if (first + cached->count > ARRAY_LEN(a->text_vertices))
+      return;
+    memcpy(a->text_vertices + first, state->text_cache.vertices + cached->first, cached->count * sizeof(*a->text_vertices));
+    a->num_text_vertices += cached->count;
+    /* the glyphs weren't asked for, so they must be kept from being evicted */
+    state->funs.glyph_touch(state->text_cache.cells + cached->first / TEXTCACHE_QUAD_VERTICES, cached->count / TEXTCACHE_QUAD_VERTICES);
+    render_command(a, RENDER_LAYER_WORLD, RENDER_SHADER_TEXT, RENDER_TEXTURE_TEXT, depth, first, cached->count);
+    return;
+  }
 
   scale = height / RENDERER_FONT_SIZE;
-  ipw = 1.0f / r->text_atlas.size.x;
-  iph = 1.0f / r->text_atlas.size.y;
+  ipw = 1.0f / r->atlas_size.x;
+  iph = 1.0f / r->atlas_size.y;
 
-  if (r->num_text_vertices + strlen(str) >= ARRAY_LEN(r->text_vertices))
-    return;
+  missing = r->num_glyphs_missing;
+  textlayout_build(l, r, &state->funs, str, max_width / scale, align);
+  complete = !l->truncated;
 
-  if (center) {
-    pos_x -= calc_string_width(r, str) * scale / 2;
-    /*pos.y -= height/2.0f;*/ /* Why isn't this working? */
-  }
+  for (i = 0; i < l->num_runs; ++i) {
+    TextRun *run = l->runs + i;
+
+    for (j = run->first; j < run->first + run->count; ++j) {
+      Glyph g = l->glyphs[j].glyph;
+
+      if (g.x1 == g.x0 || g.y1 == g.y0)
+        continue;
+      if (a->num_text_vertices + 6 > (int)ARRAY_LEN(a->text_vertices)) {
+        complete = false;
+        break;
+      }
+
+      /* the layout's y goes down */
+      x = pos_x + (run->x + l->glyphs[j].x + g.offset_x)*scale;
+      y = pos_y - (run->y + g.offset_y)*scale;
+      w = (g.x1 - g.x0)*scale;
+      h = (g.y0 - g.y1)*scale;
 
-  for (; *str && r->num_text_vertices + 6 < (int)ARRAY_LEN(r->text_vertices); ++str) {
-    Glyph g = glyph_get(r, *str);
+      /* scale texture to atlas */
+      tx0 = g.x0 * ipw,
+      tx1 = g.x1 * ipw;
+      ty0 = g.y0 * iph;
+      ty1 = g.y1 * iph;
 
-    x = pos_x + g.offset_x*scale;
-    y = pos_y - g.offset_y*scale;
-    z = pos_z;
-    w = (g.x1 - g.x0)*scale;
-    h = (g.y0 - g.y1)*scale;
+      v = a->text_vertices + a->num_text_vertices;
 
-    /* scale texture to atlas */
-    tx0 = g.x0 * ipw,
-    tx1 = g.x1 * ipw;
-    ty0 = g.y0 * iph;
-    ty1 = g.y1 * iph;
+      *v++ = textvertex_create(x, y, pos_z, tx0, ty0);
+      *v++ = textvertex_create(x + w, y, pos_z, tx1, ty0);
+      *v++ = textvertex_create(x, y + h, pos_z, tx0, ty1);
+      *v++ = textvertex_create(x, y + h, pos_z, tx0, ty1);
+      *v++ = textvertex_create(x + w, y, pos_z, tx1, ty0);
+      *v++ = textvertex_create(x + w, y + h, pos_z, tx1, ty1);
 
-    v = r->text_vertices + r->num_text_vertices;
+      a->num_text_vertices += 6;
+    }
+  }
+
+  /* only whole strings are worth keeping, with all their glyphs */
+  if (complete && r->num_glyphs_missing == missing) {
+    v = textcache_insert(&state->text_cache, key, a->num_text_vertices - first, &cells);
+    if (v) {
+      memcpy(v, a->text_vertices + first, (a->num_text_vertices - first) * sizeof(*v));
+      for (i = 0, k = 0; i < l->num_runs; ++i)
+        for (j = l->runs[i].first; j < l->runs[i].first + l->runs[i].count; ++j)
+          if (l->glyphs[j].glyph.x1 != l->glyphs[j].glyph.x0 && l->glyphs[j].glyph.y1 != l->glyphs[j].glyph.y0)
+            cells[k++] = l->glyphs[j].glyph.cell;
+    }
+  }
 
-    *v++ = spritevertex_create(x, y, z, tx0, ty0);
-    *v++ = spritevertex_create(x + w, y, z, tx1, ty0);
-    *v++ = spritevertex_create(x, y + h, z, tx0, ty1);
-    *v++ = spritevertex_create(x, y + h, z, tx0, ty1);
-    *v++ = spritevertex_create(x + w, y, z, tx1, ty0);
-    *v++ = spritevertex_create(x + w, y + h, z, tx1, ty1);
+  render_command(a, RENDER_LAYER_WORLD, RENDER_SHADER_TEXT, RENDER_TEXTURE_TEXT, depth, first, a->num_text_vertices - first);
+}
 
-    r->num_text_vertices += 6;
-    pos_x += g.advance * scale;
+/* With GPU culling the cube is pushed as it is, otherwise it has already been culled, and is expanded here */
+static void render_cube(Renderer *r, RenderArena *arena, v3 pos, Cube cube) {
+  RenderTexture texture = sprite_texture(r, SPRITE_PLAYER);
+  CubeInstance c = cubeinstance_create(pos + cube.x0, pos + cube.x1, sprite_uv(r, SPRITE_PLAYER, 0.0f, 0.0f), texture);
+  float depth = length(pos + (cube.x0 + cube.x1)*0.5f - r->camera_pos);
+  int first;
+
+  if (r->gpu_culling) {
+    if (arena->num_cubes >= ARRAY_LEN(arena->cubes))
+      return;
+    first = arena->num_cubes++;
+    arena->cubes[first] = c;
+    render_command(arena, RENDER_LAYER_WORLD, RENDER_SHADER_CUBE, texture, depth, first, 1);
+    return;
   }
+
+  if (arena->num_vertices + CUBE_VERTICES > ARRAY_LEN(arena->vertices))
+    return;
+  first = arena->num_vertices;
+  cubeinstance_expand(&c, arena->vertices + first);
+  arena->num_vertices += CUBE_VERTICES;
+  render_command(arena, RENDER_LAYER_WORLD, RENDER_SHADER_SPRITE, texture, depth, first, CUBE_VERTICES);
+}
+
+static void render_light(RenderArena *arena, v3 pos, float radius, v3 color) {
+  RenderLight *l;
+
+  if (arena->num_lights >= ARRAY_LEN(arena->lights))
+    return;
+  l = arena->lights + arena->num_lights++;
+  l->pos = pos;
+  l->radius = radius;
+  l->color = color;
+  l->padding = 0.0f;
 }
 
-static void render_quad(Renderer *r, v3 a, v3 b, v3 c, v3 d, v2 ta, v2 tb, v2 tc, v2 td) {
-  SpriteVertex *v;
-  v3 da = normalize(b-a), db = normalize(d-a);
-  v3 n = normalize(cross(da, db));
+/* anim_time is how long the animation has been playing */
+static void render_anim_sprite(Renderer *r, RenderArena *arena, v3 pos, float w, float h, AnimationState anim_state, float anim_time) {
+  float depth = length(pos - r->camera_pos);
+  int first = arena->num_instances;
+  RenderTexture texture;
 
-  if (r->num_vertices + 6 >= ARRAY_LEN(r->vertices))
+  ENUM_CHECK(ANIMATION_STATE, anim_state);
+  if (arena->num_instances >= ARRAY_LEN(arena->instances))
     return;
 
-  v = r->vertices + r->num_vertices;
-  v->pos = a; v->tex = ta; v->normal = normalize(n-da); ++v;
-  v->pos = b; v->tex = tb; v->normal = normalize(n-db); ++v;
-  v->pos = c; v->tex = tc; v->normal = normalize(n+da); ++v;
-  v->pos = a; v->tex = ta; v->normal = normalize(n-da); ++v;
-  v->pos = c; v->tex = tc; v->normal = normalize(n+da); ++v;
-  v->pos = d; v->tex = td; v->normal = normalize(n+db); ++v;
-  r->num_vertices += 6;
+  texture = sprite_texture(r, spriteanim[anim_state].sprite);
+  arena->instances[arena->num_instances++] = spriteinstance_create(pos, w, h, anim_state, texture, r->time - anim_time);
+  render_command(arena, RENDER_LAYER_WORLD, RENDER_SHADER_ANIM_SPRITE, texture, depth, first, 1);
 }
 
-static void render_cube(Renderer *r, v3 pos, Cube cube) {
-  v3 dx, a,b,c,d,e,f,g,h;
-  v2 t = {0, 0};
+/* Walls don't move, so they are meshed together once, and the chunks of the mesh that are in view are drawn with a single command */
+static void render_walls(Renderer *r, RenderArena *arena) {
+  BoxMesh *m = &state->wall_mesh;
+  Frustum frustum;
+  int i, first, count;
+
+  if (state->wall_mesh_dirty) {
+    unsigned char *top = state->stack.curr;
+    Cube *boxes = (Cube*)stack_push_ex(&state->stack, state->num_entities * sizeof(Cube), alignof(Cube));
+    int num_boxes = 0;
+
+    if (!boxes)
+      return;
+    for (i = 0; i < state->num_entities; ++i) {
+      Entity *e = state->entities + i;
+      if (e->type != ENTITY_TYPE_WALL)
+        continue;
+      boxes[num_boxes].x0 = e->pos + e->hitbox.x0;
+      boxes[num_boxes].x1 = e->pos + e->hitbox.x1;
+      ++num_boxes;
+    }
 
-  pos = pos + cube.x0;
+    boxmesh_build(&state->wall_mesh, boxes, num_boxes, &state->stack, sprite_texture(r, SPRITE_PLAYER), sprite_uv(r, SPRITE_PLAYER, 0.0f, 0.0f));
+    stack_pop(&state->stack, top);
+    state->wall_mesh_dirty = false;
+    debug("wall mesh: %i faces merged into %i, in %i chunks\n", m->num_faces_in, m->num_faces_out, m->num_chunks);
 
-  dx = cube.x1-cube.x0;
+    cullboxes_clear(&state->wall_cull_boxes);
+    for (i = 0; i < m->num_chunks; ++i)
+      cullboxes_push(&state->wall_cull_boxes, m->chunks[i].x0, m->chunks[i].x1);
+  }
 
-  a = b = c = d = pos;
-  b.x += dx.x;
-  c.x += dx.x;
-  c.y += dx.y;
-  d.y += dx.y;
-  e = a, f = b, g = c, h = d;
-  e.z = f.z = g.z = h.z = pos.z+dx.z;
+  frustum = frustum_create(r->camera_pos, RENDERER_FOV, RENDERER_ASPECT, RENDERER_NEAR_Z, RENDERER_FAR_Z);
+  frustum_cull(&frustum, &state->wall_cull_boxes, state->wall_chunk_visible);
 
-  render_quad(r, a, b, c, d, t, t, t, t);
-  render_quad(r, a, b, f, e, t, t, t, t);
-  render_quad(r, a, e, h, d, t, t, t, t);
-  render_quad(r, e, f, g, h, t, t, t, t);
-  render_quad(r, b, c, g, f, t, t, t, t);
-  render_quad(r, c, d, h, g, t, t, t, t);
+  first = arena->num_vertices;
+  for (i = 0; i < m->num_chunks; ++i) {
+    if (!state->wall_chunk_visible[i])
+      continue;
+    count = min(m->chunks[i].count, (int)ARRAY_LEN(arena->vertices) - arena->num_vertices);
+    if (count <= 0)
+      break;
+    memcpy(arena->vertices + arena->num_vertices, m->vertices + m->chunks[i].first, count * sizeof(*arena->vertices));
+    arena->num_vertices += count;
+  }
+  /* the level is drawn before everything else in the layer */
+  render_command(arena, RENDER_LAYER_WORLD, RENDER_SHADER_SPRITE, sprite_texture(r, SPRITE_PLAYER), 1e30f, first, arena->num_vertices - first);
 }
 
-static void render_anim_sprite(Renderer *r, v3 pos, float w, float h, AnimationState anim_state, float anim_time) {
-  v3 a,b,c,d;
-  v2 ta,tb,tc,td;
-  Rect tex = get_anim_tex(anim_state, anim_time);
+#define ENTITIES_PER_RENDER_JOB 32
+
+/* Renders one range of the visible entities into the arena of the calling thread */
+static void render_entities_job(void *data, int index, int thread) {
+  Renderer *r = (Renderer*)data;
+  RenderArena *arena = r->arenas + thread;
+  int i, end;
+
+  end = min((index+1) * ENTITIES_PER_RENDER_JOB, state->num_entities);
+  for (i = index * ENTITIES_PER_RENDER_JOB; i < end; ++i) {
+    Entity *e = state->entities + i;
+
+    /* the GPU culls the cubes */
+    if (!r->gpu_culling && !state->entity_visible[i])
+      continue;
 
-  pos.x -= w/2.0f;
-  pos.y -= h/2.0f;
+    switch (e->type) {
+      case ENTITY_TYPE_PLAYER:
+        render_cube(r, arena, e->pos, e->hitbox);
+        break;
 
-  a = b = c = d = pos;
-  b.x += w;
-  c.x += w, c.y += h;
-  d.y += h;
+      /* see render_walls */
+      case ENTITY_TYPE_WALL:
+        break;
 
-  ta.x = tex.x0, ta.y = tex.y0;
-  tb.x = tex.x1, tb.y = tex.y0;
-  tc.x = tex.x1, tc.y = tex.y1;
-  td.x = tex.x0, td.y = tex.y1;
-  render_quad(r, a, b, c, d, ta, tb, tc, td);
+      default:
+        break;
+    }
+  }
 }
 
 static void render_clear(Renderer *r) {
-  r->num_vertices = 0;
-  r->num_text_vertices = 0;
+  int i;
+  for (i = 0; i < ARRAY_LEN(r->arenas); ++i) {
+    r->arenas[i].num_vertices = 0;
+    r->arenas[i].num_text_vertices = 0;
+    r->arenas[i].num_instances = 0;
+    r->arenas[i].num_cubes = 0;
+    r->arenas[i].num_lights = 0;
+    r->arenas[i].num_commands = 0;
+  }
 }
 
 static void print(const char* fmt, ...) {
@@ -511,7 +680,7 @@ GAME_INIT(init) {
   assert(memory_size >= (int)sizeof(State));
   memset(state, 0, sizeof(State));
 
-  (void)function_ptrs;
+  state->funs = function_ptrs;
 
   /* Remember the renderer */
   state->renderer = renderer;
@@ -579,6 +748,9 @@ GAME_MAIN_LOOP(main_loop) {
 
   /* clear */
   render_clear(renderer);
+  state->time += dt;
+  renderer->time = state->time;
+  render_animations_update(renderer);
 
   /* Update entities */
   for (int i = 0; i < state->num_entities; ++i) {
@@ -649,12 +821,13 @@ GAME_MAIN_LOOP(main_loop) {
             as = e->last_direction == DIR_LEFT ? ANIMATION_STATE_PLAYER_STANDING_LEFT : ANIMATION_STATE_PLAYER_STANDING_RIGHT;
           else
             as = e->last_direction == DIR_LEFT ? ANIMATION_STATE_PLAYER_WALKING_LEFT : ANIMATION_STATE_PLAYER_WALKING_RIGHT;
-          render_cube(renderer, e->pos, e->hitbox);
-          // render_anim_sprite(renderer, {e->pos.x, e->pos.y, e->pos.z+1.1f}, 1, 1, as, e->animation_time);
+          // render_anim_sprite(renderer, renderer->arenas, {e->pos.x, e->pos.y, e->pos.z+1.1f}, 1, 1, as, e->animation_time);
         }
 
 
-        /*render_text(renderer, entity_type_names[e->type], GET3(e->pos), 0.1f, 1);*/
+        /*render_text(renderer, renderer->arenas, entity_type_names[e->type], GET3(e->pos), 0.1f, 0.0f, TEXT_ALIGN_CENTER | TEXT_ALIGN_MIDDLE);*/
+        /* the player carries a lamp */
+        render_light(renderer->arenas, e->pos + v3{0.0f, 0.0f, 1.0f}, 4.0f, v3{1.0f, 0.8f, 0.6f});
         renderer->camera_pos = e->pos;
         renderer->camera_pos.z += RENDERER_CAMERA_HEIGHT;
 
@@ -663,9 +836,8 @@ GAME_MAIN_LOOP(main_loop) {
         #undef PLAYER_SKID
       } break;
 
-      case ENTITY_TYPE_WALL: {
-        render_cube(renderer, e->pos, e->hitbox);
-      } break;
+      case ENTITY_TYPE_WALL:
+        break;
 
       case ENTITY_TYPE_MONSTER:
         break;
@@ -680,18 +852,38 @@ GAME_MAIN_LOOP(main_loop) {
     e->animation_time += dt;
   }
 
+  /* Render the entities that are in view */
+  {
+    /* with GPU culling, entity_visible isn't used */
+    if (!renderer->gpu_culling) {
+      Frustum frustum = frustum_create(renderer->camera_pos, RENDERER_FOV, RENDERER_ASPECT, RENDERER_NEAR_Z, RENDERER_FAR_Z);
+
+      cullboxes_clear(&state->cull_boxes);
+      for (int i = 0; i < state->num_entities; ++i) {
+        Entity *e = state->entities + i;
+        cullboxes_push(&state->cull_boxes, e->pos + e->hitbox.x0, e->pos + e->hitbox.x1);
+      }
+      frustum_cull(&frustum, &state->cull_boxes, state->entity_visible);
+    }
+
+    /* before the jobs start, since this thread uses the first arena in them */
+    render_walls(renderer, renderer->arenas);
+
+    state->funs.parallel_for(render_entities_job, renderer, (state->num_entities + ENTITIES_PER_RENDER_JOB-1) / ENTITIES_PER_RENDER_JOB);
+  }
+
   #if 0
     puts("********* Entities *********");
     for (int i = 0; i < state->num_entities; ++i)
       print("%e\n", &state->entities[i]);
 
     puts("********* Sprite Vertices *********");
-    for (int i = 0; i < renderer->num_vertices; ++i)
-      print("%v3\n", &renderer->vertices[i].pos);
+    for (int i = 0; i < renderer->arenas[0].num_vertices; ++i)
+      printf("%f %f %f\n", renderer->arenas[0].vertices[i].pos[0] / RENDERER_POS_SCALE, renderer->arenas[0].vertices[i].pos[1] / RENDERER_POS_SCALE, renderer->arenas[0].vertices[i].pos[2] / RENDERER_POS_SCALE);
 
     puts("********* Text Vertices *********");
-    for (int i = 0; i < renderer->num_text_vertices; ++i)
-      printf("%f %f %f\n", renderer->text_vertices[i].pos.x, renderer->text_vertices[i].pos.y, renderer->text_vertices[i].pos.z);
+    for (int i = 0; i < renderer->arenas[0].num_text_vertices; ++i)
+      printf("%f %f %f\n", renderer->arenas[0].text_vertices[i].pos.x, renderer->arenas[0].text_vertices[i].pos.y, renderer->arenas[0].text_vertices[i].pos.z);
   #endif
   return input.was_pressed[BUTTON_START];
 }
@@ -0,0 +1,302 @@
+/**
+ * Sprite atlas packer
+ *
+ * Packs every sprite image listed in sprite_files into as few atlas pages as possible,
+ * so that sprites can be drawn together without switching textures.
+ *
+ * Packing only needs the image sizes, so the pages can be allocated before anything
+ * is decoded, and the sprites decoded straight into them, on any thread.
+ *
+ * Packing uses the skyline bottom-left heuristic: each page keeps track of the top edge
+ * of what has been placed so far, as a list of horizontal segments, and every image goes
+ * where its top ends up lowest. Images are packed tallest first, which keeps the skyline flat.
+ *
+ * Every image gets a border of ATLAS_PADDING pixels, filled with copies of its edge pixels,
+ * so that linear filtering and the first mip levels don't pick up the neighbours.
+ */
+
+static const char *sprite_files[] = {
+  "../../assets/spritesheet.png", /* SPRITE_PLAYER */
+};
+STATIC_ASSERT(ARRAY_LEN(sprite_files) == SPRITE_COUNT, all_sprite_files_defined);
+
+#define ATLAS_PADDING 2
+#define ATLAS_MAX_SKYLINE 256
+
+struct SkylineNode {
+  int x, y, w;
+};
+
+struct AtlasPage {
+  int w, h;
+  u8 *pixels; /* RGBA, w*h */
+
+  /* nodes are sorted on x, and together cover the whole width */
+  SkylineNode skyline[ATLAS_MAX_SKYLINE];
+  int num_nodes;
+};
+
+struct AtlasImage {
+  int w, h;
+  int page, x, y; /* of the padded rectangle */
+};
+
+static void atlas__page_init(AtlasPage *p) {
+  p->w = RENDERER_ATLAS_PAGE_SIZE;
+  p->h = RENDERER_ATLAS_PAGE_SIZE;
+  p->pixels = 0;
+  p->skyline[0].x = 0;
+  p->skyline[0].y = 0;
+  p->skyline[0].w = p->w;
+  p->num_nodes = 1;
+}
+
+/* Returns the y where a w wide rectangle fits on top of the skyline starting at node i, or -1 */
+static int atlas__skyline_fit(AtlasPage *p, int i, int w, int h) {
+  int x = p->skyline[i].x, y = 0, left = w;
+
+  if (x + w > p->w)
+    return -1;
+
+  for (; left > 0; ++i) {
+    y = max(y, p->skyline[i].y);
+    if (y + h > p->h)
+      return -1;
+    left -= p->skyline[i].w;
+  }
+  return y;
+}
+
+/* Places a w*h rectangle on the page. Returns false if it doesn't fit */
+static bool atlas__skyline_insert(AtlasPage *p, int w, int h, int *out_x, int *out_y) {
+  int i, best = -1, best_y = 0, best_x = 0, best_top = p->h + 1;
+  SkylineNode node;
+
+  if (p->num_nodes >= ATLAS_MAX_SKYLINE)
+    return false;
+
+  /* lowest top edge, and then leftmost */
+  for (i = 0; i < p->num_nodes; ++i) {
+    int y = atlas__skyline_fit(p, i, w, h);
+    if (y >= 0 && y + h < best_top) {
+      best = i;
+      best_x = p->skyline[i].x;
+      best_y = y;
+      best_top = y + h;
+    }
+  }
+  if (best < 0)
+    return false;
+
+  /* insert the new segment, and cut away whatever it covers */
+  node.x = best_x;
+  node.y = best_top;
+  node.w = w;
+  memmove(p->skyline + best + 1, p->skyline + best, (p->num_nodes - best) * sizeof(*p->skyline));
+  p->skyline[best] = node;
+  ++p->num_nodes;
+
+  for (i = best + 1; i < p->num_nodes; ) {
+    SkylineNode *n = p->skyline + i, *prev = p->skyline + i - 1;
+    int overlap = prev->x + prev->w - n->x;
+
+    if (overlap <= 0)
+      break;
+    if (overlap < n->w) {
+      n->x += overlap;
+      n->w -= overlap;
+      break;
+    }
+    memmove(n, n + 1, (p->num_nodes - i - 1) * sizeof(*p->skyline));
+    --p->num_nodes;
+  }
+
+  /* merge neighbours at the same height */
+  for (i = 0; i + 1 < p->num_nodes; ) {
+    if (p->skyline[i].y == p->skyline[i+1].y) {
+      p->skyline[i].w += p->skyline[i+1].w;
+      memmove(p->skyline + i + 1, p->skyline + i + 2, (p->num_nodes - i - 2) * sizeof(*p->skyline));
+      --p->num_nodes;
+    } else {
+      ++i;
+    }
+  }
+
+  *out_x = best_x;
+  *out_y = best_y;
+  return true;
+}
+
+/* Copies the image into its padded rectangle, and extends its edges into the padding */
+static void atlas__blit(AtlasPage *p, u8 *page_pixels, AtlasImage *img, const u8 *pixels) {
+  int x, y;
+
+  for (y = 0; y < img->h + 2*ATLAS_PADDING; ++y) {
+    int sy = clamp(y - ATLAS_PADDING, 0, img->h - 1);
+    u32 *dst = (u32*)page_pixels + (img->y + y) * p->w + img->x;
+    const u32 *src = (const u32*)pixels + sy * img->w;
+
+    for (x = 0; x < img->w + 2*ATLAS_PADDING; ++x)
+      dst[x] = src[clamp(x - ATLAS_PADDING, 0, img->w - 1)];
+  }
+}
+
+static int atlas__cmp_height(const void *a, const void *b) {
+  const AtlasImage *ia = *(const AtlasImage**)a, *ib = *(const AtlasImage**)b;
+  if (ia->h != ib->h)
+    return ib->h - ia->h;
+  return ib->w - ia->w;
+}
+
+struct AtlasLayout {
+  AtlasPage pages[RENDERER_MAX_ATLAS_PAGES];
+  int num_pages;
+  int h; /* of all pages */
+  AtlasImage images[SPRITE_COUNT];
+};
+
+/**
+ * Packs all sprites, only reading the image headers.
+ * Fills in the page and uv rectangle of every sprite.
+ * Pages are only as tall as the tallest of them needs to be, but at least RENDERER_ATLAS_MIN_HEIGHT
+ */
+static void atlas_pack(AtlasLayout *l, AtlasSprite *sprites) {
+  AtlasImage *order[SPRITE_COUNT];
+  AtlasPage *pages = l->pages;
+  int i, j, top;
+
+  l->num_pages = 0;
+  for (i = 0; i < SPRITE_COUNT; ++i) {
+    AtlasImage *img = l->images + i;
+
+    if (!stbi_info(sprite_files[i], &img->w, &img->h, 0))
+      die("Failed to load image %s: %s\n", sprite_files[i], stbi_failure_reason());
+    if (img->w + 2*ATLAS_PADDING > RENDERER_ATLAS_PAGE_SIZE || img->h + 2*ATLAS_PADDING > RENDERER_ATLAS_PAGE_SIZE)
+      die("Image %s is too big for the sprite atlas (%ix%i)\n", sprite_files[i], img->w, img->h);
+    order[i] = img;
+  }
+  qsort(order, SPRITE_COUNT, sizeof(*order), atlas__cmp_height);
+
+  /* place them in the first page they fit in */
+  for (i = 0; i < SPRITE_COUNT; ++i) {
+    AtlasImage *img = order[i];
+    int w = img->w + 2*ATLAS_PADDING, h = img->h + 2*ATLAS_PADDING;
+
+    for (img->page = 0; img->page < l->num_pages; ++img->page)
+      if (atlas__skyline_insert(pages + img->page, w, h, &img->x, &img->y))
+        break;
+
+    if (img->page == l->num_pages) {
+      if (l->num_pages >= RENDERER_MAX_ATLAS_PAGES)
+        die("Sprites don't fit in %i atlas pages\n", RENDERER_MAX_ATLAS_PAGES);
+      atlas__page_init(pages + l->num_pages);
+      if (!atlas__skyline_insert(pages + l->num_pages, w, h, &img->x, &img->y))
+        die("Failed to place sprite in an empty atlas page\n");
+      ++l->num_pages;
+    }
+  }
+
+  /* shrink the pages to the highest point of any skyline, they are layers of one texture */
+  top = RENDERER_ATLAS_MIN_HEIGHT;
+  for (i = 0; i < l->num_pages; ++i)
+    for (j = 0; j < pages[i].num_nodes; ++j)
+      top = max(top, pages[i].skyline[j].y);
+  l->h = next_pow2(top);
+  for (i = 0; i < l->num_pages; ++i)
+    pages[i].h = l->h;
+
+  for (i = 0; i < SPRITE_COUNT; ++i) {
+    AtlasImage *img = l->images + i;
+    AtlasPage *p = pages + img->page;
+
+    sprites[i].page = img->page;
+    sprites[i].uv.x0 = (float)(img->x + ATLAS_PADDING) / p->w;
+    sprites[i].uv.y0 = (float)(img->y + ATLAS_PADDING) / p->h;
+    sprites[i].uv.x1 = (float)(img->x + ATLAS_PADDING + img->w) / p->w;
+    sprites[i].uv.y1 = (float)(img->y + ATLAS_PADDING + img->h) / p->h;
+  }
+}
+
+/**
+ * Decodes a sprite into the pixels of its page, which are RGBA and p->w*p->h.
+ * Sprites never overlap, so different sprites can be loaded on different threads.
+ * stbi_set_flip_vertically_on_load(1) must have been called
+ */
+static void atlas_load_sprite(AtlasLayout *l, int sprite, u8 *page_pixels) {
+  AtlasImage *img = l->images + sprite;
+  u8 *pixels;
+  int w, h;
+
+  pixels = stbi_load(sprite_files[sprite], &w, &h, 0, 4);
+  if (!pixels)
+    die("Failed to load image %s: %s\n", sprite_files[sprite], stbi_failure_reason());
+  if (w != img->w || h != img->h)
+    die("Image %s changed size while loading\n", sprite_files[sprite]);
+
+  atlas__blit(l->pages + img->page, page_pixels, img, pixels);
+  stbi_image_free(pixels);
+}
+
+/* The number of mip levels of a w*h page, down to 1x1 */
+static int atlas_num_levels(int w, int h) {
+  int n;
+
+  for (n = 1; (max(w, h) >> (n-1)) > 1; ++n);
+  return n;
+}
+
+/* Halves the RGBA image, averaging 2x2 blocks, or 2x1 and 1x2 when a side is already 1, like glGenerateMipmap */
+static void atlas_downsample(const u8 *src, int w, int h, u8 *dst) {
+  int dw = max(w/2, 1), dh = max(h/2, 1), x, y, c;
+
+  for (y = 0; y < dh; ++y) {
+    for (x = 0; x < dw; ++x) {
+      int x0 = min(2*x, w-1), x1 = min(2*x + 1, w-1), y0 = min(2*y, h-1), y1 = min(2*y + 1, h-1);
+      for (c = 0; c < 4; ++c) {
+        int sum = src[(y0*w + x0)*4 + c] + src[(y0*w + x1)*4 + c] + src[(y1*w + x0)*4 + c] + src[(y1*w + x1)*4 + c];
+        dst[(y*dw + x)*4 + c] = (u8)((sum + 2) / 4);
+      }
+    }
+  }
+}
+
+/**
+ * Hash of sprite_files and of the contents of every file, which is all that goes into the atlas,
+ * so a prebuilt atlas (see flat_pack.cpp) can tell whether it is still what atlas_build would make.
+ * Returns 0 if a file can't be read
+ */
+static u64 atlas_hash() {
+  u64 h = FNV1A_BASIS;
+  MappedFile f;
+  int i, layout[2] = {ATLAS_PADDING, RENDERER_ATLAS_PAGE_SIZE};
+
+  h = fnv1a(h, layout, sizeof(layout));
+  for (i = 0; i < SPRITE_COUNT; ++i) {
+    if (!file_map(sprite_files[i], &f))
+      return 0;
+    h = fnv1a(h, sprite_files[i], (int)strlen(sprite_files[i]) + 1);
+    h = fnv1a(h, f.data, (int)f.size);
+    file_unmap(&f);
+  }
+  return h ? h : 1;
+}
+
+/**
+ * Packs and loads all sprites on the calling thread.
+ * The pages' pixels are allocated with malloc, and must be freed by the caller
+ */
+static void atlas_build(AtlasLayout *l, AtlasSprite *sprites) {
+  int i;
+
+  atlas_pack(l, sprites);
+  for (i = 0; i < l->num_pages; ++i) {
+    AtlasPage *p = l->pages + i;
+    p->pixels = (u8*)calloc(p->w * p->h, 4);
+    if (!p->pixels)
+      die("Failed to allocate atlas page: %s\n", flat_strerror(errno));
+  }
+
+  stbi_set_flip_vertically_on_load(1);
+  for (i = 0; i < SPRITE_COUNT; ++i)
+    atlas_load_sprite(l, i, l->pages[l->images[i].page].pixels);
+}
@@ -0,0 +1,122 @@
+#ifndef FLAT_CULL_H
+#define FLAT_CULL_H
+
+/**
+ * View frustum culling
+ *
+ * The camera has no rotation and looks down -z (see sprite_vertex.glsl), so the frustum
+ * is bounded by the near and far planes, and four planes going through the camera.
+ *
+ * Boxes are stored as a structure of arrays, so that four of them can be tested at once.
+ * Fill it up with cullboxes_push, and test them all with frustum_cull
+ */
+
+struct Frustum {
+  /* p is inside the plane if p.x*x + p.y*y + p.z*z + w >= 0 */
+  v4 planes[6];
+};
+
+#define CULL_MAX_BOXES 1024
+STATIC_ASSERT(CULL_MAX_BOXES % 4 == 0, cull_boxes_come_in_fours);
+
+struct CullBoxes {
+  float x0[CULL_MAX_BOXES], y0[CULL_MAX_BOXES], z0[CULL_MAX_BOXES];
+  float x1[CULL_MAX_BOXES], y1[CULL_MAX_BOXES], z1[CULL_MAX_BOXES];
+  int num;
+};
+
+static v4 plane_create(float x, float y, float z, float w) {
+  v4 p;
+  p.x = x, p.y = y, p.z = z, p.w = w;
+  return p;
+}
+
+static Frustum frustum_create(v3 camera, float fov, float aspect, float near_z, float far_z) {
+  Frustum f;
+  float tx, ty;
+
+  /* slope of the side planes */
+  tx = (float)tan(fov/2.0f);
+  ty = tx / aspect;
+
+  f.planes[0] = plane_create(0.0f, 0.0f, -1.0f, camera.z + near_z);
+  f.planes[1] = plane_create(0.0f, 0.0f, 1.0f, -camera.z - far_z);
+  f.planes[2] = plane_create(1.0f, 0.0f, -tx, -camera.x + tx*camera.z);
+  f.planes[3] = plane_create(-1.0f, 0.0f, -tx, camera.x + tx*camera.z);
+  f.planes[4] = plane_create(0.0f, 1.0f, -ty, -camera.y + ty*camera.z);
+  f.planes[5] = plane_create(0.0f, -1.0f, -ty, camera.y + ty*camera.z);
+  return f;
+}
+
+static void cullboxes_clear(CullBoxes *b) {
+  b->num = 0;
+}
+
+/* returns the index of the box, or -1 if full */
+static int cullboxes_push(CullBoxes *b, v3 x0, v3 x1) {
+  int i;
+
+  if (b->num >= CULL_MAX_BOXES)
+    return -1;
+
+  i = b->num++;
+  b->x0[i] = x0.x, b->y0[i] = x0.y, b->z0[i] = x0.z;
+  b->x1[i] = x1.x, b->y1[i] = x1.y, b->z1[i] = x1.z;
+  return i;
+}
+
+/**
+ * Writes 1 to visible[i] if box i intersects the frustum, 0 otherwise.
+ *
+ * For each plane we only need to check the corner of the box that lies furthest along the plane normal.
+ * Which corner that is only depends on the plane, so there is no per-box branching.
+ *
+ * This is conservative: big boxes near the corners of the frustum can be reported visible even if they are not
+ */
+static void frustum_cull(Frustum *f, CullBoxes *b, u8 *visible) {
+  int i, j;
+
+#ifdef HAS_SSE
+  /* The arrays are padded to a multiple of 4, so reading past num is fine */
+  for (i = 0; i < b->num; i += 4) {
+    __m128 inside = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+    int mask;
+
+    for (j = 0; j < ARRAY_LEN(f->planes); ++j) {
+      v4 p = f->planes[j];
+      __m128 x, y, z, d;
+
+      x = _mm_loadu_ps(p.x > 0.0f ? b->x1+i : b->x0+i);
+      y = _mm_loadu_ps(p.y > 0.0f ? b->y1+i : b->y0+i);
+      z = _mm_loadu_ps(p.z > 0.0f ? b->z1+i : b->z0+i);
+
+      d = _mm_set1_ps(p.w);
+      d = _mm_add_ps(d, _mm_mul_ps(x, _mm_set1_ps(p.x)));
+      d = _mm_add_ps(d, _mm_mul_ps(y, _mm_set1_ps(p.y)));
+      d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(p.z)));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(d, _mm_setzero_ps()));
+    }
+
+    mask = _mm_movemask_ps(inside);
+    for (j = 0; j < 4 && i+j < b->num; ++j)
+      visible[i+j] = (mask >> j) & 1;
+  }
+#else
+  for (i = 0; i < b->num; ++i) {
+    visible[i] = 1;
+    for (j = 0; j < ARRAY_LEN(f->planes); ++j) {
+      v4 p = f->planes[j];
+      float d = p.w;
+      d += p.x * (p.x > 0.0f ? b->x1[i] : b->x0[i]);
+      d += p.y * (p.y > 0.0f ? b->y1[i] : b->y0[i]);
+      d += p.z * (p.z > 0.0f ? b->z1[i] : b->z0[i]);
+      if (d < 0.0f) {
+        visible[i] = 0;
+        break;
+      }
+    }
+  }
+#endif
+}
+
+#endif /* FLAT_CULL_H */
@@ -0,0 +1,117 @@
+/**
+ * Dynamic resolution
+ *
+ * The scene is drawn into an offscreen framebuffer, in a viewport that is some fraction of
+ * the window, and then stretched over the window with glBlitFramebuffer. The framebuffer is
+ * allocated at the window size once, so changing the resolution only changes the viewport.
+ *
+ * The scale follows the slower of the CPU and GPU time of each frame. The CPU time is the render thread's work
+ * from dynres_begin_frame to dynres_end_frame, which is before the swap, so waiting for vsync never counts.
+ * The GPU time comes from the timestamps in flat_gltimer.cpp, which arrive a few frames late so that
+ * we never wait for them, and if the driver has no timer queries the CPU time is used alone.
+ * The number of pixels goes with the square of the scale, so over budget it drops by sqrt(budget/time)
+ * at once, and well under budget it creeps back up.
+ *
+ * FLAT_FRAME_BUDGET sets the budget in milliseconds, and FLAT_DYNRES=0 draws at full resolution.
+ */
+
+#define DYNRES_MIN_SCALE 0.5f
+#define DYNRES_DEFAULT_BUDGET_MS 14.0f /* leaves some room under 60 Hz */
+#define DYNRES_GROW_BELOW 0.8f /* of the budget */
+#define DYNRES_GROW_STEP 0.02f
+
+struct Dynres {
+  bool enabled;
+  GLuint framebuffer, color, depth;
+  int window_w, window_h;
+  int w, h;
+  float scale, budget_ms;
+
+  /* the last frame time we know of */
+  float frame_ms;
+  Uint64 frame_start;
+};
+
+static Dynres dynres;
+
+static void dynres__resize() {
+  /* multiples of 8 are kinder to the rasterizer */
+  dynres.w = max(8, (int)(dynres.window_w * dynres.scale) & ~7);
+  dynres.h = max(8, (int)(dynres.window_h * dynres.scale) & ~7);
+}
+
+/* Must be called with the context current, after the GL functions have been loaded */
+static void dynres_init(int window_w, int window_h) {
+  const char *budget = SDL_getenv("FLAT_FRAME_BUDGET");
+  const char *enabled = SDL_getenv("FLAT_DYNRES");
+
+  dynres.window_w = window_w;
+  dynres.window_h = window_h;
+  dynres.scale = 1.0f;
+  dynres.budget_ms = budget ? (float)atof(budget) : DYNRES_DEFAULT_BUDGET_MS;
+  if (dynres.budget_ms <= 0.0f)
+    die("FLAT_FRAME_BUDGET must be a positive number of milliseconds, not %s\n", budget);
+  dynres.enabled = !enabled || strcmp(enabled, "0");
+  dynres__resize();
+  if (!dynres.enabled)
+    return;
+
+  glGenRenderbuffers(1, &dynres.color);
+  glBindRenderbuffer(GL_RENDERBUFFER, dynres.color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, window_w, window_h);
+  glGenRenderbuffers(1, &dynres.depth);
+  glBindRenderbuffer(GL_RENDERBUFFER, dynres.depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, window_w, window_h);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &dynres.framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, dynres.framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, dynres.color);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dynres.depth);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    die("Offscreen framebuffer is incomplete\n");
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  gl_ok_or_die;
+}
+
+static void dynres__update(float frame_ms) {
+  float scale = dynres.scale;
+
+  dynres.frame_ms = frame_ms;
+  if (frame_ms > dynres.budget_ms)
+    scale *= (float)sqrt(dynres.budget_ms / frame_ms);
+  else if (frame_ms < dynres.budget_ms * DYNRES_GROW_BELOW)
+    scale += DYNRES_GROW_STEP;
+
+  dynres.scale = clamp(scale, DYNRES_MIN_SCALE, 1.0f);
+  dynres__resize();
+}
+
+/* Binds the offscreen framebuffer at the current resolution */
+static void dynres_begin_frame() {
+  if (!dynres.enabled)
+    return;
+
+  dynres.frame_start = SDL_GetPerformanceCounter();
+  glBindFramebuffer(GL_FRAMEBUFFER, dynres.framebuffer);
+  glViewport(0, 0, dynres.w, dynres.h);
+}
+
+/* Stretches the frame over the window, and picks the resolution of the next one */
+static void dynres_end_frame() {
+  float cpu_ms, gpu_ms;
+
+  if (!dynres.enabled)
+    return;
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, dynres.framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, dynres.w, dynres.h, 0, 0, dynres.window_w, dynres.window_h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  cpu_ms = (SDL_GetPerformanceCounter() - dynres.frame_start) * 1000.0f / SDL_GetPerformanceFrequency();
+  if (!gpu_timers.enabled)
+    dynres__update(cpu_ms);
+  else if (gpu_timer_frame_ms(&gpu_ms))
+    dynres__update(max(cpu_ms, gpu_ms));
+}
@@ -0,0 +1,134 @@
+/**
+ * Offline font baker
+ *
+ * Rasterizes the glyphs most text needs, with the same code and settings as the game's glyph cache,
+ * and writes them to a .glyphs file that glyphs_init maps instead of rasterizing at runtime
+ * (see flat_glyphs.cpp for the format).
+ *
+ * usage: flat_fontbake font.ttf out.glyphs
+ *
+ * Bakes printable ASCII, Latin-1 and the replacement character, at RENDERER_FONT_SIZE.
+ * Run it again whenever the font, RENDERER_FONT_SIZE or GLYPH_BAKE_VERSION changes,
+ * a stale file is ignored by the game.
+ */
+#include "flat_math.hpp"
+#include "flat_utils.cpp"
+#include "flat_platform_api.hpp"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#define STB_TRUETYPE_IMPLEMENTATION
+#define STBTT_STATIC
+#include "stb_truetype.hpp"
+
+#include "flat_pack.cpp"
+#include "flat_glyphs.cpp"
+
+static const u32 fontbake_ranges[][2] = {
+  {0x20, 0x7E},
+  {0xA0, 0xFF},
+  {UTF8_REPLACEMENT, UTF8_REPLACEMENT}
+};
+
+static Renderer renderer;
+
+static void fontbake_write(FILE *f, const void *data, size_t size, const char *filename) {
+  if (size && fwrite(data, size, 1, f) != 1)
+    die("Failed to write %s: %s\n", filename, flat_strerror(errno));
+}
+
+int main(int argc, char **argv) {
+  GlyphCache *c = &glyph_cache;
+  static u32 codepoints[GLYPH_MAX_CELLS];
+  static Glyph glyphs[GLYPH_MAX_CELLS];
+  GlyphBakeHeader header = {};
+  GlyphBakeKern *kerning;
+  int i, j, row, num_glyphs = 0, num_kerning = 0;
+  u32 cp;
+  FILE *f;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s font.ttf out.glyphs\n", argv[0]);
+    return 1;
+  }
+
+  /* a layer as big as the atlas can be, so the cells fit whatever the game's atlas ends up as */
+  renderer.atlas_size.x = RENDERER_ATLAS_PAGE_SIZE;
+  renderer.atlas_size.y = RENDERER_ATLAS_PAGE_SIZE;
+  glyphs_init(&renderer, 0, argv[1], RENDERER_FONT_SIZE);
+
+  for (i = 0; i < ARRAY_LEN(fontbake_ranges); ++i) {
+    for (cp = fontbake_ranges[i][0]; cp <= fontbake_ranges[i][1]; ++cp) {
+      if (!stbtt_FindGlyphIndex(&c->font, cp))
+        continue;
+      if (num_glyphs == c->num_cells)
+        die("More glyphs than cells\n");
+      /* every frame has room for a limited number of new glyphs */
+      if (num_glyphs % RENDERER_MAX_GLYPH_UPLOADS == 0)
+        glyphs_begin_frame(&renderer);
+      codepoints[num_glyphs] = cp;
+      glyphs[num_glyphs] = glyph_get(&renderer, cp);
+      ++num_glyphs;
+    }
+  }
+  if (renderer.num_glyphs_missing)
+    die("Ran out of cells for %i glyphs\n", renderer.num_glyphs_missing);
+
+  /* kerning between every pair, in bsearch order since the codepoints are sorted */
+  kerning = (GlyphBakeKern*)malloc(num_glyphs * num_glyphs * sizeof(*kerning));
+  if (!kerning) die("Failed to allocate memory for kerning: %s\n", flat_strerror(errno));
+  for (i = 0; i < num_glyphs; ++i) {
+    for (j = 0; j < num_glyphs; ++j) {
+      int k = stbtt_GetCodepointKernAdvance(&c->font, codepoints[i], codepoints[j]);
+      if (!k)
+        continue;
+      kerning[num_kerning].first = codepoints[i];
+      kerning[num_kerning].second = codepoints[j];
+      kerning[num_kerning].advance = k * c->scale;
+      ++num_kerning;
+    }
+  }
+
+  header.magic = GLYPH_BAKE_MAGIC;
+  header.version = GLYPH_BAKE_VERSION;
+  header.height = RENDERER_FONT_SIZE;
+  header.sdf_padding = GLYPH_SDF_PADDING;
+  header.sdf_onedge = GLYPH_SDF_ONEDGE;
+  header.sdf_scale = GLYPH_SDF_SCALE;
+  header.cell_w = c->cell_w;
+  header.cell_h = c->cell_h;
+  header.num_glyphs = num_glyphs;
+  header.num_kerning = num_kerning;
+  header.ascent = c->ascent;
+  header.descent = c->descent;
+  header.line_gap = c->line_gap;
+  header.ttf_size = (u32)c->ttf_file.size;
+  header.ttf_hash = fnv1a(FNV1A_BASIS, c->ttf_file.data, (int)c->ttf_file.size);
+
+  f = flat_fopen(argv[2], "wb");
+  if (!f) die("Failed to open %s: %s\n", argv[2], flat_strerror(errno));
+  fontbake_write(f, &header, sizeof(header), argv[2]);
+  for (i = 0; i < num_glyphs; ++i) {
+    GlyphBakeGlyph b;
+    b.codepoint = codepoints[i];
+    b.w = (u16)(glyphs[i].x1 - glyphs[i].x0);
+    b.h = (u16)(glyphs[i].y1 - glyphs[i].y0);
+    b.offset_x = glyphs[i].offset_x;
+    b.offset_y = glyphs[i].offset_y;
+    b.advance = glyphs[i].advance;
+    fontbake_write(f, &b, sizeof(b), argv[2]);
+  }
+  fontbake_write(f, kerning, num_kerning * sizeof(*kerning), argv[2]);
+  /* the whole cell, which starts a pixel up and left of the glyph */
+  for (i = 0; i < num_glyphs; ++i)
+    for (row = 0; row < c->cell_h; ++row)
+      fontbake_write(f, c->pixels + (glyphs[i].y0 - 1 + row)*c->w + glyphs[i].x0 - 1, c->cell_w, argv[2]);
+  if (fclose(f))
+    die("Failed to write %s: %s\n", argv[2], flat_strerror(errno));
+
+  printf("baked %i glyphs of %ix%i and %i kerning pairs into %s\n", num_glyphs, c->cell_w, c->cell_h, num_kerning, argv[2]);
+  free(kerning);
+  return 0;
+}
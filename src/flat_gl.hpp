@@ -16,10 +16,14 @@
 #define GL_GLEXT_VERSION 20171125
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef char GLchar;
 typedef ptrdiff_t GLsizeiptr;
 typedef ptrdiff_t GLintptr;
+typedef uint64_t GLuint64;
+typedef int64_t GLint64;
+typedef struct __GLsync *GLsync;
 
 #define GL_DYNAMIC_DRAW                   0x88E8
 #define GL_ARRAY_BUFFER                   0x8892
@@ -28,6 +32,63 @@ typedef ptrdiff_t GLintptr;
 #define GL_VERTEX_SHADER                  0x8B31
 #define GL_COMPILE_STATUS                 0x8B81
 #define GL_FRAGMENT_SHADER                0x8B30
+#define GL_STATIC_DRAW                    0x88E4
+#define GL_ELEMENT_ARRAY_BUFFER           0x8893
+#define GL_MAJOR_VERSION                  0x821B
+#define GL_MINOR_VERSION                  0x821C
+
+#define GL_STREAM_DRAW                    0x88E0
+#define GL_PIXEL_UNPACK_BUFFER            0x88EC
+#define GL_MAP_WRITE_BIT                  0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT      0x0008
+#define GL_SYNC_GPU_COMMANDS_COMPLETE     0x9117
+#define GL_ALREADY_SIGNALED               0x911A
+#define GL_TIMEOUT_EXPIRED                0x911B
+#define GL_CONDITION_SATISFIED            0x911C
+#define GL_WAIT_FAILED                    0x911D
+#define GL_SYNC_FLUSH_COMMANDS_BIT        0x00000001
+
+#define GL_TEXTURE_2D_ARRAY               0x8C1A
+#define GL_TEXTURE_BUFFER                 0x8C2A
+#define GL_RGBA32F                        0x8814
+#define GL_RG32UI                         0x823C
+#define GL_R16UI                          0x8234
+
+#define GL_FRAMEBUFFER                    0x8D40
+#define GL_READ_FRAMEBUFFER               0x8CA8
+#define GL_DRAW_FRAMEBUFFER               0x8CA9
+#define GL_RENDERBUFFER                   0x8D41
+#define GL_COLOR_ATTACHMENT0              0x8CE0
+#define GL_DEPTH_ATTACHMENT               0x8D00
+#define GL_FRAMEBUFFER_COMPLETE           0x8CD5
+#define GL_DEPTH_COMPONENT24              0x81A6
+
+#define GL_TIME_ELAPSED                   0x88BF
+#define GL_TIMESTAMP                      0x8E28
+#define GL_QUERY_COUNTER_BITS             0x8864
+#define GL_QUERY_RESULT                   0x8866
+#define GL_QUERY_RESULT_AVAILABLE         0x8867
+
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH          0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS     0x87FE
+
+#define GL_COMPUTE_SHADER                 0x91B9
+#define GL_SHADER_STORAGE_BUFFER          0x90D2
+#define GL_DRAW_INDIRECT_BUFFER           0x8F3F
+#define GL_COMMAND_BARRIER_BIT            0x00000040
+#define GL_SHADER_STORAGE_BARRIER_BIT     0x00002000
+
+#define GL_DEBUG_OUTPUT                   0x92E0
+#define GL_DEBUG_OUTPUT_SYNCHRONOUS       0x8242
+#define GL_DEBUG_TYPE_ERROR               0x824C
+#define GL_DEBUG_SEVERITY_HIGH            0x9146
+#define GL_DEBUG_SEVERITY_MEDIUM          0x9147
+#define GL_DEBUG_SEVERITY_LOW             0x9148
+#define GL_DEBUG_SEVERITY_NOTIFICATION    0x826B
+#define GL_DONT_CARE                      0x1100
+
+typedef void (GLAPI *GLDEBUGPROC)(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *message, const void *userParam);
 
 #define GL_TEXTURE0                       0x84C0
 #define GL_TEXTURE1                       0x84C1
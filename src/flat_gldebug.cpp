@@ -0,0 +1,55 @@
+/**
+ * GL error reporting
+ *
+ * In debug builds, drivers that support KHR_debug report errors through gl_debug_callback.
+ * The callback is asynchronous, so nothing ever waits on the GPU to find out about errors,
+ * but an error can be reported some calls after the one that caused it.
+ *
+ * Without KHR_debug, debug builds fall back to glGetError: gl_ok_or_die at load time,
+ * and gl_errors_sample once every GL_ERROR_SAMPLE_FRAMES frames in the frame loop.
+ *
+ * Release builds don't check for errors at all.
+ */
+
+#define GL_ERROR_SAMPLE_FRAMES 60
+
+static void GLAPI gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *message, const void *user) {
+  FILE *f;
+
+  if (type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH)
+    die("GL error (%u): %s\n", id, message);
+
+  f = get_log_file();
+  fprintf(f, "GL: %s\n", message);
+  fflush(f);
+}
+
+/* Must be called with the context current, after the GL functions have been loaded */
+static void gl_debug_init() {
+#ifdef DEBUG
+  if (!SDL_GL_ExtensionSupported("GL_KHR_debug"))
+    return;
+
+  /* optional, so don't die if they are missing */
+  #define GL_FUN(ret, name, par) \
+    *(void**) (&name) = (void*)SDL_GL_GetProcAddress(#name); \
+    if (!name) return;
+  #include "flat_glfuns_ext.incl"
+  #undef GL_FUN
+
+  glEnable(GL_DEBUG_OUTPUT);
+  glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, 0, GL_FALSE);
+  glDebugMessageCallback(gl_debug_callback, 0);
+  gl_debug_output = true;
+#endif
+}
+
+/* Call once per frame, only checks glGetError every now and then */
+static void gl_errors_sample() {
+#ifdef DEBUG
+  static int frame;
+
+  if (!gl_debug_output && ++frame % GL_ERROR_SAMPLE_FRAMES == 0)
+    _gl_ok_or_die(__FILE__, __LINE__);
+#endif
+}
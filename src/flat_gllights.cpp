@@ -0,0 +1,83 @@
+/**
+ * Lights on the GPU
+ *
+ * The lights and their clusters, binned by flat_lights.cpp, go to the shaders as three buffer textures,
+ * since GL 3.3 has no storage buffers:
+ *
+ *   - lights, two RGBA32F texels per RenderLight, position and radius, then color
+ *   - light_clusters, one RG32UI texel per LightCluster, its first index and count
+ *   - light_indices, one R16UI texel per index into lights
+ *
+ * They stay bound to their own texture units, so the atlas keeps unit 0, and each frame only
+ * replaces their contents, as much as is used.
+ */
+
+enum GlLightBuffer {
+  GL_LIGHTS_LIGHTS,
+  GL_LIGHTS_CLUSTERS,
+  GL_LIGHTS_INDICES,
+  GL_LIGHTS_COUNT
+};
+
+struct GlLights {
+  GLuint buffers[GL_LIGHTS_COUNT];
+  GLuint textures[GL_LIGHTS_COUNT];
+};
+
+static GlLights gl_lights;
+
+/* texture unit and sampler name of every buffer */
+static const int gl_lights__units[GL_LIGHTS_COUNT] = {1, 2, 3};
+static const char *gl_lights__samplers[GL_LIGHTS_COUNT] = {"lights", "light_clusters", "light_indices"};
+
+/* Must be called with the context current, after the GL functions have been loaded */
+static void gl_lights_init() {
+  GLenum formats[GL_LIGHTS_COUNT] = {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+  GLsizeiptr sizes[GL_LIGHTS_COUNT] = {
+    sizeof(((LightClusters*)0)->lights),
+    sizeof(((LightClusters*)0)->clusters),
+    sizeof(((LightClusters*)0)->indices)
+  };
+  int i;
+
+  glGenBuffers(GL_LIGHTS_COUNT, gl_lights.buffers);
+  glGenTextures(GL_LIGHTS_COUNT, gl_lights.textures);
+  for (i = 0; i < GL_LIGHTS_COUNT; ++i) {
+    glBindBuffer(GL_TEXTURE_BUFFER, gl_lights.buffers[i]);
+    glBufferData(GL_TEXTURE_BUFFER, sizes[i], 0, GL_DYNAMIC_DRAW);
+    glActiveTexture(GL_TEXTURE0 + gl_lights__units[i]);
+    glBindTexture(GL_TEXTURE_BUFFER, gl_lights.textures[i]);
+    glTexBuffer(GL_TEXTURE_BUFFER, formats[i], gl_lights.buffers[i]);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  glActiveTexture(GL_TEXTURE0);
+  gl_ok_or_die;
+}
+
+/* Points the light samplers of a program at their units */
+static void gl_lights_shader_init(GLuint program) {
+  int i;
+
+  glUseProgram(program);
+  for (i = 0; i < GL_LIGHTS_COUNT; ++i)
+    glUniform1i(glGetUniformLocation(program, gl_lights__samplers[i]), gl_lights__units[i]);
+  gl_ok_or_die;
+}
+
+static void gl_lights_upload(const LightClusters *c) {
+  glBindBuffer(GL_TEXTURE_BUFFER, gl_lights.buffers[GL_LIGHTS_LIGHTS]);
+  glBufferSubData(GL_TEXTURE_BUFFER, 0, c->num_lights * sizeof(*c->lights), c->lights);
+  glBindBuffer(GL_TEXTURE_BUFFER, gl_lights.buffers[GL_LIGHTS_CLUSTERS]);
+  glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(c->clusters), c->clusters);
+  glBindBuffer(GL_TEXTURE_BUFFER, gl_lights.buffers[GL_LIGHTS_INDICES]);
+  glBufferSubData(GL_TEXTURE_BUFFER, 0, c->num_indices * sizeof(*c->indices), c->indices);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+/* Binds the buffer textures to their units, which the state cache skips after the first frame */
+static void gl_lights_bind() {
+  int i;
+
+  for (i = 0; i < GL_LIGHTS_COUNT; ++i)
+    gls_bind_texture(gl_lights__units[i], GL_TEXTURE_BUFFER, gl_lights.textures[i]);
+}
@@ -0,0 +1,210 @@
+/**
+ * GL state cache
+ *
+ * Thin wrappers over the GL functions that shadow the bound program, vertex array,
+ * array buffer and textures, and the uniform values of every program,
+ * and skip the call when it wouldn't change anything.
+ *
+ * Every wrapper counts how often it was called and how often it skipped the call,
+ * so we can see how much redundant state the renderer sends.
+ *
+ * The cache must own the state: anything bound with the raw GL functions while it is in use
+ * has to be followed by gls_reset. It must only be used from the thread that owns the context.
+ */
+
+enum GlsCall {
+  GLS_PROGRAM,
+  GLS_VERTEX_ARRAY,
+  GLS_BUFFER,
+  GLS_TEXTURE,
+  GLS_UNIFORM,
+  GLS_COUNT
+};
+
+static const char *gls_call_names[] = {
+  "program",
+  "vertex array",
+  "buffer",
+  "texture",
+  "uniform",
+};
+STATIC_ASSERT(ARRAY_LEN(gls_call_names) == GLS_COUNT, all_gls_calls_named);
+
+struct GlsStats {
+  long calls[GLS_COUNT];
+  long skipped[GLS_COUNT];
+};
+
+/**
+ * Uniform values are remembered as a hash of their bytes, per program and location,
+ * so that arrays cost no more to track than scalars.
+ * The table is open addressed, and is simply cleared if it fills up.
+ */
+#define GLS_MAX_UNIFORMS 256
+STATIC_ASSERT((GLS_MAX_UNIFORMS & (GLS_MAX_UNIFORMS-1)) == 0, gls_max_uniforms_is_pow2);
+
+struct GlsUniform {
+  u32 key; /* 0 if empty */
+  u64 hash;
+};
+
+#define GLS_MAX_TEXTURE_UNITS 8
+#define GLS_UNKNOWN 0xffffffff
+
+struct GlState {
+  GLuint program, vertex_array, array_buffer;
+  GLenum active_texture;
+  GLuint textures[GLS_MAX_TEXTURE_UNITS];
+
+  GlsUniform uniforms[GLS_MAX_UNIFORMS];
+  int num_uniforms;
+
+  GlsStats stats;
+};
+
+static GlState gls;
+
+/* Forgets all state, so that the next call of every kind goes through */
+static void gls_reset() {
+  int i;
+
+  gls.program = GLS_UNKNOWN;
+  gls.vertex_array = GLS_UNKNOWN;
+  gls.array_buffer = GLS_UNKNOWN;
+  gls.active_texture = GLS_UNKNOWN;
+  for (i = 0; i < GLS_MAX_TEXTURE_UNITS; ++i)
+    gls.textures[i] = GLS_UNKNOWN;
+  memset(gls.uniforms, 0, sizeof(gls.uniforms));
+  gls.num_uniforms = 0;
+}
+
+/* Returns true if the call should be made */
+static bool gls__set(GlsCall call, GLuint *current, GLuint value) {
+  ++gls.stats.calls[call];
+  if (*current == value) {
+    ++gls.stats.skipped[call];
+    return false;
+  }
+  *current = value;
+  return true;
+}
+
+static void gls_use_program(GLuint program) {
+  if (gls__set(GLS_PROGRAM, &gls.program, program))
+    glUseProgram(program);
+}
+
+static void gls_bind_vertex_array(GLuint vertex_array) {
+  if (gls__set(GLS_VERTEX_ARRAY, &gls.vertex_array, vertex_array))
+    glBindVertexArray(vertex_array);
+}
+
+/* Only GL_ARRAY_BUFFER is tracked, other targets are passed through */
+static void gls_bind_buffer(GLenum target, GLuint buffer) {
+  if (target != GL_ARRAY_BUFFER) {
+    ++gls.stats.calls[GLS_BUFFER];
+    glBindBuffer(target, buffer);
+    return;
+  }
+  if (gls__set(GLS_BUFFER, &gls.array_buffer, buffer))
+    glBindBuffer(target, buffer);
+}
+
+/**
+ * Binds a texture to a texture unit, only switching the active unit if needed.
+ * Only one texture is tracked per unit, so a unit should only be used with one target
+ */
+static void gls_bind_texture(int unit, GLenum target, GLuint texture) {
+  if (unit < 0 || unit >= GLS_MAX_TEXTURE_UNITS)
+    die("Texture unit %i is out of range\n", unit);
+  if (!gls__set(GLS_TEXTURE, gls.textures + unit, texture))
+    return;
+  if (gls.active_texture != (GLenum)(GL_TEXTURE0 + unit)) {
+    gls.active_texture = GL_TEXTURE0 + unit;
+    glActiveTexture(gls.active_texture);
+  }
+  glBindTexture(target, texture);
+}
+
+/* Returns true if the uniform of the current program has to be set */
+static bool gls__uniform_changed(GLint location, const void *data, int size) {
+  GlsUniform *u;
+  u32 key, i;
+  u64 hash;
+
+  ++gls.stats.calls[GLS_UNIFORM];
+
+  /* GL ignores these, so we might as well not call it */
+  if (location < 0 || gls.program == GLS_UNKNOWN) {
+    ++gls.stats.skipped[GLS_UNIFORM];
+    return location >= 0;
+  }
+
+  key = (gls.program << 16 | (u32)location) + 1;
+  hash = fnv1a(FNV1A_BASIS, data, size);
+
+  for (i = key * 2654435761u;; ++i) {
+    u = gls.uniforms + (i & (GLS_MAX_UNIFORMS-1));
+    if (u->key == key || !u->key)
+      break;
+  }
+
+  if (u->key == key && u->hash == hash) {
+    ++gls.stats.skipped[GLS_UNIFORM];
+    return false;
+  }
+
+  if (!u->key) {
+    /* keep at least one slot empty, so that lookups terminate */
+    if (gls.num_uniforms + 1 >= GLS_MAX_UNIFORMS) {
+      memset(gls.uniforms, 0, sizeof(gls.uniforms));
+      gls.num_uniforms = 0;
+      for (i = key * 2654435761u; gls.uniforms[i & (GLS_MAX_UNIFORMS-1)].key; ++i);
+      u = gls.uniforms + (i & (GLS_MAX_UNIFORMS-1));
+    }
+    ++gls.num_uniforms;
+  }
+  u->key = key;
+  u->hash = hash;
+  return true;
+}
+
+static void gls_uniform1i(GLint location, GLint x) {
+  if (gls__uniform_changed(location, &x, sizeof(x)))
+    glUniform1i(location, x);
+}
+
+static void gls_uniform1f(GLint location, GLfloat x) {
+  if (gls__uniform_changed(location, &x, sizeof(x)))
+    glUniform1f(location, x);
+}
+
+static void gls_uniform2f(GLint location, GLfloat x, GLfloat y) {
+  GLfloat v[] = {x, y};
+  if (gls__uniform_changed(location, v, sizeof(v)))
+    glUniform2f(location, x, y);
+}
+
+static void gls_uniform3f(GLint location, GLfloat x, GLfloat y, GLfloat z) {
+  GLfloat v[] = {x, y, z};
+  if (gls__uniform_changed(location, v, sizeof(v)))
+    glUniform3f(location, x, y, z);
+}
+
+static void gls_uniform1fv(GLint location, GLsizei count, const GLfloat *v) {
+  if (gls__uniform_changed(location, v, count * sizeof(*v)))
+    glUniform1fv(location, count, v);
+}
+
+static void gls_uniform4fv(GLint location, GLsizei count, const GLfloat *v) {
+  if (gls__uniform_changed(location, v, count * 4 * sizeof(*v)))
+    glUniform4fv(location, count, v);
+}
+
+static void gls_stats_print(FILE *f, GlsStats *stats) {
+  int i;
+
+  for (i = 0; i < GLS_COUNT; ++i)
+    fprintf(f, "  %-12s %10li calls, %10li skipped (%.1f%%)\n", gls_call_names[i], stats->calls[i], stats->skipped[i],
+      stats->calls[i] ? 100.0 * stats->skipped[i] / stats->calls[i] : 0.0);
+}
@@ -0,0 +1,134 @@
+/**
+ * GPU pass timings
+ *
+ * Each frame puts a GL_TIMESTAMP query in front of every pass and one at the end, so a pass
+ * takes from its timestamp to the next one. GL_TIME_ELAPSED queries can't nest or overlap, so only
+ * one pass at a time could be timed with them. Timestamps are single points with no such limit,
+ * so any number of them can be taken in a frame.
+ *
+ * The queries come from a pool of GPU_TIMER_FRAMES frames. A frame's results are read when
+ * its slot comes round again, which is late enough that they are almost always there.
+ * If they are not, the frame is dropped rather than waited for.
+ *
+ * Results go to profile_record, with the GPU clock mapped onto the profiler's.
+ */
+
+#define GPU_TIMER_FRAMES 4
+#define GPU_TIMER_MAX_MARKS 32
+
+struct GpuTimerFrame {
+  GLuint queries[GPU_TIMER_MAX_MARKS];
+  ProfileStat passes[GPU_TIMER_MAX_MARKS]; /* the pass that starts at each mark, the last one ends the frame */
+  int num_marks;
+  bool pending;
+};
+
+struct GpuTimers {
+  bool enabled;
+  GpuTimerFrame frames[GPU_TIMER_FRAMES];
+  int frame;
+  double gpu_to_cpu_ms; /* added to GPU timestamps to get profiler time */
+  ProfileStat current;
+
+  /* the GPU time of the last frame read back, see gpu_timer_frame_ms */
+  float frame_ms;
+  bool has_new_frame;
+  long dropped;
+};
+
+static GpuTimers gpu_timers;
+
+/* Must be called with the context current, after profile_init */
+static void gpu_timer_init() {
+  GLint bits = 0;
+  GLint64 now;
+  int i;
+
+  glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+  gpu_timers.enabled = bits > 0;
+  if (!gpu_timers.enabled)
+    return;
+
+  for (i = 0; i < GPU_TIMER_FRAMES; ++i)
+    glGenQueries(GPU_TIMER_MAX_MARKS, gpu_timers.frames[i].queries);
+
+  glGetInteger64v(GL_TIMESTAMP, &now);
+  gpu_timers.gpu_to_cpu_ms = profile_now() - now / 1000000.0;
+  gl_ok_or_die;
+}
+
+static void gpu_timer__collect(GpuTimerFrame *f) {
+  GLuint64 t[GPU_TIMER_MAX_MARKS];
+  GLint available = 0;
+  int i;
+
+  f->pending = false;
+  if (f->num_marks < 2)
+    return;
+
+  /* the last query finishes last */
+  glGetQueryObjectiv(f->queries[f->num_marks-1], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available) {
+    ++gpu_timers.dropped;
+    return;
+  }
+
+  for (i = 0; i < f->num_marks; ++i)
+    glGetQueryObjectui64v(f->queries[i], GL_QUERY_RESULT, t + i);
+
+  for (i = 0; i + 1 < f->num_marks; ++i)
+    profile_record(f->passes[i], PROFILE_THREAD_GPU, t[i] / 1000000.0 + gpu_timers.gpu_to_cpu_ms, (t[i+1] - t[i]) / 1000000.0);
+
+  gpu_timers.frame_ms = (float)((t[f->num_marks-1] - t[0]) / 1000000.0);
+  gpu_timers.has_new_frame = true;
+  profile_record(PROFILE_GPU_FRAME, PROFILE_THREAD_GPU, t[0] / 1000000.0 + gpu_timers.gpu_to_cpu_ms, gpu_timers.frame_ms);
+}
+
+/* Starts the next pass, unless it is the one we're already in */
+static void gpu_timer_pass(ProfileStat pass) {
+  GpuTimerFrame *f = gpu_timers.frames + gpu_timers.frame;
+
+  if (!gpu_timers.enabled || pass == gpu_timers.current)
+    return;
+  /* keep the last mark for the end of the frame */
+  if (f->num_marks + 1 >= GPU_TIMER_MAX_MARKS)
+    return;
+
+  glQueryCounter(f->queries[f->num_marks], GL_TIMESTAMP);
+  f->passes[f->num_marks++] = pass;
+  gpu_timers.current = pass;
+}
+
+static void gpu_timer_begin_frame() {
+  GpuTimerFrame *f;
+
+  if (!gpu_timers.enabled)
+    return;
+
+  f = gpu_timers.frames + gpu_timers.frame;
+  if (f->pending)
+    gpu_timer__collect(f);
+  f->num_marks = 0;
+  gpu_timers.current = PROFILE_COUNT;
+}
+
+static void gpu_timer_end_frame() {
+  GpuTimerFrame *f = gpu_timers.frames + gpu_timers.frame;
+
+  if (!gpu_timers.enabled)
+    return;
+
+  glQueryCounter(f->queries[f->num_marks], GL_TIMESTAMP);
+  f->passes[f->num_marks++] = PROFILE_COUNT;
+  f->pending = true;
+  gpu_timers.frame = (gpu_timers.frame + 1) % GPU_TIMER_FRAMES;
+}
+
+/* Returns true, once, for every frame whose GPU time has been read back */
+static bool gpu_timer_frame_ms(float *ms) {
+  if (!gpu_timers.has_new_frame)
+    return false;
+  gpu_timers.has_new_frame = false;
+  *ms = gpu_timers.frame_ms;
+  return true;
+}
@@ -0,0 +1,453 @@
+/**
+ * Dynamic glyph cache
+ *
+ * Instead of baking a fixed range of characters up front, glyphs are rasterized with stb_truetype
+ * the first time the game asks for them, into the RENDER_TEXTURE_TEXT layer of the atlas.
+ *
+ * Glyphs are stored as signed distance fields, made at RENDERER_FONT_SIZE: every texel holds the distance
+ * to the outline, GLYPH_SDF_ONEDGE on it and GLYPH_SDF_SCALE more per texel further inside,
+ * out to GLYPH_SDF_PADDING texels around the glyph. text_fragment.glsl turns the distance back into
+ * an edge that is one pixel wide at whatever height the text is drawn, so one set of glyphs serves
+ * every size, and outlines and shadows only cost another look at the distance.
+ * The layer is cut into a grid of cells, each as big as the font's bounding box, so any glyph
+ * fits in any cell and a cell can be handed to a new glyph without packing the layer again.
+ *
+ * Cells are kept in least recently used order. When all cells are taken, the new glyph gets the
+ * one that has gone unused the longest, but never one that a frame in flight has used.
+ * Glyphs that are drawn without glyph_get, like the text cache's meshes, are kept in that order with glyphs_touch.
+ *
+ * The platform keeps the pixels of the layer in memory. Every glyph rasterized during a frame
+ * adds its cell to the frame's glyph_uploads, and render_queue_build copies those cells out,
+ * so the backends only ever update the rectangles that changed. Since the cells of the frames in flight
+ * are never reused, that copy can't race with the game rasterizing the next frame, and the texture
+ * only changes under a glyph once no frame draws it any more.
+ *
+ * The glyphs most text uses can be baked offline by flat_fontbake into a .glyphs file, which holds
+ * their cells as they would be rasterized, their metrics, and the kerning between them.
+ * glyphs_init maps that file (or finds it in the asset pack) and puts its cells straight into the layer, and only loads the TTF
+ * once a glyph that wasn't baked is asked for. Without the file, or if it is from another version,
+ * size or font, everything comes from the TTF as before. The TTF is mapped up front to check the last,
+ * since the bake keeps its size and hash.
+ *
+ * The game calls glyph_get through Funs, from the main thread only.
+ */
+
+#define GLYPH_MAX_CELLS 4096
+#define GLYPH_BUCKETS 1024
+#define GLYPH_FRAMES_IN_FLIGHT 2 /* the frame being simulated, and the one being drawn */
+/* same as text_fragment.glsl and swr__shade_text */
+#define GLYPH_SDF_PADDING 6
+#define GLYPH_SDF_ONEDGE 128
+#define GLYPH_SDF_SCALE 20.0f
+STATIC_ASSERT((GLYPH_BUCKETS & (GLYPH_BUCKETS-1)) == 0, glyph_buckets_is_pow2);
+
+/**
+ * The .glyphs file, little endian, which is
+ *
+ *   GlyphBakeHeader
+ *   GlyphBakeGlyph glyphs[num_glyphs], by codepoint
+ *   GlyphBakeKern kerning[num_kerning], by first and then second codepoint
+ *   u8 cells[num_glyphs][cell_h][cell_w]
+ *
+ * Bump GLYPH_BAKE_VERSION whenever it, or the way glyphs are rasterized, changes
+ */
+#define GLYPH_BAKE_MAGIC 0x48504c47 /* "GLPH" */
+#define GLYPH_BAKE_VERSION 3
+
+struct GlyphBakeHeader {
+  u32 magic, version;
+  float height;
+  i32 sdf_padding, sdf_onedge;
+  float sdf_scale;
+  i32 cell_w, cell_h;
+  i32 num_glyphs, num_kerning;
+  float ascent, descent, line_gap;
+  /* of the TTF it was baked from */
+  u32 ttf_size;
+  u64 ttf_hash;
+};
+
+/* The glyph is at 1,1 in its cell */
+struct GlyphBakeGlyph {
+  u32 codepoint;
+  u16 w, h;
+  float offset_x, offset_y, advance;
+};
+
+struct GlyphBakeKern {
+  u32 first, second;
+  float advance;
+};
+
+STATIC_ASSERT(sizeof(GlyphBakeHeader) == 64, glyph_bake_header_is_packed);
+STATIC_ASSERT(sizeof(GlyphBakeGlyph) == 20, glyph_bake_glyph_is_packed);
+STATIC_ASSERT(sizeof(GlyphBakeKern) == 12, glyph_bake_kern_is_packed);
+
+struct GlyphCell {
+  u32 codepoint;
+  bool used;
+  Glyph glyph;
+  u32 last_used; /* frame */
+
+  /* the next cell in the same bucket, and the neighbours in lru order, or -1 */
+  int next;
+  int lru_prev, lru_next;
+};
+
+struct GlyphCache {
+  /* the font, loaded the first time a glyph isn't baked */
+  const char *ttf_filename;
+  float height;
+  Asset ttf_file;
+  const u8 *ttf;
+  stbtt_fontinfo font;
+  float scale;
+  float ascent, descent, line_gap;
+
+  /* the baked glyphs, if any */
+  Asset bake;
+  const GlyphBakeKern *kerning;
+  int num_kerning;
+
+  /* the layer */
+  u8 *pixels;
+  int w, h;
+  int cell_w, cell_h, cols, num_cells;
+
+  GlyphCell cells[GLYPH_MAX_CELLS];
+  int buckets[GLYPH_BUCKETS];
+  int lru_first, lru_last; /* most recently used first */
+  u32 frame, generation;
+
+  /* stats */
+  long rasterized, evicted;
+};
+
+static GlyphCache glyph_cache;
+
+static int glyphs__bucket(u32 codepoint) {
+  return (int)((codepoint * 2654435761u) >> 22) & (GLYPH_BUCKETS-1);
+}
+
+static void glyphs__unlink(GlyphCache *c, int i) {
+  GlyphCell *cell = c->cells + i;
+
+  if (cell->lru_prev >= 0) c->cells[cell->lru_prev].lru_next = cell->lru_next;
+  else c->lru_first = cell->lru_next;
+  if (cell->lru_next >= 0) c->cells[cell->lru_next].lru_prev = cell->lru_prev;
+  else c->lru_last = cell->lru_prev;
+}
+
+/* Moves the cell to the front of the lru order */
+static void glyphs__touch(GlyphCache *c, int i) {
+  GlyphCell *cell = c->cells + i;
+
+  cell->last_used = c->frame;
+  if (c->lru_first == i)
+    return;
+  glyphs__unlink(c, i);
+  cell->lru_prev = -1;
+  cell->lru_next = c->lru_first;
+  c->cells[c->lru_first].lru_prev = i;
+  c->lru_first = i;
+}
+
+/* Drops the glyph in the cell from its bucket */
+static void glyphs__evict(GlyphCache *c, int i) {
+  int *p = c->buckets + glyphs__bucket(c->cells[i].codepoint);
+
+  while (*p != i)
+    p = &c->cells[*p].next;
+  *p = c->cells[i].next;
+  c->cells[i].used = false;
+  ++c->evicted;
+  ++c->generation;
+}
+
+/* The advance of the glyph, without a place in the layer */
+static Glyph glyphs__metrics(GlyphCache *c, u32 codepoint) {
+  int advance, lsb;
+  Glyph g = {};
+
+  stbtt_GetCodepointHMetrics(&c->font, codepoint, &advance, &lsb);
+  g.advance = advance * c->scale;
+  return g;
+}
+
+/* stb_truetype reads the font where it is mapped, which glyphs_init may already have done */
+static void glyphs__load_ttf(GlyphCache *c) {
+  if (!c->ttf_file.data && !asset_map(c->ttf_filename, &c->ttf_file))
+    die("Failed to open ttf file %s\n", c->ttf_filename);
+  c->ttf = c->ttf_file.data;
+
+  if (!stbtt_InitFont(&c->font, c->ttf, stbtt_GetFontOffsetForIndex(c->ttf, 0)))
+    die("Failed to load font %s\n", c->ttf_filename);
+  c->scale = stbtt_ScaleForPixelHeight(&c->font, c->height);
+}
+
+/* Vertical metrics, from the TTF */
+static void glyphs__vmetrics(GlyphCache *c) {
+  int ascent, descent, line_gap;
+
+  stbtt_GetFontVMetrics(&c->font, &ascent, &descent, &line_gap);
+  c->ascent = ascent * c->scale;
+  c->descent = descent * c->scale;
+  c->line_gap = line_gap * c->scale;
+}
+
+/**
+ * Maps the .glyphs file, returns false if it is missing or doesn't match how glyphs are made here.
+ * If the TTF is mapped, the bake must have been made from it
+ */
+static bool glyphs__map_bake(GlyphCache *c, const char *filename) {
+  const GlyphBakeHeader *h;
+  long size;
+  int i;
+
+  if (!filename || !asset_map(filename, &c->bake))
+    return false;
+
+  h = (const GlyphBakeHeader*)c->bake.data;
+  if (c->bake.size < (long)sizeof(*h) || h->magic != GLYPH_BAKE_MAGIC || h->version != GLYPH_BAKE_VERSION)
+    goto stale;
+  if (h->height != c->height || h->sdf_padding != GLYPH_SDF_PADDING || h->sdf_onedge != GLYPH_SDF_ONEDGE || h->sdf_scale != GLYPH_SDF_SCALE)
+    goto stale;
+  if (c->ttf_file.data && (h->ttf_size != (u32)c->ttf_file.size || h->ttf_hash != fnv1a(FNV1A_BASIS, c->ttf_file.data, (int)c->ttf_file.size)))
+    goto stale;
+  if (h->cell_w < 3 || h->cell_w > min(RENDERER_MAX_GLYPH_SIZE, c->w) || h->cell_h < 3 || h->cell_h > min(RENDERER_MAX_GLYPH_SIZE, c->h))
+    goto stale;
+  if (h->num_glyphs < 0 || h->num_kerning < 0 || h->num_glyphs > min((c->w / h->cell_w) * (c->h / h->cell_h), GLYPH_MAX_CELLS))
+    goto stale;
+  size = sizeof(*h) + h->num_glyphs * (sizeof(GlyphBakeGlyph) + h->cell_w * h->cell_h) + h->num_kerning * sizeof(GlyphBakeKern);
+  if (c->bake.size != size)
+    goto stale;
+  for (i = 0; i < h->num_glyphs; ++i) {
+    const GlyphBakeGlyph *g = (const GlyphBakeGlyph*)(h + 1) + i;
+    if (g->w > h->cell_w - 2 || g->h > h->cell_h - 2)
+      goto stale;
+  }
+  return true;
+
+  stale:
+  fprintf(get_log_file(), "Glyph bake %s is corrupt or out of date, rasterizing from the ttf instead\n", filename);
+  asset_unmap(&c->bake);
+  return false;
+}
+
+/* Adds the glyph to the cell, which must be free */
+static void glyphs__insert(GlyphCache *c, int i, u32 codepoint, Glyph g) {
+  GlyphCell *cell = c->cells + i;
+  int bucket = glyphs__bucket(codepoint);
+
+  cell->codepoint = codepoint;
+  cell->glyph = g;
+  cell->used = true;
+  cell->next = c->buckets[bucket];
+  c->buckets[bucket] = i;
+  glyphs__touch(c, i);
+}
+
+/* Copies the baked glyphs into the first cells */
+static void glyphs__load_bake(GlyphCache *c) {
+  const GlyphBakeHeader *h = (const GlyphBakeHeader*)c->bake.data;
+  const GlyphBakeGlyph *glyphs = (const GlyphBakeGlyph*)(h + 1);
+  const u8 *pixels;
+  int i, x, y, row;
+
+  c->kerning = (const GlyphBakeKern*)(glyphs + h->num_glyphs);
+  c->num_kerning = h->num_kerning;
+  pixels = (const u8*)(c->kerning + h->num_kerning);
+
+  for (i = 0; i < h->num_glyphs; ++i) {
+    const GlyphBakeGlyph *b = glyphs + i;
+    Glyph g;
+
+    x = (i % c->cols) * c->cell_w;
+    y = (i / c->cols) * c->cell_h;
+    for (row = 0; row < c->cell_h; ++row)
+      memcpy(c->pixels + (y + row)*c->w + x, pixels + row*c->cell_w, c->cell_w);
+    pixels += c->cell_w * c->cell_h;
+
+    g.x0 = (unsigned short)(x+1);
+    g.y0 = (unsigned short)(y+1);
+    g.x1 = (unsigned short)(x+1 + b->w);
+    g.y1 = (unsigned short)(y+1 + b->h);
+    g.offset_x = b->offset_x;
+    g.offset_y = b->offset_y;
+    g.advance = b->advance;
+    g.cell = (u16)i;
+    glyphs__insert(c, i, b->codepoint, g);
+  }
+}
+
+/**
+ * Lays out the cells over the layer, and fills them with the glyphs baked into bake_filename, which may be 0.
+ * The TTF is only mapped here if there is a bake, to check that it was made from it, and only loaded if there is no bake.
+ * Sets the layer's pixels in the renderer, which the platform must copy to all frames.
+ * Returns the number of baked glyphs, if there are any the platform must upload the whole layer
+ */
+static int glyphs_init(Renderer *r, const char *bake_filename, const char *ttf_filename, float height) {
+  GlyphCache *c = &glyph_cache;
+  int x0, y0, x1, y1, i;
+
+  c->ttf_filename = ttf_filename;
+  c->height = height;
+  c->w = r->atlas_size.x;
+  c->h = r->atlas_size.y;
+  c->pixels = (u8*)calloc(c->w * c->h, 1);
+  if (!c->pixels) die("Failed to allocate memory for glyphs: %s\n", flat_strerror(errno));
+
+  /* without the TTF the bake can't be checked, and is all there is */
+  if (bake_filename)
+    asset_map(ttf_filename, &c->ttf_file);
+  if (glyphs__map_bake(c, bake_filename)) {
+    const GlyphBakeHeader *h = (const GlyphBakeHeader*)c->bake.data;
+    c->cell_w = h->cell_w;
+    c->cell_h = h->cell_h;
+    c->ascent = h->ascent;
+    c->descent = h->descent;
+    c->line_gap = h->line_gap;
+  } else {
+    /* cells as big as any glyph's distance field can be, with a pixel more on both sides, so filtering doesn't pick up the neighbours */
+    glyphs__load_ttf(c);
+    glyphs__vmetrics(c);
+    stbtt_GetFontBoundingBox(&c->font, &x0, &y0, &x1, &y1);
+    c->cell_w = min((int)ceilf((x1 - x0) * c->scale) + 2*GLYPH_SDF_PADDING + 2, RENDERER_MAX_GLYPH_SIZE);
+    c->cell_h = min((int)ceilf((y1 - y0) * c->scale) + 2*GLYPH_SDF_PADDING + 2, RENDERER_MAX_GLYPH_SIZE);
+  }
+  c->cols = c->w / c->cell_w;
+  c->num_cells = min(c->cols * (c->h / c->cell_h), GLYPH_MAX_CELLS);
+
+  for (i = 0; i < GLYPH_BUCKETS; ++i)
+    c->buckets[i] = -1;
+  for (i = 0; i < c->num_cells; ++i) {
+    c->cells[i].used = false;
+    c->cells[i].next = -1;
+    c->cells[i].lru_prev = i-1;
+    c->cells[i].lru_next = i+1 < c->num_cells ? i+1 : -1;
+  }
+  c->lru_first = 0;
+  c->lru_last = c->num_cells - 1;
+  c->frame = GLYPH_FRAMES_IN_FLIGHT;
+
+  if (c->bake.data)
+    glyphs__load_bake(c);
+
+  r->glyph_pixels = c->pixels;
+  r->font_ascent = c->ascent;
+  r->font_descent = c->descent;
+  r->font_line_gap = c->line_gap;
+  r->num_glyph_uploads = 0;
+  r->num_glyphs_missing = 0;
+  return c->bake.data ? ((const GlyphBakeHeader*)c->bake.data)->num_glyphs : 0;
+}
+
+/* Call before every frame is simulated */
+static void glyphs_begin_frame(Renderer *frame) {
+  ++glyph_cache.frame;
+  frame->num_glyph_uploads = 0;
+  frame->num_glyphs_missing = 0;
+  frame->glyph_generation = glyph_cache.generation;
+}
+
+static Glyph glyph_get(Renderer *r, u32 codepoint) {
+  GlyphCache *c = &glyph_cache;
+  GlyphCell *cell;
+  GlyphUpload *up;
+  int i, bucket, x, y, w, h, xoff, yoff, row;
+  u8 *sdf;
+  Glyph g;
+
+  bucket = glyphs__bucket(codepoint);
+  for (i = c->buckets[bucket]; i >= 0; i = c->cells[i].next) {
+    if (c->cells[i].codepoint == codepoint) {
+      glyphs__touch(c, i);
+      return c->cells[i].glyph;
+    }
+  }
+
+  if (!c->ttf)
+    glyphs__load_ttf(c);
+  g = glyphs__metrics(c, codepoint);
+
+  /* the oldest cell, unless a frame in flight might be using it */
+  i = c->lru_last;
+  cell = c->cells + i;
+  if (i < 0 || r->num_glyph_uploads >= RENDERER_MAX_GLYPH_UPLOADS || (cell->used && cell->last_used + GLYPH_FRAMES_IN_FLIGHT > c->frame)) {
+    ++r->num_glyphs_missing;
+    return g;
+  }
+  if (cell->used) {
+    glyphs__evict(c, i);
+    r->glyph_generation = c->generation;
+  }
+
+  /* clear the whole cell, so the upload doesn't need to know what was there */
+  x = (i % c->cols) * c->cell_w;
+  y = (i / c->cols) * c->cell_h;
+  for (row = 0; row < c->cell_h; ++row)
+    memset(c->pixels + (y + row)*c->w + x, 0, c->cell_w);
+
+  /* 0 for glyphs without an outline, like space */
+  w = h = xoff = yoff = 0;
+  sdf = stbtt_GetCodepointSDF(&c->font, c->scale, codepoint, GLYPH_SDF_PADDING, GLYPH_SDF_ONEDGE, GLYPH_SDF_SCALE, &w, &h, &xoff, &yoff);
+  if (sdf) {
+    int cw = min(w, c->cell_w - 2), ch = min(h, c->cell_h - 2);
+    for (row = 0; row < ch; ++row)
+      memcpy(c->pixels + (y+1 + row)*c->w + x+1, sdf + row*w, cw);
+    stbtt_FreeSDF(sdf, 0);
+    w = cw, h = ch;
+  } else {
+    w = h = 0;
+  }
+
+  g.x0 = (unsigned short)(x+1);
+  g.y0 = (unsigned short)(y+1);
+  g.x1 = (unsigned short)(x+1 + w);
+  g.y1 = (unsigned short)(y+1 + h);
+  g.offset_x = (float)xoff;
+  g.offset_y = (float)yoff;
+  g.cell = (u16)i;
+
+  up = r->glyph_uploads + r->num_glyph_uploads++;
+  up->x = (u16)x, up->y = (u16)y;
+  up->w = (u16)c->cell_w, up->h = (u16)c->cell_h;
+
+  glyphs__insert(c, i, codepoint, g);
+  ++c->rasterized;
+  return g;
+}
+
+static void glyphs_touch(const u16 *cells, int count) {
+  GlyphCache *c = &glyph_cache;
+  int i;
+
+  for (i = 0; i < count; ++i)
+    if (cells[i] < c->num_cells && c->cells[cells[i]].used)
+      glyphs__touch(c, cells[i]);
+}
+
+static int glyphs__cmp_kern(const void *a, const void *b) {
+  const GlyphBakeKern *x = (const GlyphBakeKern*)a, *y = (const GlyphBakeKern*)b;
+  if (x->first != y->first) return x->first < y->first ? -1 : 1;
+  if (x->second != y->second) return x->second < y->second ? -1 : 1;
+  return 0;
+}
+
+/**
+ * The extra advance between two glyphs, at RENDERER_FONT_SIZE.
+ * Comes from the bake until the TTF has been loaded, which happens as soon as a glyph that wasn't baked
+ * has been asked for, so the pairs the bake doesn't have are never needed
+ */
+static float glyphs_kern(u32 first, u32 second) {
+  GlyphCache *c = &glyph_cache;
+  GlyphBakeKern key, *k;
+
+  if (c->ttf)
+    return stbtt_GetCodepointKernAdvance(&c->font, first, second) * c->scale;
+
+  key.first = first;
+  key.second = second;
+  k = (GlyphBakeKern*)bsearch(&key, c->kerning, c->num_kerning, sizeof(*c->kerning), glyphs__cmp_kern);
+  return k ? k->advance : 0.0f;
+}
@@ -0,0 +1,167 @@
+/**
+ * GPU culling of cubes
+ *
+ * With GL 4.3, the game pushes every cube as a CubeInstance instead of culling it and
+ * writing its vertices (see Renderer::gpu_culling). The instances are uploaded as they are,
+ * and for every batch of them:
+ *
+ *   - cube_cull_compute.glsl tests each box against the frustum, with the same planes as
+ *     flat_cull.hpp, and writes one indirect draw command per box, of one instance if it is visible,
+ *     and none if it isn't
+ *   - one glMultiDrawElementsIndirect draws them all, from a unit cube and the instance attributes,
+ *     with the base instance of each command picking the box
+ *
+ * So a batch costs the CPU the same few calls, however many cubes there are. The commands keep the
+ * order of the boxes, so cubes still blend back to front.
+ *
+ * Without GL 4.3, or with FLAT_GPU_CULLING=0, this stays disabled, and the game culls
+ * and expands the cubes itself, as before.
+ */
+
+struct GpuCullCommand {
+  u32 count, instance_count, first_index;
+  i32 base_vertex;
+  u32 base_instance;
+};
+STATIC_ASSERT(sizeof(GpuCullCommand) == 20, gpucull_command_is_tightly_packed);
+
+#define GPUCULL_MAX_CUBES ((int)ARRAY_LEN(((RenderQueue*)0)->cubes))
+#define GPUCULL_GROUP_SIZE 64 /* local_size_x in cube_cull_compute.glsl */
+
+struct GpuCull {
+  bool enabled;
+  GLuint vertex_array, vertex_buffer, index_buffer, instance_buffer, command_buffer;
+  Shader cull_shader, cube_shader;
+};
+
+static GpuCull gpucull;
+
+/* Points the instance attributes of the bound vertex array at the bound array buffer */
+static void gpucull__instance_attribs() {
+  int i;
+
+  for (i = 2; i <= 5; ++i) {
+    glEnableVertexAttribArray(i);
+    glVertexAttribDivisor(i, 1);
+  }
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, x0));
+  glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, x1));
+  glVertexAttribPointer(4, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CubeInstance), (void*) offsetof(CubeInstance, tex));
+  glVertexAttribIPointer(5, 1, GL_INT, sizeof(CubeInstance), (void*) offsetof(CubeInstance, texture));
+}
+
+/**
+ * Must be called with the context current, after the GL functions have been loaded.
+ * Returns whether GPU culling is enabled, in which case the caller must build the shaders
+ * with gpucull_build_begin
+ */
+static bool gpucull_init() {
+  const char *enabled = SDL_getenv("FLAT_GPU_CULLING");
+  GLint major = 0, minor = 0;
+  SpriteVertex expanded[CUBE_VERTICES], vertices[24];
+  u16 indices[CUBE_VERTICES];
+  CubeInstance unit;
+  int i;
+
+  gpucull.enabled = false;
+  if (enabled && !strcmp(enabled, "0"))
+    return false;
+
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  if (major*10 + minor < 43)
+    return false;
+
+  /* optional, so don't die if they are missing */
+  #define GL_FUN(ret, name, par) *(void**) (&name) = (void*)SDL_GL_GetProcAddress(#name);
+  #include "flat_glfuns_gpucull.incl"
+  #undef GL_FUN
+  if (!glDispatchCompute || !glMemoryBarrier || !glBindBufferBase || !glMultiDrawElementsIndirect)
+    return false;
+
+  /* a unit cube, with the same faces and normals as the cubes the game expands */
+  unit = cubeinstance_create(v3{0.0f, 0.0f, 0.0f}, v3{1.0f, 1.0f, 1.0f}, v2{0.0f, 0.0f}, 0);
+  cubeinstance_expand(&unit, expanded);
+  /* each quad is abc acd */
+  for (i = 0; i < 6; ++i) {
+    vertices[i*4 + 0] = expanded[i*6 + 0];
+    vertices[i*4 + 1] = expanded[i*6 + 1];
+    vertices[i*4 + 2] = expanded[i*6 + 2];
+    vertices[i*4 + 3] = expanded[i*6 + 5];
+    indices[i*6 + 0] = (u16)(i*4 + 0);
+    indices[i*6 + 1] = (u16)(i*4 + 1);
+    indices[i*6 + 2] = (u16)(i*4 + 2);
+    indices[i*6 + 3] = (u16)(i*4 + 0);
+    indices[i*6 + 4] = (u16)(i*4 + 2);
+    indices[i*6 + 5] = (u16)(i*4 + 3);
+  }
+
+  glGenVertexArrays(1, &gpucull.vertex_array);
+  glBindVertexArray(gpucull.vertex_array);
+
+  glGenBuffers(1, &gpucull.vertex_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, gpucull.vertex_buffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, sizeof(SpriteVertex), (void*) 0);
+  glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(SpriteVertex), (void*) offsetof(SpriteVertex, normal));
+
+  glGenBuffers(1, &gpucull.index_buffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpucull.index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+
+  /* the instances are read both as attributes and by the compute shader */
+  glGenBuffers(1, &gpucull.instance_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, gpucull.instance_buffer);
+  glBufferData(GL_ARRAY_BUFFER, GPUCULL_MAX_CUBES * sizeof(CubeInstance), 0, GL_DYNAMIC_DRAW);
+  gpucull__instance_attribs();
+  glBindVertexArray(0);
+
+  glGenBuffers(1, &gpucull.command_buffer);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpucull.command_buffer);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER, GPUCULL_MAX_CUBES * sizeof(GpuCullCommand), 0, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  gl_ok_or_die;
+
+  gpucull.enabled = true;
+  return true;
+}
+
+/* Starts building both shaders, for shader_build_end */
+static void gpucull_build_begin(ShaderBuild *cull_build, ShaderBuild *cube_build) {
+  shader_build_compute_begin(cull_build, &gpucull.cull_shader, "../../assets/shaders/cube_cull_compute.glsl");
+  shader_build_begin(cube_build, &gpucull.cube_shader, "../../assets/shaders/cube_vertex.glsl", "../../assets/shaders/sprite_fragment.glsl");
+}
+
+/* Sets the constant uniforms, once the shaders are built */
+static void gpucull_shaders_init() {
+  glUseProgram(gpucull.cube_shader.program);
+  glUniform1i(glGetUniformLocation(gpucull.cube_shader.program, "tex"), 0);
+  glUniform1f(glGetUniformLocation(gpucull.cube_shader.program, "pos_scale"), 1.0f / RENDERER_POS_SCALE);
+  gl_ok_or_die;
+}
+
+static void gpucull_upload(const CubeInstance *cubes, int num_cubes) {
+  gls_bind_buffer(GL_ARRAY_BUFFER, gpucull.instance_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, num_cubes * sizeof(*cubes), cubes);
+}
+
+/* Culls and draws cubes first to first+count */
+static void gpucull_draw(int first, int count) {
+  gls_use_program(gpucull.cull_shader.program);
+  gls_uniform1i(gpucull.cull_shader.first_loc, first);
+  gls_uniform1i(gpucull.cull_shader.count_loc, count);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpucull.instance_buffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpucull.command_buffer);
+  glDispatchCompute((count + GPUCULL_GROUP_SIZE-1) / GPUCULL_GROUP_SIZE, 1, 1);
+
+  /* the draw reads the commands the dispatch wrote */
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+  gls_use_program(gpucull.cube_shader.program);
+  gls_bind_vertex_array(gpucull.vertex_array);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpucull.command_buffer);
+  glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (void*) (first * sizeof(GpuCullCommand)), count, 0);
+}
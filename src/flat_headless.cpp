@@ -0,0 +1,193 @@
+/**
+ * Headless platform layer
+ *
+ * Runs the game without a window or an OpenGL context.
+ * Every frame gets a fixed 16 ms timestep and no input, so runs are reproducible.
+ * Prints the time spent in the game and in the renderer for every frame.
+ *
+ * usage: flat_headless [-null | -record file] [num_frames] [output_dir]
+ *
+ * By default frames are drawn with the software renderer, and written as TGA files if output_dir is given.
+ * -null skips drawing, to measure the cost of generating the geometry on its own.
+ * -record writes the draw stream to a file, which flat_sdl can replay (see FLAT_REPLAY)
+ */
+#define _POSIX_C_SOURCE 200112L
+#include "flat_math.hpp"
+#include "flat_utils.cpp"
+#include "flat_platform_api.hpp"
+#include <SDL2/SDL.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#define STB_TRUETYPE_IMPLEMENTATION
+#define STBTT_STATIC
+#include "stb_truetype.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.hpp"
+
+#include "flat_lights.cpp"
+#include "flat_render.cpp"
+#include "flat_jobs.cpp"
+#include "flat_pack.cpp"
+#include "flat_atlas.cpp"
+#include "flat_glyphs.cpp"
+#include "flat_software.cpp"
+
+#ifdef OS_WINDOWS
+static const char *dll_file = "flat.dll";
+#else
+static const char *dll_file = "flat.so";
+#endif
+
+static RenderQueue render_queue;
+static SoftwareRenderer software_renderer;
+static Recorder recorder;
+
+static double ticks_to_ms(Uint64 ticks) {
+  return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+int main(int argc, char **argv) {
+  int err, i, num_frames;
+  const char *output_dir, *record_file = 0;
+  bool draw = true;
+  RenderBackend backend, swr_backend;
+  Input input = {};
+  MainLoop main_loop;
+  Init init;
+  void *dll;
+  double total_game_ms = 0.0, total_raster_ms = 0.0;
+
+  ++argv, --argc;
+  if (argc > 0 && !strcmp(argv[0], "-null"))
+    draw = false, ++argv, --argc;
+  else if (argc > 1 && !strcmp(argv[0], "-record"))
+    draw = false, record_file = argv[1], argv += 2, argc -= 2;
+  num_frames = argc > 0 ? atoi(argv[0]) : 100;
+  output_dir = argc > 1 && draw ? argv[1] : 0;
+
+  /* Alloc memory */
+  #define MEMORY_SIZE 512*1024*1024
+  char *memory = (char*)malloc(MEMORY_SIZE);
+  if (memory == NULL)
+    die("Not enough memory");
+
+  /* Alloc renderer */
+  Renderer *renderer = (Renderer*)memory;
+  memory += sizeof(*renderer);
+
+  /* No video, we only need threads and timers */
+  if (SDL_Init(0))
+    die("%s\n", SDL_GetError());
+  atexit(SDL_Quit);
+
+  jobs_init();
+  swr_init(&software_renderer, 1280, 720);
+  swr_backend = swr_backend_create(&software_renderer);
+  if (record_file)
+    backend = recorder_create(&recorder, record_file, 0);
+  else if (!draw)
+    backend = null_backend_create();
+  else
+    backend = swr_backend;
+
+  /* the game culls and expands the cubes, the same as GL without GPU culling */
+  renderer->gpu_culling = false;
+
+  /* Load images, from the asset pack if there is one, or else the same way as the GL platform */
+  pack_open("../../assets/assets.pack");
+  {
+    const PackAtlas *packed = pack_atlas(atlas_hash());
+    static AtlasLayout atlas;
+    AtlasPage *pages = atlas.pages;
+
+    if (packed) {
+      /* the software renderer doesn't mipmap, so only the first level */
+      const u8 *level = pack_atlas_level(packed, 0);
+      long size = (long)packed->w * packed->h * 4;
+
+      memcpy(renderer->sprites, packed->sprites, sizeof(packed->sprites));
+      renderer->num_sprite_pages = packed->num_pages;
+      renderer->atlas_size.x = packed->w;
+      renderer->atlas_size.y = packed->h;
+      for (i = 0; i < renderer->num_sprite_pages; ++i) {
+        u8 *pixels = (u8*)malloc(size);
+        if (!pixels)
+          die("Failed to allocate atlas page: %s\n", flat_strerror(errno));
+        memcpy(pixels, level + i*size, size);
+        swr_texture_set(&software_renderer, RENDER_TEXTURE_SPRITES + i, pixels, packed->w, packed->h, 4);
+      }
+    } else {
+      atlas_build(&atlas, renderer->sprites);
+      renderer->num_sprite_pages = atlas.num_pages;
+      renderer->atlas_size.x = RENDERER_ATLAS_PAGE_SIZE;
+      renderer->atlas_size.y = atlas.h;
+      for (i = 0; i < renderer->num_sprite_pages; ++i)
+        swr_texture_set(&software_renderer, RENDER_TEXTURE_SPRITES + i, pages[i].pixels, pages[i].w, pages[i].h, 4);
+    }
+  }
+  {
+    /* the same size as the GL atlas layers, so the glyphs land in the same place */
+    const int w = renderer->atlas_size.x, h = renderer->atlas_size.y;
+    unsigned char *bitmap = (unsigned char*)malloc(w * h);
+
+    if (!bitmap)
+      die("Failed to allocate memory for the text layer: %s\n", flat_strerror(errno));
+    glyphs_init(renderer, "../../assets/Roboto-Regular.glyphs", "../../assets/Roboto-Regular.ttf", RENDERER_FONT_SIZE);
+    memcpy(bitmap, renderer->glyph_pixels, w * h);
+    swr_texture_set(&software_renderer, RENDER_TEXTURE_TEXT, bitmap, w, h, 1);
+  }
+
+  /* load game */
+  dll = SDL_LoadObject(dll_file);
+  if (!dll)
+    die("%s\n", SDL_GetError());
+  *(void**)(&main_loop) = SDL_LoadFunction(dll, "main_loop");
+  *(void**)(&init) = SDL_LoadFunction(dll, "init");
+  if (!main_loop || !init)
+    die("%s\n", SDL_GetError());
+
+  {
+    Funs dfuns = {};
+    dfuns.parallel_for = jobs_parallel_for;
+    dfuns.glyph_get = glyph_get;
+    dfuns.glyph_kern = glyphs_kern;
+    dfuns.glyph_touch = glyphs_touch;
+    init(memory, MEMORY_SIZE - sizeof(*renderer), dfuns, renderer);
+  }
+
+  for (i = 0; i < num_frames; ++i) {
+    Uint64 t0, t1, t2;
+
+    t0 = SDL_GetPerformanceCounter();
+    glyphs_begin_frame(renderer);
+    err = main_loop(memory, i*16, input, renderer);
+    if (err) break;
+
+    t1 = SDL_GetPerformanceCounter();
+    render_queue_build(&render_queue, renderer);
+    render_queue_submit(&render_queue, &backend);
+    t2 = SDL_GetPerformanceCounter();
+
+    total_game_ms += ticks_to_ms(t1 - t0);
+    total_raster_ms += ticks_to_ms(t2 - t1);
+    printf("frame %i: game %.3f ms, render %.3f ms, %i batches\n", i, ticks_to_ms(t1 - t0), ticks_to_ms(t2 - t1), render_queue.num_batches);
+
+    if (output_dir) {
+      char filename[1024];
+      snprintf(filename, sizeof(filename), "%s/frame_%04i.tga", output_dir, i);
+      if (!swr_write_tga(&software_renderer, filename))
+        die("Failed to write %s: %s\n", filename, flat_strerror(errno));
+    }
+  }
+
+  if (record_file)
+    recorder_close(&recorder);
+  if (i)
+    printf("average: game %.3f ms, render %.3f ms\n", total_game_ms / i, total_raster_ms / i);
+  return 0;
+}
@@ -0,0 +1,76 @@
+/**
+ * Job system
+ *
+ * A fixed set of worker threads that help out with parallel_for.
+ * The calling thread takes part as thread 0, and the workers are threads 1 and up.
+ *
+ * parallel_for must only be called from one thread at a time, and not from inside a job.
+ */
+
+struct Jobs {
+  SDL_Thread *workers[RENDERER_MAX_THREADS-1];
+  int num_workers;
+  SDL_sem *start, *done;
+
+  /* current parallel_for */
+  SDL_atomic_t next_index;
+  ParallelForFun fn;
+  void *data;
+  int count;
+};
+
+static Jobs jobs;
+
+static void jobs__run(int thread) {
+  int i;
+
+  while ((i = SDL_AtomicAdd(&jobs.next_index, 1)) < jobs.count)
+    jobs.fn(jobs.data, i, thread);
+}
+
+static int jobs__worker(void *data) {
+  int thread = (int)(size_t)data;
+
+  for (;;) {
+    SDL_SemWait(jobs.start);
+    jobs__run(thread);
+    SDL_SemPost(jobs.done);
+  }
+  return 0;
+}
+
+static void jobs_init() {
+  int i;
+
+  jobs.start = SDL_CreateSemaphore(0);
+  jobs.done = SDL_CreateSemaphore(0);
+  if (!jobs.start || !jobs.done)
+    die("%s\n", SDL_GetError());
+
+  jobs.num_workers = min(SDL_GetCPUCount(), RENDERER_MAX_THREADS) - 1;
+  for (i = 0; i < jobs.num_workers; ++i) {
+    jobs.workers[i] = SDL_CreateThread(jobs__worker, "worker", (void*)(size_t)(i+1));
+    if (!jobs.workers[i])
+      die("%s\n", SDL_GetError());
+    SDL_DetachThread(jobs.workers[i]);
+  }
+}
+
+static void jobs_parallel_for(ParallelForFun fn, void *data, int count) {
+  int i, num_wakeups;
+
+  jobs.fn = fn;
+  jobs.data = data;
+  jobs.count = count;
+  SDL_AtomicSet(&jobs.next_index, 0);
+
+  /* No point in waking up more workers than there are jobs */
+  num_wakeups = min(jobs.num_workers, count-1);
+  for (i = 0; i < num_wakeups; ++i)
+    SDL_SemPost(jobs.start);
+
+  jobs__run(0);
+
+  for (i = 0; i < num_wakeups; ++i)
+    SDL_SemWait(jobs.done);
+}
@@ -0,0 +1,196 @@
+/**
+ * Clustered lighting
+ *
+ * The view frustum is cut into LIGHT_CLUSTERS_X by LIGHT_CLUSTERS_Y tiles of the screen, and
+ * LIGHT_CLUSTERS_Z slices of depth, which get thicker further away, so that clusters stay
+ * roughly as deep as they are wide. Every frame the lights are binned into the clusters
+ * they touch, and sprite_fragment.glsl only loops over the lights of the cluster it is in.
+ * Clusters only depend on position, not on pixels, so the resolution doesn't matter.
+ *
+ * Binning takes two steps:
+ *
+ *   - lights__ranges finds the box of clusters around every light, four at a time with SSE.
+ *     The box is conservative, it is the screen extent of the light's bounding box,
+ *     at both its nearest and furthest depth
+ *   - lights_bin counts the lights in every cluster, and then writes their indices into
+ *     one compact list, in which every cluster has a range
+ *
+ * The camera has no rotation (see flat_cull.hpp), which keeps both steps cheap.
+ */
+
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 9
+#define LIGHT_CLUSTERS_Z 24
+#define LIGHT_NUM_CLUSTERS (LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z)
+#define LIGHT_MAX_LIGHTS (RENDERER_MAX_THREADS * ARRAY_LEN(((RenderArena*)0)->lights))
+#define LIGHT_MAX_INDICES (64*1024)
+
+STATIC_ASSERT(LIGHT_MAX_LIGHTS % 4 == 0, lights_come_in_fours);
+STATIC_ASSERT(LIGHT_MAX_LIGHTS <= 0xffff, light_indices_fit_in_16_bits);
+
+/* A range in LightClusters::indices */
+struct LightCluster {
+  u32 first, count;
+};
+
+struct LightClusters {
+  RenderLight lights[LIGHT_MAX_LIGHTS];
+  int num_lights;
+
+  /* cluster x,y,z is at (z*LIGHT_CLUSTERS_Y + y)*LIGHT_CLUSTERS_X + x */
+  LightCluster clusters[LIGHT_NUM_CLUSTERS];
+  u16 indices[LIGHT_MAX_INDICES];
+  int num_indices;
+
+  /* the clusters touched by every light, inclusive and already floored, empty if x1 < x0 */
+  float x0[LIGHT_MAX_LIGHTS], x1[LIGHT_MAX_LIGHTS];
+  float y0[LIGHT_MAX_LIGHTS], y1[LIGHT_MAX_LIGHTS];
+  float z0[LIGHT_MAX_LIGHTS], z1[LIGHT_MAX_LIGHTS];
+};
+
+static void lights_clear(LightClusters *c) {
+  c->num_lights = 0;
+}
+
+static void lights_push(LightClusters *c, const RenderLight *lights, int num_lights) {
+  num_lights = min(num_lights, (int)LIGHT_MAX_LIGHTS - c->num_lights);
+  memcpy(c->lights + c->num_lights, lights, num_lights * sizeof(*lights));
+  c->num_lights += num_lights;
+}
+
+static void lights__ranges(LightClusters *c, v3 camera, float near_z, float far_z, v2 nearsize) {
+  /* distances in front of the camera */
+  float near_d = -near_z, far_d = -far_z;
+  /* from x/distance to normalized device coordinates, see sprite_vertex.glsl */
+  float sx = 2.0f * near_d / nearsize.x, sy = 2.0f * near_d / nearsize.y;
+  /* the near side of every slice but the first */
+  float bounds[LIGHT_CLUSTERS_Z - 1];
+  int i, k;
+
+  for (k = 1; k < LIGHT_CLUSTERS_Z; ++k)
+    bounds[k-1] = near_d * (float)pow(far_d / near_d, (double)k / LIGHT_CLUSTERS_Z);
+
+#ifdef HAS_SSE
+  /* The arrays are padded to a multiple of 4, so reading past num_lights is fine */
+  for (i = 0; i < c->num_lights; i += 4) {
+    const RenderLight *l = c->lights + i;
+    __m128 px, py, r, d, d0, d1, lo, hi, t0, t1, z0, z1, visible;
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+    px = _mm_sub_ps(_mm_set_ps(l[3].pos.x, l[2].pos.x, l[1].pos.x, l[0].pos.x), _mm_set1_ps(camera.x));
+    py = _mm_sub_ps(_mm_set_ps(l[3].pos.y, l[2].pos.y, l[1].pos.y, l[0].pos.y), _mm_set1_ps(camera.y));
+    d = _mm_sub_ps(_mm_set1_ps(camera.z), _mm_set_ps(l[3].pos.z, l[2].pos.z, l[1].pos.z, l[0].pos.z));
+    r = _mm_set_ps(l[3].radius, l[2].radius, l[1].radius, l[0].radius);
+
+    /* depth range, clipped to the frustum */
+    d0 = _mm_max_ps(_mm_sub_ps(d, r), _mm_set1_ps(near_d));
+    d1 = _mm_min_ps(_mm_add_ps(d, r), _mm_set1_ps(far_d));
+    visible = _mm_cmple_ps(d0, d1);
+
+    /* the slices are found by counting the bounds in front of each end */
+    z0 = z1 = zero;
+    for (k = 0; k < LIGHT_CLUSTERS_Z - 1; ++k) {
+      __m128 b = _mm_set1_ps(bounds[k]);
+      z0 = _mm_add_ps(z0, _mm_and_ps(_mm_cmple_ps(b, d0), one));
+      z1 = _mm_add_ps(z1, _mm_and_ps(_mm_cmple_ps(b, d1), one));
+    }
+
+    /* tiles, with the sides of the box projected at both ends of the depth range, n - 0.5 floors to the last one */
+    #define LIGHTS_TILES(p, s, n, out0, out1) \
+      lo = _mm_sub_ps(p, r), hi = _mm_add_ps(p, r); \
+      t0 = _mm_min_ps(_mm_div_ps(lo, d0), _mm_div_ps(lo, d1)); \
+      t1 = _mm_max_ps(_mm_div_ps(hi, d0), _mm_div_ps(hi, d1)); \
+      t0 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(t0, _mm_set1_ps(s)), one), _mm_set1_ps(0.5f * (n))); \
+      t1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(t1, _mm_set1_ps(s)), one), _mm_set1_ps(0.5f * (n))); \
+      visible = _mm_and_ps(visible, _mm_cmpge_ps(t1, zero)); \
+      visible = _mm_and_ps(visible, _mm_cmplt_ps(t0, _mm_set1_ps((float)(n)))); \
+      out0 = _mm_min_ps(_mm_max_ps(t0, zero), _mm_set1_ps((n) - 0.5f)); \
+      out1 = _mm_min_ps(_mm_max_ps(t1, zero), _mm_set1_ps((n) - 0.5f));
+    {
+      __m128 x0, x1, y0, y1;
+
+      LIGHTS_TILES(px, sx, LIGHT_CLUSTERS_X, x0, x1);
+      LIGHTS_TILES(py, sy, LIGHT_CLUSTERS_Y, y0, y1);
+
+      _mm_storeu_ps(c->x0 + i, x0);
+      _mm_storeu_ps(c->x1 + i, _mm_or_ps(_mm_and_ps(visible, x1), _mm_andnot_ps(visible, _mm_set1_ps(-1.0f))));
+      _mm_storeu_ps(c->y0 + i, y0);
+      _mm_storeu_ps(c->y1 + i, y1);
+      _mm_storeu_ps(c->z0 + i, z0);
+      _mm_storeu_ps(c->z1 + i, z1);
+    }
+    #undef LIGHTS_TILES
+  }
+#else
+  for (i = 0; i < c->num_lights; ++i) {
+    const RenderLight *l = c->lights + i;
+    float px = l->pos.x - camera.x, py = l->pos.y - camera.y, d = camera.z - l->pos.z, r = l->radius;
+    float d0 = max(d - r, near_d), d1 = min(d + r, far_d);
+    float t[4];
+    bool visible = d0 <= d1;
+
+    c->z0[i] = c->z1[i] = 0.0f;
+    for (k = 0; k < LIGHT_CLUSTERS_Z - 1; ++k) {
+      c->z0[i] += bounds[k] <= d0;
+      c->z1[i] += bounds[k] <= d1;
+    }
+
+    t[0] = (min((px - r) / d0, (px - r) / d1) * sx + 1.0f) * 0.5f * LIGHT_CLUSTERS_X;
+    t[1] = (max((px + r) / d0, (px + r) / d1) * sx + 1.0f) * 0.5f * LIGHT_CLUSTERS_X;
+    t[2] = (min((py - r) / d0, (py - r) / d1) * sy + 1.0f) * 0.5f * LIGHT_CLUSTERS_Y;
+    t[3] = (max((py + r) / d0, (py + r) / d1) * sy + 1.0f) * 0.5f * LIGHT_CLUSTERS_Y;
+    visible = visible && t[1] >= 0.0f && t[0] < LIGHT_CLUSTERS_X && t[3] >= 0.0f && t[2] < LIGHT_CLUSTERS_Y;
+
+    c->x0[i] = clamp(t[0], 0.0f, LIGHT_CLUSTERS_X - 0.5f);
+    c->x1[i] = visible ? clamp(t[1], 0.0f, LIGHT_CLUSTERS_X - 0.5f) : -1.0f;
+    c->y0[i] = clamp(t[2], 0.0f, LIGHT_CLUSTERS_Y - 0.5f);
+    c->y1[i] = clamp(t[3], 0.0f, LIGHT_CLUSTERS_Y - 0.5f);
+  }
+#endif
+}
+
+/**
+ * Bins the pushed lights into the clusters of the view.
+ * If the index list fills up, the clusters furthest away lose lights first
+ */
+static void lights_bin(LightClusters *c, v3 camera, float near_z, float far_z, v2 nearsize) {
+  u32 sum;
+  int i, x, y, z;
+
+  memset(c->clusters, 0, sizeof(c->clusters));
+  c->num_indices = 0;
+  if (!c->num_lights)
+    return;
+
+  lights__ranges(c, camera, near_z, far_z, nearsize);
+
+  /* count */
+  for (i = 0; i < c->num_lights; ++i)
+    for (z = (int)c->z0[i]; z <= (int)c->z1[i]; ++z)
+    for (y = (int)c->y0[i]; y <= (int)c->y1[i]; ++y)
+    for (x = (int)c->x0[i]; x <= (int)c->x1[i]; ++x)
+      ++c->clusters[(z*LIGHT_CLUSTERS_Y + y)*LIGHT_CLUSTERS_X + x].count;
+
+  /* give every cluster its range, as much of it as fits */
+  for (sum = 0, i = 0; i < LIGHT_NUM_CLUSTERS; ++i) {
+    LightCluster *cl = c->clusters + i;
+    cl->first = min(sum, (u32)LIGHT_MAX_INDICES);
+    cl->count = min(cl->count, (u32)LIGHT_MAX_INDICES - cl->first);
+    sum = cl->first + cl->count;
+  }
+  c->num_indices = sum;
+
+  /* fill, using count as the cursor, which ends up where it was */
+  for (i = 0; i < LIGHT_NUM_CLUSTERS; ++i)
+    c->clusters[i].count = 0;
+  for (i = 0; i < c->num_lights; ++i)
+    for (z = (int)c->z0[i]; z <= (int)c->z1[i]; ++z)
+    for (y = (int)c->y0[i]; y <= (int)c->y1[i]; ++y)
+    for (x = (int)c->x0[i]; x <= (int)c->x1[i]; ++x) {
+      LightCluster *cl = c->clusters + (z*LIGHT_CLUSTERS_Y + y)*LIGHT_CLUSTERS_X + x;
+      u32 end = (cl + 1 < c->clusters + LIGHT_NUM_CLUSTERS) ? cl[1].first : (u32)c->num_indices;
+
+      if (cl->first + cl->count < end)
+        c->indices[cl->first + cl->count++] = (u16)i;
+    }
+}
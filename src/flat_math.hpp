@@ -11,6 +11,11 @@ T min(T a, T b) {
   return b < a ? b : a;
 }
 
+template<class T>
+T clamp(T x, T lo, T hi) {
+  return x < lo ? lo : hi < x ? hi : x;
+}
+
 template<class T>
 T abs(T x) {
   return x < T() ? -x : x;
@@ -124,7 +129,7 @@ union v4 {
   };
 };
 
-union v2i {
+struct v2i {
   int x,y;
 };
 
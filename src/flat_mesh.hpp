@@ -0,0 +1,340 @@
+#ifndef FLAT_MESH_H
+#define FLAT_MESH_H
+
+/**
+ * Mesh builder for static boxes
+ *
+ * Turns a set of axis aligned boxes into one mesh, without the faces that are buried
+ * inside other boxes, and with adjacent coplanar faces merged into as few rectangles as possible.
+ *
+ * Faces are grouped by plane. For every plane, the edges of the faces on it, and of the boxes
+ * that cover it, cut the plane into a grid of cells. A cell is visible if it lies in a face and
+ * not in a box, and the visible cells are merged greedily: grow a rectangle along u as far as
+ * possible, and then along v for as long as the whole row is visible.
+ *
+ * Faces are emitted with the same corners as render_cube, so the mesh shades the same.
+ *
+ * Finally the faces are sorted into chunks, by which cell of a MESH_CHUNK_SIZE grid over x and y
+ * their centers are in, so that the mesh can be culled a chunk at a time. A chunk's bounds are those
+ * of its faces, which can reach past its cell.
+ */
+
+#define MESH_MAX_VERTICES 4096
+#define MESH_MAX_QUADS (MESH_MAX_VERTICES / 6)
+#define MESH_MAX_CHUNKS 64
+#define MESH_CHUNK_SIZE 4.0f
+#define MESH_EPSILON 0.0001f
+
+/* The vertices [first, first+count) of the mesh */
+struct MeshChunk {
+  int first, count;
+  v3 x0, x1; /* bounds */
+};
+
+struct BoxMesh {
+  SpriteVertex vertices[MESH_MAX_VERTICES];
+  int num_vertices;
+  int texture; /* the RenderTexture of all faces */
+  v3 x0, x1; /* bounds */
+
+  MeshChunk chunks[MESH_MAX_CHUNKS];
+  int num_chunks;
+  /* bounds of every quad, while building */
+  Cube quads[MESH_MAX_QUADS];
+
+  /* stats */
+  int num_faces_in, num_faces_out;
+};
+
+/* dir is axis*2 + positive, u and v are the other two axes */
+struct MeshFace {
+  int dir;
+  float c;
+  float u0, v0, u1, v1;
+};
+
+static const int mesh__u_axis[3] = {1, 0, 0};
+static const int mesh__v_axis[3] = {2, 2, 1};
+
+/* The order render_cube goes round each face in, as (u,v) corners */
+static const u8 mesh__corners[6][4][2] = {
+  {{0,0}, {0,1}, {1,1}, {1,0}}, /* -x */
+  {{0,0}, {1,0}, {1,1}, {0,1}}, /* +x */
+  {{0,0}, {1,0}, {1,1}, {0,1}}, /* -y */
+  {{1,0}, {0,0}, {0,1}, {1,1}}, /* +y */
+  {{0,0}, {1,0}, {1,1}, {0,1}}, /* -z */
+  {{0,0}, {1,0}, {1,1}, {0,1}}, /* +z */
+};
+
+static float mesh__get(v3 v, int axis) {
+  return (&v.x)[axis];
+}
+
+static int mesh__cmp_face(const void *a, const void *b) {
+  const MeshFace *fa = (const MeshFace*)a, *fb = (const MeshFace*)b;
+  if (fa->dir != fb->dir)
+    return fa->dir - fb->dir;
+  return fa->c < fb->c ? -1 : fa->c > fb->c;
+}
+
+static int mesh__cmp_float(const void *a, const void *b) {
+  float fa = *(const float*)a, fb = *(const float*)b;
+  return fa < fb ? -1 : fa > fb;
+}
+
+/* Sorts and removes duplicates, returns the new count */
+static int mesh__unique(float *x, int n) {
+  int i, j;
+
+  if (!n)
+    return 0;
+  qsort(x, n, sizeof(*x), mesh__cmp_float);
+  for (i = 1, j = 0; i < n; ++i)
+    if (x[i] - x[j] > MESH_EPSILON)
+      x[++j] = x[i];
+  return j+1;
+}
+
+/* Index of the coordinate closest to x */
+static int mesh__find(const float *x, int n, float value) {
+  int i, best = 0;
+  for (i = 1; i < n; ++i)
+    if (abs(x[i] - value) < abs(x[best] - value))
+      best = i;
+  return best;
+}
+
+/* Does box cover the outside of a face with direction dir on plane c */
+static bool mesh__covers(Cube *box, int dir, float c) {
+  int axis = dir/2;
+  float x0 = mesh__get(box->x0, axis), x1 = mesh__get(box->x1, axis);
+
+  if (dir & 1)
+    return x0 <= c + MESH_EPSILON && x1 > c + MESH_EPSILON;
+  return x1 >= c - MESH_EPSILON && x0 < c - MESH_EPSILON;
+}
+
+static void mesh__emit(BoxMesh *m, int dir, float c, float u0, float v0, float u1, float v1, v2 uv) {
+  int axis = dir/2, i;
+  Cube *q;
+  v3 p[4];
+
+  if (m->num_vertices + 6 > MESH_MAX_VERTICES)
+    return;
+
+  q = m->quads + m->num_vertices/6;
+  (&q->x0.x)[axis] = (&q->x1.x)[axis] = c;
+  (&q->x0.x)[mesh__u_axis[axis]] = u0, (&q->x1.x)[mesh__u_axis[axis]] = u1;
+  (&q->x0.x)[mesh__v_axis[axis]] = v0, (&q->x1.x)[mesh__v_axis[axis]] = v1;
+
+  for (i = 0; i < 4; ++i) {
+    (&p[i].x)[axis] = c;
+    (&p[i].x)[mesh__u_axis[axis]] = mesh__corners[dir][i][0] ? u1 : u0;
+    (&p[i].x)[mesh__v_axis[axis]] = mesh__corners[dir][i][1] ? v1 : v0;
+  }
+  spritevertex_quad(m->vertices + m->num_vertices, p[0], p[1], p[2], p[3], uv, uv, uv, uv, m->texture);
+  m->num_vertices += 6;
+  ++m->num_faces_out;
+}
+
+/* Merges the faces[0..n) which all lie in the same plane */
+static void mesh__plane(BoxMesh *m, MeshFace *faces, int n, Cube *boxes, int num_boxes, Stack *scratch, v2 uv) {
+  int dir = faces[0].dir, axis = dir/2, ua = mesh__u_axis[axis], va = mesh__v_axis[axis];
+  float c = faces[0].c;
+  float *us, *vs;
+  int nu = 0, nv = 0, i, j, k, x, y;
+  u8 *cells;
+  unsigned char *top = scratch->curr;
+
+  us = (float*)stack_push_ex(scratch, 2*(n + num_boxes) * sizeof(float), alignof(float));
+  vs = (float*)stack_push_ex(scratch, 2*(n + num_boxes) * sizeof(float), alignof(float));
+  if (!us || !vs)
+    goto done;
+
+  /* cut the plane along every edge */
+  for (i = 0; i < n; ++i) {
+    us[nu++] = faces[i].u0, us[nu++] = faces[i].u1;
+    vs[nv++] = faces[i].v0, vs[nv++] = faces[i].v1;
+  }
+  for (i = 0; i < num_boxes; ++i) {
+    if (!mesh__covers(boxes + i, dir, c))
+      continue;
+    us[nu++] = mesh__get(boxes[i].x0, ua), us[nu++] = mesh__get(boxes[i].x1, ua);
+    vs[nv++] = mesh__get(boxes[i].x0, va), vs[nv++] = mesh__get(boxes[i].x1, va);
+  }
+  nu = mesh__unique(us, nu);
+  nv = mesh__unique(vs, nv);
+  if (nu < 2 || nv < 2)
+    goto done;
+
+  /* cells[y*(nu-1) + x] is 1 if it should be drawn */
+  cells = (u8*)stack_push_ex(scratch, (nu-1) * (nv-1), 1);
+  if (!cells)
+    goto done;
+  memset(cells, 0, (nu-1) * (nv-1));
+
+  for (k = 0; k < n + num_boxes; ++k) {
+    int x0, x1, y0, y1;
+    u8 value;
+
+    if (k < n) {
+      x0 = mesh__find(us, nu, faces[k].u0), x1 = mesh__find(us, nu, faces[k].u1);
+      y0 = mesh__find(vs, nv, faces[k].v0), y1 = mesh__find(vs, nv, faces[k].v1);
+      value = 1;
+    } else {
+      Cube *b = boxes + k - n;
+      if (!mesh__covers(b, dir, c))
+        continue;
+      x0 = mesh__find(us, nu, mesh__get(b->x0, ua)), x1 = mesh__find(us, nu, mesh__get(b->x1, ua));
+      y0 = mesh__find(vs, nv, mesh__get(b->x0, va)), y1 = mesh__find(vs, nv, mesh__get(b->x1, va));
+      value = 0;
+    }
+    for (y = y0; y < y1; ++y)
+      memset(cells + y*(nu-1) + x0, value, x1 - x0);
+  }
+
+  /* greedy merge */
+  for (y = 0; y < nv-1; ++y)
+  for (x = 0; x < nu-1; ++x) {
+    int x1, y1;
+
+    if (!cells[y*(nu-1) + x])
+      continue;
+
+    for (x1 = x+1; x1 < nu-1 && cells[y*(nu-1) + x1]; ++x1);
+    for (y1 = y+1; y1 < nv-1; ++y1) {
+      for (j = x; j < x1 && cells[y1*(nu-1) + j]; ++j);
+      if (j < x1)
+        break;
+    }
+
+    for (j = y; j < y1; ++j)
+      memset(cells + j*(nu-1) + x, 0, x1 - x);
+    mesh__emit(m, dir, c, us[x], vs[y], us[x1], vs[y1], uv);
+  }
+
+  done:
+  stack_pop(scratch, top);
+}
+
+struct MeshQuadKey {
+  u32 chunk;
+  int quad;
+};
+
+static int mesh__cmp_quad_key(const void *a, const void *b) {
+  const MeshQuadKey *ka = (const MeshQuadKey*)a, *kb = (const MeshQuadKey*)b;
+  if (ka->chunk != kb->chunk)
+    return ka->chunk < kb->chunk ? -1 : 1;
+  return ka->quad - kb->quad;
+}
+
+/* Sorts the quads into chunks, see the top of the file. Past MESH_MAX_CHUNKS the last chunk takes the rest */
+static void mesh__chunk(BoxMesh *m, Stack *scratch) {
+  int num_quads = m->num_vertices / 6, i;
+  MeshChunk *chunk = 0;
+  MeshQuadKey *keys;
+  SpriteVertex *sorted;
+  unsigned char *top = scratch->curr;
+
+  m->num_chunks = 0;
+  keys = (MeshQuadKey*)stack_push_ex(scratch, num_quads * sizeof(*keys), alignof(MeshQuadKey));
+  sorted = (SpriteVertex*)stack_push_ex(scratch, m->num_vertices * sizeof(*sorted), alignof(SpriteVertex));
+  if (!keys || !sorted) {
+    /* one chunk with all of it */
+    m->chunks[0].first = 0;
+    m->chunks[0].count = m->num_vertices;
+    m->chunks[0].x0 = m->x0;
+    m->chunks[0].x1 = m->x1;
+    m->num_chunks = 1;
+    goto done;
+  }
+
+  for (i = 0; i < num_quads; ++i) {
+    v3 center = (m->quads[i].x0 + m->quads[i].x1) * 0.5f;
+    u32 cx = (u32)(int)floorf((center.x - m->x0.x) / MESH_CHUNK_SIZE);
+    u32 cy = (u32)(int)floorf((center.y - m->x0.y) / MESH_CHUNK_SIZE);
+    keys[i].chunk = (cy << 16) | (cx & 0xffff);
+    keys[i].quad = i;
+  }
+  qsort(keys, num_quads, sizeof(*keys), mesh__cmp_quad_key);
+
+  for (i = 0; i < num_quads; ++i) {
+    Cube *q = m->quads + keys[i].quad;
+
+    memcpy(sorted + i*6, m->vertices + keys[i].quad*6, 6 * sizeof(*sorted));
+    if (!chunk || (keys[i].chunk != keys[i-1].chunk && m->num_chunks < MESH_MAX_CHUNKS)) {
+      chunk = m->chunks + m->num_chunks++;
+      chunk->first = i*6;
+      chunk->count = 0;
+      chunk->x0 = q->x0;
+      chunk->x1 = q->x1;
+    }
+    chunk->count += 6;
+    chunk->x0 = v3{min(chunk->x0.x, q->x0.x), min(chunk->x0.y, q->x0.y), min(chunk->x0.z, q->x0.z)};
+    chunk->x1 = v3{max(chunk->x1.x, q->x1.x), max(chunk->x1.y, q->x1.y), max(chunk->x1.z, q->x1.z)};
+  }
+  memcpy(m->vertices, sorted, m->num_vertices * sizeof(*sorted));
+
+  done:
+  stack_pop(scratch, top);
+}
+
+/**
+ * Builds the mesh for the boxes, all faces get the texture coordinate uv on the given RenderTexture.
+ * scratch is only used during the call
+ */
+static void boxmesh_build(BoxMesh *m, Cube *boxes, int num_boxes, Stack *scratch, int texture, v2 uv) {
+  MeshFace *faces;
+  int num_faces = 0, i, j, dir;
+  unsigned char *top = scratch->curr;
+
+  m->num_vertices = 0;
+  m->texture = texture;
+  m->num_faces_in = 0;
+  m->num_faces_out = 0;
+  m->num_chunks = 0;
+  m->x0 = m->x1 = v3{0.0f, 0.0f, 0.0f};
+  if (!num_boxes)
+    return;
+
+  faces = (MeshFace*)stack_push_ex(scratch, 6 * num_boxes * sizeof(*faces), alignof(MeshFace));
+  if (!faces)
+    return;
+
+  m->x0 = boxes[0].x0;
+  m->x1 = boxes[0].x1;
+  for (i = 0; i < num_boxes; ++i) {
+    Cube *b = boxes + i;
+
+    m->x0 = v3{min(m->x0.x, b->x0.x), min(m->x0.y, b->x0.y), min(m->x0.z, b->x0.z)};
+    m->x1 = v3{max(m->x1.x, b->x1.x), max(m->x1.y, b->x1.y), max(m->x1.z, b->x1.z)};
+
+    for (dir = 0; dir < 6; ++dir) {
+      int axis = dir/2, ua = mesh__u_axis[axis], va = mesh__v_axis[axis];
+      MeshFace f;
+
+      f.dir = dir;
+      f.c = mesh__get(dir & 1 ? b->x1 : b->x0, axis);
+      f.u0 = mesh__get(b->x0, ua), f.u1 = mesh__get(b->x1, ua);
+      f.v0 = mesh__get(b->x0, va), f.v1 = mesh__get(b->x1, va);
+      ++m->num_faces_in;
+
+      /* flat boxes have no sides */
+      if (f.u1 - f.u0 <= MESH_EPSILON || f.v1 - f.v0 <= MESH_EPSILON)
+        continue;
+      faces[num_faces++] = f;
+    }
+  }
+
+  qsort(faces, num_faces, sizeof(*faces), mesh__cmp_face);
+  for (i = 0; i < num_faces; i = j) {
+    for (j = i+1; j < num_faces && faces[j].dir == faces[i].dir && faces[j].c - faces[i].c <= MESH_EPSILON; ++j);
+    mesh__plane(m, faces + i, j - i, boxes, num_boxes, scratch, uv);
+  }
+
+  stack_pop(scratch, top);
+  mesh__chunk(m, scratch);
+}
+
+#endif /* FLAT_MESH_H */
@@ -0,0 +1,170 @@
+/**
+ * Asset pack
+ *
+ * flat_packer writes all assets into one file, which is mapped once at startup, so that
+ * loading an asset is a lookup in the table of contents and a pointer into the mapping:
+ *
+ *   - the sprite atlas, already packed and decoded, with every mip level of every page
+ *     (see PackAtlas), which flat_texload.cpp hands to glTexSubImage3D as it is
+ *   - any other file, like shader sources and .glyphs bakes, byte for byte, under the
+ *     path the game opens it by, so asset_map finds it in the pack first
+ *
+ * Without a pack, or with one from another version, assets are loaded from their loose files,
+ * which asset_map still maps rather than reads. The atlas is also skipped if the sprites it was
+ * packed from have changed since, see pack_atlas.
+ *
+ * The file is little endian, and is
+ *
+ *   PackHeader
+ *   PackEntry entries[num_entries], by name
+ *   the data of every entry, PACK_ALIGN aligned, and followed by a zero that isn't part of its size,
+ *   so text can be used in place
+ */
+
+#define PACK_MAGIC 0x4b415046 /* "FPAK" */
+#define PACK_VERSION 2
+#define PACK_ALIGN 16
+#define PACK_MAX_NAME 56
+#define PACK_ATLAS_NAME "@atlas"
+
+struct PackHeader {
+  u32 magic, version;
+  u32 num_entries, reserved;
+};
+
+struct PackEntry {
+  char name[PACK_MAX_NAME]; /* zero terminated */
+  u32 offset, size;
+};
+
+/**
+ * The atlas entry, followed by the mip levels, largest first, each with all pages,
+ * which are RGBA, bottom row first, and max(w >> level, 1) by max(h >> level, 1)
+ */
+struct PackAtlas {
+  u64 hash; /* atlas_hash() of the sprites it was packed from */
+  i32 num_pages, w, h, num_levels;
+  AtlasSprite sprites[SPRITE_COUNT];
+};
+
+STATIC_ASSERT(sizeof(PackHeader) == 16, pack_header_is_packed);
+STATIC_ASSERT(sizeof(PackEntry) == 64, pack_entry_is_packed);
+
+struct Pack {
+  MappedFile file;
+  const PackEntry *entries;
+  int num_entries;
+};
+
+static Pack pack;
+
+/* A loaded asset, from the pack or its own file */
+struct Asset {
+  const u8 *data;
+  long size;
+  MappedFile file;
+};
+
+/* Maps the pack. Returns false, and leaves assets to their loose files, if it is missing or not usable */
+static bool pack_open(const char *filename) {
+  const PackHeader *h;
+  int i;
+
+  if (!file_map(filename, &pack.file))
+    return false;
+
+  h = (const PackHeader*)pack.file.data;
+  if (pack.file.size < (long)sizeof(*h) || h->magic != PACK_MAGIC || h->version != PACK_VERSION)
+    goto stale;
+  if ((long)h->num_entries > (pack.file.size - (long)sizeof(*h)) / (long)sizeof(PackEntry))
+    goto stale;
+  pack.entries = (const PackEntry*)(h + 1);
+  pack.num_entries = (int)h->num_entries;
+  for (i = 0; i < pack.num_entries; ++i) {
+    const PackEntry *e = pack.entries + i;
+    if (!memchr(e->name, 0, PACK_MAX_NAME) || e->offset % PACK_ALIGN || (long)e->offset + (long)e->size >= pack.file.size)
+      goto stale;
+    if (i && strcmp(pack.entries[i-1].name, e->name) >= 0)
+      goto stale;
+  }
+  return true;
+
+  stale:
+  fprintf(get_log_file(), "Asset pack %s is corrupt or out of date, loading loose files instead\n", filename);
+  file_unmap(&pack.file);
+  pack.entries = 0;
+  pack.num_entries = 0;
+  return false;
+}
+
+/* Returns the data of the entry, or 0 if the pack doesn't have it */
+static const u8* pack_find(const char *name, long *size) {
+  int lo = 0, hi = pack.num_entries - 1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2, cmp = strcmp(name, pack.entries[mid].name);
+    if (!cmp) {
+      *size = pack.entries[mid].size;
+      return pack.file.data + pack.entries[mid].offset;
+    }
+    if (cmp < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return 0;
+}
+
+/**
+ * Returns the atlas in the pack, or 0 if there is none or it was packed from other sprites than the ones hash,
+ * from atlas_hash(), was made from. A hash of 0 skips that check, for when the sprite files aren't there to compare with.
+ * Level l of the pages is at pack_atlas_level(a, l)
+ */
+static const PackAtlas* pack_atlas(u64 hash) {
+  const PackAtlas *a;
+  long size, needed;
+  int l;
+
+  a = (const PackAtlas*)pack_find(PACK_ATLAS_NAME, &size);
+  if (!a || size < (long)sizeof(*a))
+    return 0;
+  if (hash && a->hash != hash) {
+    fprintf(get_log_file(), "The atlas in the asset pack was made from other sprites, loading them instead\n");
+    return 0;
+  }
+  if (a->num_pages < 1 || a->num_pages > RENDERER_MAX_ATLAS_PAGES || a->w != RENDERER_ATLAS_PAGE_SIZE || a->h < 1 || a->h > RENDERER_ATLAS_PAGE_SIZE)
+    return 0;
+  if (a->num_levels < 1 || (max(a->w, a->h) >> (a->num_levels - 1)) != 1)
+    return 0;
+
+  needed = sizeof(*a);
+  for (l = 0; l < a->num_levels; ++l)
+    needed += (long)max(a->w >> l, 1) * max(a->h >> l, 1) * 4 * a->num_pages;
+  return size == needed ? a : 0;
+}
+
+static const u8* pack_atlas_level(const PackAtlas *a, int level) {
+  const u8 *p = (const u8*)(a + 1);
+  int l;
+
+  for (l = 0; l < level; ++l)
+    p += (long)max(a->w >> l, 1) * max(a->h >> l, 1) * 4 * a->num_pages;
+  return p;
+}
+
+/* Finds name in the pack, or maps the file called name. Returns false if neither works */
+static bool asset_map(const char *name, Asset *a) {
+  memset(a, 0, sizeof(*a));
+  a->data = pack_find(name, &a->size);
+  if (a->data)
+    return true;
+  if (!file_map(name, &a->file))
+    return false;
+  a->data = a->file.data;
+  a->size = a->file.size;
+  return true;
+}
+
+static void asset_unmap(Asset *a) {
+  file_unmap(&a->file);
+  a->data = 0;
+  a->size = 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * Offline asset packer
+ *
+ * Writes the asset pack that flat_pack.cpp maps at startup (see there for the format):
+ * the sprite atlas, packed and decoded the same way flat_atlas.cpp does at runtime, with a full
+ * mip chain made by atlas_downsample, and every file given on the
+ * command line, as it is.
+ *
+ * usage: flat_packer out.pack file...
+ *
+ * Files are stored under the paths they are given by, and the game looks them up by the paths it
+ * opens them with, so run it from the game's working directory with the same relative paths, e.g.
+ *
+ *   flat_packer ../../assets/assets.pack ../../assets/Roboto-Regular.glyphs ../../assets/shaders/sprite_vertex.glsl ...
+ *
+ * Run it again whenever an asset changes, the game reads the pack instead of the files.
+ */
+#include "flat_math.hpp"
+#include "flat_utils.cpp"
+#include "flat_platform_api.hpp"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.hpp"
+
+#include "flat_pack.cpp"
+#include "flat_atlas.cpp"
+
+#define PACKER_MAX_ENTRIES 256
+
+struct PackerEntry {
+  PackEntry entry;
+  const u8 *data;
+};
+
+static PackerEntry packer_entries[PACKER_MAX_ENTRIES];
+static int packer_num_entries;
+
+static void packer_add(const char *name, const u8 *data, long size) {
+  PackerEntry *e;
+
+  if (packer_num_entries == PACKER_MAX_ENTRIES)
+    die("More than %i assets\n", PACKER_MAX_ENTRIES);
+  if ((int)strlen(name) >= PACK_MAX_NAME)
+    die("Asset name %s is longer than %i characters\n", name, PACK_MAX_NAME - 1);
+  e = packer_entries + packer_num_entries++;
+  memset(e, 0, sizeof(*e));
+  strcpy(e->entry.name, name);
+  e->entry.size = (u32)size;
+  e->data = data;
+}
+
+static int packer__cmp_name(const void *a, const void *b) {
+  return strcmp(((const PackerEntry*)a)->entry.name, ((const PackerEntry*)b)->entry.name);
+}
+
+/* Packs and decodes the sprites, and lays out their mip levels after a PackAtlas */
+static u8* packer_atlas(long *size) {
+  static AtlasLayout layout;
+  PackAtlas *a;
+  u8 *level, *prev;
+  long page_size, prev_size;
+  int i, l, w, h;
+
+  a = (PackAtlas*)calloc(1, sizeof(*a));
+  if (!a) die("Out of memory\n");
+  atlas_build(&layout, a->sprites);
+  a->hash = atlas_hash();
+  a->num_pages = layout.num_pages;
+  a->w = RENDERER_ATLAS_PAGE_SIZE;
+  a->h = layout.h;
+  a->num_levels = atlas_num_levels(a->w, a->h);
+
+  *size = sizeof(*a);
+  for (l = 0; l < a->num_levels; ++l)
+    *size += (long)max(a->w >> l, 1) * max(a->h >> l, 1) * 4 * a->num_pages;
+  a = (PackAtlas*)realloc(a, *size);
+  if (!a) die("Out of memory\n");
+
+  /* level 0 is the pages, and every level after it is made from the one before */
+  level = (u8*)(a + 1);
+  page_size = (long)a->w * a->h * 4;
+  for (i = 0; i < a->num_pages; ++i) {
+    memcpy(level + i*page_size, layout.pages[i].pixels, page_size);
+    free(layout.pages[i].pixels);
+  }
+  for (l = 1; l < a->num_levels; ++l) {
+    w = max(a->w >> (l-1), 1);
+    h = max(a->h >> (l-1), 1);
+    prev = level;
+    prev_size = (long)w * h * 4;
+    level += prev_size * a->num_pages;
+    page_size = (long)max(w/2, 1) * max(h/2, 1) * 4;
+    for (i = 0; i < a->num_pages; ++i)
+      atlas_downsample(prev + i*prev_size, w, h, level + i*page_size);
+  }
+  return (u8*)a;
+}
+
+static void packer_write(FILE *f, const void *data, size_t size, const char *filename) {
+  if (size && fwrite(data, size, 1, f) != 1)
+    die("Failed to write %s: %s\n", filename, flat_strerror(errno));
+}
+
+int main(int argc, char **argv) {
+  static const u8 padding[PACK_ALIGN] = {};
+  PackHeader header = {};
+  MappedFile *files;
+  u8 *atlas;
+  long atlas_size, offset;
+  int i;
+  FILE *f;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s out.pack file...\n", argv[0]);
+    return 1;
+  }
+
+  atlas = packer_atlas(&atlas_size);
+  packer_add(PACK_ATLAS_NAME, atlas, atlas_size);
+
+  files = (MappedFile*)calloc(argc, sizeof(*files));
+  if (!files) die("Out of memory\n");
+  for (i = 2; i < argc; ++i) {
+    if (!file_map(argv[i], files + i))
+      die("Failed to open %s: %s\n", argv[i], flat_strerror(errno));
+    packer_add(argv[i], files[i].data, files[i].size);
+  }
+  qsort(packer_entries, packer_num_entries, sizeof(*packer_entries), packer__cmp_name);
+  for (i = 1; i < packer_num_entries; ++i)
+    if (!strcmp(packer_entries[i-1].entry.name, packer_entries[i].entry.name))
+      die("%s is given twice\n", packer_entries[i].entry.name);
+
+  /* every entry is followed by a zero, and then padded */
+  offset = ALIGN(sizeof(header) + packer_num_entries * sizeof(PackEntry), PACK_ALIGN);
+  for (i = 0; i < packer_num_entries; ++i) {
+    PackEntry *e = &packer_entries[i].entry;
+    if (offset + (long)e->size + 1 > 0x7fffffffL)
+      die("The pack is bigger than 2 GB\n");
+    e->offset = (u32)offset;
+    offset = ALIGN(offset + e->size + 1, PACK_ALIGN);
+  }
+
+  header.magic = PACK_MAGIC;
+  header.version = PACK_VERSION;
+  header.num_entries = packer_num_entries;
+
+  f = flat_fopen(argv[1], "wb");
+  if (!f) die("Failed to open %s: %s\n", argv[1], flat_strerror(errno));
+  packer_write(f, &header, sizeof(header), argv[1]);
+  for (i = 0; i < packer_num_entries; ++i)
+    packer_write(f, &packer_entries[i].entry, sizeof(PackEntry), argv[1]);
+  offset = sizeof(header) + packer_num_entries * sizeof(PackEntry);
+  for (i = 0; i < packer_num_entries; ++i) {
+    PackEntry *e = &packer_entries[i].entry;
+    packer_write(f, padding, e->offset - offset, argv[1]);
+    packer_write(f, packer_entries[i].data, e->size, argv[1]);
+    packer_write(f, padding, 1, argv[1]);
+    offset = e->offset + e->size + 1;
+  }
+  if (fclose(f))
+    die("Failed to write %s: %s\n", argv[1], flat_strerror(errno));
+
+  printf("packed %i assets, %li bytes, into %s\n", packer_num_entries, offset, argv[1]);
+  for (i = 2; i < argc; ++i)
+    file_unmap(files + i);
+  free(files);
+  free(atlas);
+  return 0;
+}
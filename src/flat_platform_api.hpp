@@ -27,8 +27,34 @@ struct Input {
 /********************/
 /*** PLATFORM API ***/
 /********************/
+/**
+ * Calls fn(data, index, thread) for every index in [0, count), spread out over worker threads.
+ * Returns when all calls are done.
+ * thread is in [0, RENDERER_MAX_THREADS), and no two calls running at the same time get the same one,
+ * so it can be used to pick a RenderArena.
+ */
+typedef void (*ParallelForFun)(void *data, int index, int thread);
+
+/**
+ * Returns the glyph for a unicode codepoint, rasterizing it if needed. Only call it from the thread running main_loop.
+ * If the frame has run out of room for new glyphs, the glyph is empty, but still advances, and Renderer::num_glyphs_missing goes up
+ */
+typedef Glyph (*GlyphGetFun)(Renderer *r, u32 codepoint);
+
+/* Returns the kerning between two codepoints, to add to the advance of the first, at RENDERER_FONT_SIZE. Main thread only */
+typedef float (*GlyphKernFun)(u32 first, u32 second);
+
+/**
+ * Marks the glyphs in the cells (Glyph::cell) as used this frame, for anything that draws glyphs it got earlier
+ * without asking for them again, so they aren't evicted while it does. Main thread only
+ */
+typedef void (*GlyphTouchFun)(const u16 *cells, int count);
+
 struct Funs {
-	void *dummy;
+	void (*parallel_for)(ParallelForFun fn, void *data, int count);
+	GlyphGetFun glyph_get;
+	GlyphKernFun glyph_kern;
+	GlyphTouchFun glyph_touch;
 };
 
 #define GAME_MAIN_LOOP(name) int name(void* memory, long ms, Input input, Renderer *renderer)
@@ -0,0 +1,120 @@
+/**
+ * Frame timings
+ *
+ * Every timed span of a frame, on the CPU or the GPU, goes through profile_record,
+ * which keeps running totals per stat for profile_stats_print, and if FLAT_TRACE is set,
+ * writes the span to that file in the Chrome trace event format,
+ * so a run can be looked at in chrome://tracing or Perfetto.
+ *
+ * Times are in milliseconds since profile_init. Can be called from any thread.
+ */
+
+enum ProfileStat {
+  PROFILE_GAME,
+  PROFILE_RENDER,
+  PROFILE_SWAP,
+  PROFILE_GPU_FRAME,
+  PROFILE_GPU_UPLOAD,
+  PROFILE_GPU_SPRITES,
+  PROFILE_GPU_ANIM_SPRITES,
+  PROFILE_GPU_TEXT,
+  PROFILE_GPU_CUBES,
+  PROFILE_GPU_BLIT,
+  PROFILE_COUNT
+};
+
+static const char *profile_stat_names[] = {
+  "game",
+  "render",
+  "swap",
+  "gpu frame",
+  "gpu upload",
+  "gpu sprites",
+  "gpu anim sprites",
+  "gpu text",
+  "gpu cubes",
+  "gpu blit",
+};
+STATIC_ASSERT(ARRAY_LEN(profile_stat_names) == PROFILE_COUNT, all_profile_stats_named);
+
+/* The rows of the trace */
+enum ProfileThread {
+  PROFILE_THREAD_MAIN,
+  PROFILE_THREAD_RENDER,
+  PROFILE_THREAD_GPU
+};
+
+struct ProfileStats {
+  double total_ms[PROFILE_COUNT];
+  double max_ms[PROFILE_COUNT];
+  long count[PROFILE_COUNT];
+};
+
+struct Profiler {
+  SDL_mutex *lock;
+  Uint64 start;
+  FILE *trace;
+  bool first_event;
+  ProfileStats stats;
+};
+
+static Profiler profiler;
+
+static void profile_init() {
+  const char *trace_file = SDL_getenv("FLAT_TRACE");
+
+  profiler.lock = SDL_CreateMutex();
+  if (!profiler.lock)
+    die("%s\n", SDL_GetError());
+  profiler.start = SDL_GetPerformanceCounter();
+
+  if (trace_file) {
+    profiler.trace = flat_fopen(trace_file, "w");
+    if (!profiler.trace)
+      die("Could not open trace file %s: %s\n", trace_file, flat_strerror(errno));
+    fprintf(profiler.trace, "{\"traceEvents\":[\n");
+    fprintf(profiler.trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%i,\"args\":{\"name\":\"main\"}},\n", PROFILE_THREAD_MAIN);
+    fprintf(profiler.trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%i,\"args\":{\"name\":\"render\"}},\n", PROFILE_THREAD_RENDER);
+    fprintf(profiler.trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%i,\"args\":{\"name\":\"gpu\"}}", PROFILE_THREAD_GPU);
+  }
+}
+
+/* Must be called once the other threads are done recording */
+static void profile_close() {
+  if (profiler.trace) {
+    fprintf(profiler.trace, "\n]}\n");
+    fclose(profiler.trace);
+    profiler.trace = 0;
+  }
+}
+
+static double profile_now() {
+  return (SDL_GetPerformanceCounter() - profiler.start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static void profile_record(ProfileStat stat, ProfileThread thread, double start_ms, double ms) {
+  SDL_LockMutex(profiler.lock);
+
+  profiler.stats.total_ms[stat] += ms;
+  profiler.stats.max_ms[stat] = max(profiler.stats.max_ms[stat], ms);
+  ++profiler.stats.count[stat];
+
+  if (profiler.trace)
+    fprintf(profiler.trace, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}",
+      profile_stat_names[stat], thread, start_ms * 1000.0, ms * 1000.0);
+
+  SDL_UnlockMutex(profiler.lock);
+}
+
+static void profile_stats_print(FILE *f) {
+  int i;
+
+  SDL_LockMutex(profiler.lock);
+  for (i = 0; i < PROFILE_COUNT; ++i) {
+    if (!profiler.stats.count[i])
+      continue;
+    fprintf(f, "  %-16s %8.3f ms average, %8.3f ms max, %6li samples\n", profile_stat_names[i],
+      profiler.stats.total_ms[i] / profiler.stats.count[i], profiler.stats.max_ms[i], profiler.stats.count[i]);
+  }
+  SDL_UnlockMutex(profiler.lock);
+}
@@ -0,0 +1,523 @@
+/**
+ * Platform side of the renderer
+ *
+ * Sorts the render commands pushed by the game, copies their vertices
+ * into staging arrays in sorted order, and merges runs of commands that
+ * share the same state into batches, each of which is a single draw.
+ * The lights are binned into clusters along the way (see flat_lights.cpp).
+ */
+
+struct RenderUniforms {
+  v3 camera;
+  float near_z, far_z;
+  v2 nearsize;
+  float time;
+  RenderAnimations animations;
+};
+
+struct RenderBatch {
+  u64 key; /* of the first command, the depth bits are meaningless */
+  int first, count;
+};
+
+#define RENDER_QUEUE_MAX_COMMANDS (RENDERER_MAX_THREADS * ARRAY_LEN(((RenderArena*)0)->commands))
+
+struct RenderQueue {
+  RenderCommand commands[RENDER_QUEUE_MAX_COMMANDS];
+  RenderCommand tmp[RENDER_QUEUE_MAX_COMMANDS];
+  int num_commands;
+
+  SpriteVertex vertices[RENDERER_MAX_THREADS * ARRAY_LEN(((RenderArena*)0)->vertices)];
+  int num_vertices;
+  TextVertex text_vertices[RENDERER_MAX_THREADS * ARRAY_LEN(((RenderArena*)0)->text_vertices)];
+  int num_text_vertices;
+  SpriteInstance instances[RENDERER_MAX_THREADS * ARRAY_LEN(((RenderArena*)0)->instances)];
+  int num_instances;
+  CubeInstance cubes[RENDERER_MAX_THREADS * ARRAY_LEN(((RenderArena*)0)->cubes)];
+  int num_cubes;
+
+  RenderBatch batches[RENDER_QUEUE_MAX_COMMANDS];
+  int num_batches;
+
+  RenderUniforms uniforms;
+  LightClusters lights;
+
+  /* the glyph cells that changed, one after the other, w*h bytes each */
+  GlyphUpload glyph_uploads[RENDERER_MAX_GLYPH_UPLOADS];
+  int num_glyph_uploads, num_glyph_pixels;
+  u8 glyph_pixels[RENDERER_MAX_GLYPH_UPLOADS * RENDERER_MAX_GLYPH_SIZE * RENDERER_MAX_GLYPH_SIZE];
+};
+
+/**
+ * LSD radix sort, one byte per pass.
+ * Passes where all keys share the same byte are skipped, which is the common case
+ * for the layer, shader and texture bytes.
+ *
+ * Stable, so commands with equal keys are drawn in the order they were pushed.
+ */
+static void render_commands_sort(RenderCommand *commands, RenderCommand *tmp, int n) {
+  RenderCommand *src, *dst, *swap;
+  int pass, i;
+
+  if (n <= 1)
+    return;
+
+  src = commands;
+  dst = tmp;
+  for (pass = 0; pass < 8; ++pass) {
+    int offsets[256] = {};
+    int shift = pass*8, sum;
+
+    for (i = 0; i < n; ++i)
+      ++offsets[(src[i].key >> shift) & 0xff];
+
+    if (offsets[(src[0].key >> shift) & 0xff] == n)
+      continue;
+
+    for (sum = 0, i = 0; i < 256; ++i) {
+      int c = offsets[i];
+      offsets[i] = sum;
+      sum += c;
+    }
+
+    for (i = 0; i < n; ++i)
+      dst[offsets[(src[i].key >> shift) & 0xff]++] = src[i];
+
+    swap = src, src = dst, dst = swap;
+  }
+
+  if (src != commands)
+    memcpy(commands, src, n * sizeof(*commands));
+}
+
+static void render_queue_build(RenderQueue *q, Renderer *r) {
+  RenderUniforms *u = &q->uniforms;
+  int i, j;
+  RenderBatch *batch;
+
+  u->camera = r->camera_pos;
+  u->near_z = RENDERER_NEAR_Z;
+  u->far_z = RENDERER_FAR_Z;
+  u->nearsize.x = - 2.0f * RENDERER_NEAR_Z * (float)tan(RENDERER_FOV/2.0f);
+  u->nearsize.y = u->nearsize.x / RENDERER_ASPECT;
+  u->time = r->time;
+  u->animations = r->animations;
+
+  lights_clear(&q->lights);
+  for (i = 0; i < RENDERER_MAX_THREADS; ++i)
+    lights_push(&q->lights, r->arenas[i].lights, r->arenas[i].num_lights);
+  lights_bin(&q->lights, u->camera, u->near_z, u->far_z, u->nearsize);
+
+  /* copy the new glyphs out of the layer, which the game goes on rasterizing into */
+  q->num_glyph_uploads = r->num_glyph_uploads;
+  q->num_glyph_pixels = 0;
+  for (i = 0; i < r->num_glyph_uploads; ++i) {
+    GlyphUpload *up = r->glyph_uploads + i;
+    q->glyph_uploads[i] = *up;
+    for (j = 0; j < up->h; ++j)
+      memcpy(q->glyph_pixels + q->num_glyph_pixels + j*up->w, r->glyph_pixels + (up->y + j)*r->atlas_size.x + up->x, up->w);
+    q->num_glyph_pixels += up->w * up->h;
+  }
+
+  /* concatenate the arenas. Jobs go to whichever thread is free, so the order of commands with equal keys from different jobs isn't deterministic */
+  q->num_commands = 0;
+  for (i = 0; i < RENDERER_MAX_THREADS; ++i) {
+    RenderArena *a = r->arenas + i;
+    for (j = 0; j < a->num_commands; ++j) {
+      q->commands[q->num_commands] = a->commands[j];
+      q->commands[q->num_commands].arena = i;
+      ++q->num_commands;
+    }
+  }
+  render_commands_sort(q->commands, q->tmp, q->num_commands);
+
+  q->num_vertices = 0;
+  q->num_text_vertices = 0;
+  q->num_instances = 0;
+  q->num_cubes = 0;
+  q->num_batches = 0;
+  batch = 0;
+
+  for (i = 0; i < q->num_commands; ++i) {
+    RenderCommand *c = q->commands + i;
+    RenderArena *a = r->arenas + c->arena;
+    int first;
+
+    switch (render_key_shader(c->key)) {
+      case RENDER_SHADER_SPRITE:
+        first = q->num_vertices;
+        memcpy(q->vertices + first, a->vertices + c->first, c->count * sizeof(*q->vertices));
+        q->num_vertices += c->count;
+        break;
+
+      case RENDER_SHADER_TEXT:
+        first = q->num_text_vertices;
+        memcpy(q->text_vertices + first, a->text_vertices + c->first, c->count * sizeof(*q->text_vertices));
+        q->num_text_vertices += c->count;
+        break;
+
+      case RENDER_SHADER_ANIM_SPRITE:
+        first = q->num_instances;
+        memcpy(q->instances + first, a->instances + c->first, c->count * sizeof(*q->instances));
+        q->num_instances += c->count;
+        break;
+
+      case RENDER_SHADER_CUBE:
+        first = q->num_cubes;
+        memcpy(q->cubes + first, a->cubes + c->first, c->count * sizeof(*q->cubes));
+        q->num_cubes += c->count;
+        break;
+
+      default:
+        die("Unknown shader in render command (%i)\n", render_key_shader(c->key));
+        return;
+    }
+
+    if (batch && render_key_batch(batch->key) == render_key_batch(c->key)) {
+      batch->count += c->count;
+      continue;
+    }
+
+    batch = q->batches + q->num_batches++;
+    batch->key = c->key;
+    batch->first = first;
+    batch->count = c->count;
+  }
+}
+
+/**
+ * Render backends
+ *
+ * Everything that talks to the GPU once a frame has been sorted and batched goes through a RenderBackend,
+ * so that the same frame can be drawn with GL, thrown away, recorded to a file, or replayed.
+ * This lets us time the game's geometry generation without the driver (null backend),
+ * and the driver without the game (record a session, then replay it into the GL backend).
+ *
+ * For every frame, render_queue_submit calls begin_frame once, upload_glyphs once, upload once for each
+ * vertex format, upload_lights once, draw once for each batch, and then end_frame.
+ */
+
+struct RenderBackend {
+  void *data;
+  /* clear the frame and set the uniforms for every shader */
+  void (*begin_frame)(void *data, RenderUniforms *uniforms);
+  /* replaces the vertices (or instances) used by all draws with this shader */
+  void (*upload)(void *data, int shader, const void *vertices, int num_vertices);
+  /* copies rectangles of pixels into the RENDER_TEXTURE_TEXT layer, pixels has w*h bytes for each, one after the other */
+  void (*upload_glyphs)(void *data, const GlyphUpload *uploads, int num_uploads, const u8 *pixels);
+  /* replaces the lights and their clusters */
+  void (*upload_lights)(void *data, const LightClusters *lights);
+  /* texture is that of the first command in the batch, the vertices say which they use */
+  void (*draw)(void *data, int shader, int texture, int first, int count);
+  void (*end_frame)(void *data);
+};
+
+static int render_shader_vertex_size(int shader) {
+  switch (shader) {
+    case RENDER_SHADER_SPRITE: return sizeof(SpriteVertex);
+    case RENDER_SHADER_TEXT: return sizeof(TextVertex);
+    case RENDER_SHADER_ANIM_SPRITE: return sizeof(SpriteInstance);
+    case RENDER_SHADER_CUBE: return sizeof(CubeInstance);
+  }
+  die("Unknown shader %i\n", shader);
+  return 0;
+}
+
+static void render_queue_submit(RenderQueue *q, RenderBackend *backend) {
+  int i;
+
+  backend->begin_frame(backend->data, &q->uniforms);
+  backend->upload_glyphs(backend->data, q->glyph_uploads, q->num_glyph_uploads, q->glyph_pixels);
+  backend->upload(backend->data, RENDER_SHADER_SPRITE, q->vertices, q->num_vertices);
+  backend->upload(backend->data, RENDER_SHADER_TEXT, q->text_vertices, q->num_text_vertices);
+  backend->upload(backend->data, RENDER_SHADER_ANIM_SPRITE, q->instances, q->num_instances);
+  backend->upload(backend->data, RENDER_SHADER_CUBE, q->cubes, q->num_cubes);
+  backend->upload_lights(backend->data, &q->lights);
+  for (i = 0; i < q->num_batches; ++i) {
+    RenderBatch *b = q->batches + i;
+    backend->draw(backend->data, render_key_shader(b->key), render_key_texture(b->key), b->first, b->count);
+  }
+  backend->end_frame(backend->data);
+}
+
+/* ======= Null backend ======= */
+
+static void null_begin_frame(void *data, RenderUniforms *uniforms) {}
+static void null_upload(void *data, int shader, const void *vertices, int num_vertices) {}
+static void null_upload_lights(void *data, const LightClusters *lights) {}
+static void null_upload_glyphs(void *data, const GlyphUpload *uploads, int num_uploads, const u8 *pixels) {}
+static void null_draw(void *data, int shader, int texture, int first, int count) {}
+static void null_end_frame(void *data) {}
+
+static RenderBackend null_backend_create() {
+  RenderBackend b;
+  b.data = 0;
+  b.begin_frame = null_begin_frame;
+  b.upload = null_upload;
+  b.upload_lights = null_upload_lights;
+  b.upload_glyphs = null_upload_glyphs;
+  b.draw = null_draw;
+  b.end_frame = null_end_frame;
+  return b;
+}
+
+/* ======= Recording backend ======= */
+
+/**
+ * Writes the draw stream to a file, and optionally passes it on to another backend.
+ *
+ * The file starts with a RecordHeader, followed by one record per backend call,
+ * each of which is a RecordTag and the call's arguments.
+ * Uploads are followed by the vertex data, lights by the lights, all clusters, and the indices,
+ * and glyphs by the rectangles and their pixels.
+ * Everything is written as raw structs, so recordings are only meant to be replayed by the same build.
+ */
+
+#define RECORD_MAGIC 0x43455246 /* "FREC" */
+#define RECORD_VERSION 6
+
+struct RecordHeader {
+  u32 magic, version;
+  u32 sprite_vertex_size, text_vertex_size, sprite_instance_size, cube_instance_size;
+};
+
+enum RecordTag {
+  RECORD_BEGIN_FRAME,
+  RECORD_UPLOAD,
+  RECORD_LIGHTS,
+  RECORD_GLYPHS,
+  RECORD_DRAW,
+  RECORD_END_FRAME
+};
+
+struct RecordDraw {
+  i32 shader, texture, first, count;
+};
+
+struct RecordUpload {
+  i32 shader, num_vertices;
+};
+
+struct RecordLights {
+  i32 num_lights, num_indices;
+};
+
+struct RecordGlyphs {
+  i32 num_uploads, num_pixels;
+};
+
+struct Recorder {
+  FILE *file;
+  RenderBackend *next; /* can be null */
+};
+
+static void recorder__write(Recorder *r, const void *data, size_t size) {
+  if (fwrite(data, 1, size, r->file) != size)
+    die("Failed to write render recording: %s\n", flat_strerror(errno));
+}
+
+static void recorder__tag(Recorder *r, u32 tag) {
+  recorder__write(r, &tag, sizeof(tag));
+}
+
+static void recorder_begin_frame(void *data, RenderUniforms *uniforms) {
+  Recorder *r = (Recorder*)data;
+  recorder__tag(r, RECORD_BEGIN_FRAME);
+  recorder__write(r, uniforms, sizeof(*uniforms));
+  if (r->next) r->next->begin_frame(r->next->data, uniforms);
+}
+
+static void recorder_upload(void *data, int shader, const void *vertices, int num_vertices) {
+  Recorder *r = (Recorder*)data;
+  RecordUpload u = {shader, num_vertices};
+  recorder__tag(r, RECORD_UPLOAD);
+  recorder__write(r, &u, sizeof(u));
+  recorder__write(r, vertices, num_vertices * render_shader_vertex_size(shader));
+  if (r->next) r->next->upload(r->next->data, shader, vertices, num_vertices);
+}
+
+static void recorder_upload_lights(void *data, const LightClusters *lights) {
+  Recorder *r = (Recorder*)data;
+  RecordLights l = {lights->num_lights, lights->num_indices};
+  recorder__tag(r, RECORD_LIGHTS);
+  recorder__write(r, &l, sizeof(l));
+  recorder__write(r, lights->lights, lights->num_lights * sizeof(*lights->lights));
+  recorder__write(r, lights->clusters, sizeof(lights->clusters));
+  recorder__write(r, lights->indices, lights->num_indices * sizeof(*lights->indices));
+  if (r->next) r->next->upload_lights(r->next->data, lights);
+}
+
+static void recorder_upload_glyphs(void *data, const GlyphUpload *uploads, int num_uploads, const u8 *pixels) {
+  Recorder *r = (Recorder*)data;
+  RecordGlyphs g = {num_uploads, 0};
+  int i;
+
+  for (i = 0; i < num_uploads; ++i)
+    g.num_pixels += uploads[i].w * uploads[i].h;
+  recorder__tag(r, RECORD_GLYPHS);
+  recorder__write(r, &g, sizeof(g));
+  recorder__write(r, uploads, num_uploads * sizeof(*uploads));
+  recorder__write(r, pixels, g.num_pixels);
+  if (r->next) r->next->upload_glyphs(r->next->data, uploads, num_uploads, pixels);
+}
+
+static void recorder_draw(void *data, int shader, int texture, int first, int count) {
+  Recorder *r = (Recorder*)data;
+  RecordDraw d = {shader, texture, first, count};
+  recorder__tag(r, RECORD_DRAW);
+  recorder__write(r, &d, sizeof(d));
+  if (r->next) r->next->draw(r->next->data, shader, texture, first, count);
+}
+
+static void recorder_end_frame(void *data) {
+  Recorder *r = (Recorder*)data;
+  recorder__tag(r, RECORD_END_FRAME);
+  if (r->next) r->next->end_frame(r->next->data);
+}
+
+static RenderBackend recorder_create(Recorder *r, const char *filename, RenderBackend *next) {
+  RenderBackend b;
+  RecordHeader h = {RECORD_MAGIC, RECORD_VERSION, sizeof(SpriteVertex), sizeof(TextVertex), sizeof(SpriteInstance), sizeof(CubeInstance)};
+
+  r->next = next;
+  r->file = flat_fopen(filename, "wb");
+  if (!r->file)
+    die("Failed to open %s for recording: %s\n", filename, flat_strerror(errno));
+  recorder__write(r, &h, sizeof(h));
+
+  b.data = r;
+  b.begin_frame = recorder_begin_frame;
+  b.upload = recorder_upload;
+  b.upload_lights = recorder_upload_lights;
+  b.upload_glyphs = recorder_upload_glyphs;
+  b.draw = recorder_draw;
+  b.end_frame = recorder_end_frame;
+  return b;
+}
+
+static void recorder_close(Recorder *r) {
+  if (fclose(r->file))
+    die("Failed to close render recording: %s\n", flat_strerror(errno));
+  r->file = 0;
+}
+
+/* ======= Replay ======= */
+
+static bool replay__read(FILE *f, void *data, size_t size) {
+  return fread(data, 1, size, f) == size;
+}
+
+/* Opens a recording and checks that it was made by this build */
+static FILE* replay_open(const char *filename) {
+  RecordHeader h;
+  FILE *f;
+
+  f = flat_fopen(filename, "rb");
+  if (!f)
+    die("Failed to open render recording %s: %s\n", filename, flat_strerror(errno));
+  if (!replay__read(f, &h, sizeof(h)) || h.magic != RECORD_MAGIC)
+    die("%s is not a render recording\n", filename);
+  if (h.version != RECORD_VERSION || h.sprite_vertex_size != sizeof(SpriteVertex) || h.text_vertex_size != sizeof(TextVertex) || h.sprite_instance_size != sizeof(SpriteInstance) || h.cube_instance_size != sizeof(CubeInstance))
+    die("%s was recorded by a different version\n", filename);
+  return f;
+}
+
+/**
+ * Plays back the next frame of a recording into backend.
+ * The vertex arrays of q are used as scratch memory.
+ *
+ * Returns false at the end of the recording
+ */
+static bool replay_frame(FILE *f, RenderQueue *q, RenderBackend *backend) {
+  u32 tag;
+
+  if (!replay__read(f, &tag, sizeof(tag)))
+    return false;
+  if (tag != RECORD_BEGIN_FRAME)
+    die("Render recording is corrupt, expected the start of a frame\n");
+
+  for (;;) {
+    switch (tag) {
+      case RECORD_BEGIN_FRAME: {
+        RenderUniforms u;
+        if (!replay__read(f, &u, sizeof(u))) goto truncated;
+        backend->begin_frame(backend->data, &u);
+      } break;
+
+      case RECORD_UPLOAD: {
+        RecordUpload u;
+        void *vertices;
+        int max_vertices;
+
+        if (!replay__read(f, &u, sizeof(u))) goto truncated;
+        switch (u.shader) {
+          case RENDER_SHADER_SPRITE: vertices = q->vertices, max_vertices = ARRAY_LEN(q->vertices); break;
+          case RENDER_SHADER_TEXT: vertices = q->text_vertices, max_vertices = ARRAY_LEN(q->text_vertices); break;
+          case RENDER_SHADER_ANIM_SPRITE: vertices = q->instances, max_vertices = ARRAY_LEN(q->instances); break;
+          case RENDER_SHADER_CUBE: vertices = q->cubes, max_vertices = ARRAY_LEN(q->cubes); break;
+          default: die("Render recording is corrupt, unknown shader %i\n", u.shader); return false;
+        }
+        if (u.num_vertices < 0 || u.num_vertices > max_vertices)
+          die("Render recording is corrupt, %i vertices in one upload\n", u.num_vertices);
+        if (!replay__read(f, vertices, u.num_vertices * render_shader_vertex_size(u.shader))) goto truncated;
+        backend->upload(backend->data, u.shader, vertices, u.num_vertices);
+      } break;
+
+      case RECORD_LIGHTS: {
+        LightClusters *c = &q->lights;
+        RecordLights l;
+
+        if (!replay__read(f, &l, sizeof(l))) goto truncated;
+        if (l.num_lights < 0 || l.num_lights > (int)LIGHT_MAX_LIGHTS || l.num_indices < 0 || l.num_indices > LIGHT_MAX_INDICES)
+          die("Render recording is corrupt, %i lights and %i light indices\n", l.num_lights, l.num_indices);
+        c->num_lights = l.num_lights;
+        c->num_indices = l.num_indices;
+        if (!replay__read(f, c->lights, c->num_lights * sizeof(*c->lights))) goto truncated;
+        if (!replay__read(f, c->clusters, sizeof(c->clusters))) goto truncated;
+        if (!replay__read(f, c->indices, c->num_indices * sizeof(*c->indices))) goto truncated;
+        backend->upload_lights(backend->data, c);
+      } break;
+
+      case RECORD_GLYPHS: {
+        RecordGlyphs g;
+        int i, num_pixels = 0;
+
+        if (!replay__read(f, &g, sizeof(g))) goto truncated;
+        if (g.num_uploads < 0 || g.num_uploads > RENDERER_MAX_GLYPH_UPLOADS)
+          die("Render recording is corrupt, %i glyph uploads\n", g.num_uploads);
+        if (!replay__read(f, q->glyph_uploads, g.num_uploads * sizeof(*q->glyph_uploads))) goto truncated;
+        for (i = 0; i < g.num_uploads; ++i) {
+          GlyphUpload *up = q->glyph_uploads + i;
+          if (up->w > RENDERER_MAX_GLYPH_SIZE || up->h > RENDERER_MAX_GLYPH_SIZE)
+            die("Render recording is corrupt, glyph upload of %ix%i\n", up->w, up->h);
+          num_pixels += up->w * up->h;
+        }
+        if (num_pixels != g.num_pixels)
+          die("Render recording is corrupt, glyph uploads don't add up\n");
+        if (!replay__read(f, q->glyph_pixels, num_pixels)) goto truncated;
+        backend->upload_glyphs(backend->data, q->glyph_uploads, g.num_uploads, q->glyph_pixels);
+      } break;
+
+      case RECORD_DRAW: {
+        RecordDraw d;
+        if (!replay__read(f, &d, sizeof(d))) goto truncated;
+        backend->draw(backend->data, d.shader, d.texture, d.first, d.count);
+      } break;
+
+      case RECORD_END_FRAME:
+        backend->end_frame(backend->data);
+        return true;
+
+      default:
+        die("Render recording is corrupt, unknown record %u\n", tag);
+    }
+
+    if (!replay__read(f, &tag, sizeof(tag))) goto truncated;
+    if (tag == RECORD_BEGIN_FRAME)
+      die("Render recording is corrupt, frame was never ended\n");
+  }
+
+  truncated:
+  die("Render recording is truncated\n");
+  return false;
+}
@@ -1,16 +1,128 @@
-struct Texture {
-  GLuint id;
-  v2i size;
+struct Shader {
+  GLuint program;
+  /* locations */
+  GLint
+    camera_loc,
+    far_z_loc,
+    near_z_loc,
+    nearsize_loc,
+    time_loc,
+    anim_rect_loc,
+    anim_step_loc,
+    anim_frame_time_loc,
+    first_loc,
+    count_loc
+    ;
 };
 
+/**
+ * Sprite vertices are packed into 16 bytes:
+ *
+ *   pos:    fixed point with 1/RENDERER_POS_SCALE precision, giving a range of about +-128 units.
+ *           pack_pos clamps anything outside that range, and logs the first clamped value in debug builds.
+ *           Positions are in world space, since wall meshes and gpucull instances are cached across frames,
+ *           so a map must fit in the range. The fourth component is the RenderTexture, which is the layer in the atlas texture array
+ *   tex:    unsigned normalized, so texture coordinates must lie in [0,1]
+ *   normal: octahedral encoded, signed normalized
+ */
+#define RENDERER_POS_SCALE 256.0f
+
 struct SpriteVertex {
+  i16 pos[4];
+  u16 tex[2];
+  i16 normal[2];
+};
+STATIC_ASSERT(sizeof(SpriteVertex) == 16, spritevertex_is_16_bytes);
+
+/* Text has no normals, and needs the full precision of floats for small glyphs. It is always RENDER_TEXTURE_TEXT */
+struct TextVertex {
   v3 pos;
   v2 tex;
-  v3 normal;
 };
+STATIC_ASSERT(sizeof(TextVertex) == 20, textvertex_is_20_bytes);
+
+#ifdef DEBUG
+  /* Set on the first clamp, so a map that is too big logs once instead of once per vertex. Racy across jobs threads, which at worst logs once per thread */
+  static bool pack_pos_clamped;
+#endif
+
+static i16 pack_pos(float x) {
+  x = x * RENDERER_POS_SCALE;
+#ifdef DEBUG
+  if ((x < -32768.0f || x > 32767.0f) && !pack_pos_clamped) {
+    pack_pos_clamped = true;
+    fprintf(get_log_file(), "%s:%i: warning: position %f is outside the +-%f units SpriteVertex can hold, and was clamped\n", __FILE__, __LINE__, x / RENDERER_POS_SCALE, 32768.0f / RENDERER_POS_SCALE);
+    fflush(get_log_file());
+  }
+#endif
+  x = x < -32768.0f ? -32768.0f : x > 32767.0f ? 32767.0f : x;
+  return (i16)floorf(x + 0.5f);
+}
+
+static u16 pack_unorm16(float x) {
+  x = x < 0.0f ? 0.0f : x > 1.0f ? 1.0f : x;
+  return (u16)(x * 65535.0f + 0.5f);
+}
+
+static i16 pack_snorm16(float x) {
+  x = x < -1.0f ? -1.0f : x > 1.0f ? 1.0f : x;
+  return (i16)floorf(x * 32767.0f + 0.5f);
+}
+
+/* Maps the unit sphere onto an octahedron, and folds the lower half over the upper one */
+static void pack_normal(v3 n, i16 *out) {
+  float s, x, y;
+
+  s = abs(n.x) + abs(n.y) + abs(n.z);
+  if (s == 0.0f) {
+    out[0] = out[1] = 0;
+    return;
+  }
+
+  x = n.x / s;
+  y = n.y / s;
+  if (n.z < 0.0f) {
+    float tx = x;
+    x = (1.0f - abs(y)) * sign(tx);
+    y = (1.0f - abs(tx)) * sign(y);
+  }
+  out[0] = pack_snorm16(x);
+  out[1] = pack_snorm16(y);
+}
 
-static SpriteVertex spritevertex_create(float x, float y, float z, float tx, float ty) {
+static SpriteVertex spritevertex_create(v3 pos, v2 tex, v3 normal, int texture) {
   SpriteVertex result;
+  result.pos[0] = pack_pos(pos.x);
+  result.pos[1] = pack_pos(pos.y);
+  result.pos[2] = pack_pos(pos.z);
+  result.pos[3] = (i16)texture;
+  result.tex[0] = pack_unorm16(tex.x);
+  result.tex[1] = pack_unorm16(tex.y);
+  pack_normal(normal, result.normal);
+  return result;
+}
+
+/* Writes the two triangles abc and acd, with normals bent outwards at the corners */
+static void spritevertex_quad(SpriteVertex *out, v3 a, v3 b, v3 c, v3 d, v2 ta, v2 tb, v2 tc, v2 td, int texture) {
+  SpriteVertex va, vb, vc, vd;
+  v3 da = normalize(b-a), db = normalize(d-a);
+  v3 n = normalize(cross(da, db));
+
+  va = spritevertex_create(a, ta, normalize(n-da), texture);
+  vb = spritevertex_create(b, tb, normalize(n-db), texture);
+  vc = spritevertex_create(c, tc, normalize(n+da), texture);
+  vd = spritevertex_create(d, td, normalize(n+db), texture);
+
+  *out++ = va;
+  *out++ = vb;
+  *out++ = vc;
+  *out++ = va;
+  *out++ = vc;
+  *out++ = vd;
+}
+
+static TextVertex textvertex_create(float x, float y, float z, float tx, float ty) {
+  TextVertex result;
   result.pos.x = x;
   result.pos.y = y;
   result.pos.z = z;
@@ -18,41 +130,293 @@ static SpriteVertex spritevertex_create(float x, float y, float z, float tx, flo
   result.tex.y = ty;
   return result;
 }
-typedef SpriteVertex TextVertex;
+
+/**
+ * Animated sprites are drawn instanced, one SpriteInstance per sprite.
+ * anim_sprite_vertex.glsl expands it into a quad facing the camera, and picks the
+ * frame from the animation table, so the game does no per frame work for animation.
+ *
+ *   pos:       center, packed like SpriteVertex
+ *   animation: index into RenderAnimations
+ *   texture:   the RenderTexture the animation's sprite is on
+ *   size:      packed like pos
+ *   start_time: renderer time at which the animation was at its first frame
+ */
+struct SpriteInstance {
+  i16 pos[3];
+  u8 animation, texture;
+  i16 size[2];
+  float start_time;
+};
+STATIC_ASSERT(sizeof(SpriteInstance) == 16, spriteinstance_is_16_bytes);
+
+static SpriteInstance spriteinstance_create(v3 pos, float w, float h, int animation, int texture, float start_time) {
+  SpriteInstance result;
+  result.pos[0] = pack_pos(pos.x);
+  result.pos[1] = pack_pos(pos.y);
+  result.pos[2] = pack_pos(pos.z);
+  result.animation = (u8)animation;
+  result.texture = (u8)texture;
+  result.size[0] = pack_pos(w);
+  result.size[1] = pack_pos(h);
+  result.start_time = start_time;
+  return result;
+}
+
+/**
+ * Cubes are pushed as one CubeInstance each, and turned into 36 sprite vertices either by
+ * the game (cubeinstance_expand), or, if Renderer::gpu_culling is set, by the GPU after
+ * it has culled them (see flat_gpucull.cpp).
+ *
+ *   x0, x1:  corners of the box, in world space
+ *   tex:     texture coordinate of every face, packed like SpriteVertex
+ *   texture: the RenderTexture
+ */
+struct CubeInstance {
+  v3 x0;
+  u16 tex[2];
+  v3 x1;
+  i32 texture;
+};
+STATIC_ASSERT(sizeof(CubeInstance) == 32, cubeinstance_is_32_bytes);
+
+static CubeInstance cubeinstance_create(v3 x0, v3 x1, v2 tex, int texture) {
+  CubeInstance result;
+  result.x0 = x0;
+  result.x1 = x1;
+  result.tex[0] = pack_unorm16(tex.x);
+  result.tex[1] = pack_unorm16(tex.y);
+  result.texture = texture;
+  return result;
+}
+
+#define CUBE_VERTICES 36
+
+/* Writes the CUBE_VERTICES vertices of the six faces */
+static void cubeinstance_expand(const CubeInstance *cube, SpriteVertex *out) {
+  v3 a,b,c,d,e,f,g,h;
+  v2 t = {cube->tex[0] / 65535.0f, cube->tex[1] / 65535.0f};
+  int i = 0;
+
+  a = b = c = d = cube->x0;
+  b.x = c.x = cube->x1.x;
+  c.y = d.y = cube->x1.y;
+  e = a, f = b, g = c, h = d;
+  e.z = f.z = g.z = h.z = cube->x1.z;
+
+  spritevertex_quad(out + i, a, b, c, d, t, t, t, t, cube->texture), i += 6;
+  spritevertex_quad(out + i, a, b, f, e, t, t, t, t, cube->texture), i += 6;
+  spritevertex_quad(out + i, a, e, h, d, t, t, t, t, cube->texture), i += 6;
+  spritevertex_quad(out + i, e, f, g, h, t, t, t, t, cube->texture), i += 6;
+  spritevertex_quad(out + i, b, c, g, f, t, t, t, t, cube->texture), i += 6;
+  spritevertex_quad(out + i, c, d, h, g, t, t, t, t, cube->texture), i += 6;
+}
+
+/**
+ * The animation table, uploaded as uniforms.
+ * Frames are laid out in a grid of the given number of columns, left to right and then downwards.
+ * Stored as arrays of vec4, so that each field is a single glUniform call.
+ *
+ *   rect: x, y, w, h of the first frame, in atlas uv
+ *   step: dx, dy between frames, in atlas uv, number of columns, number of frames
+ */
+#define RENDERER_MAX_ANIMATIONS 32
+
+struct RenderAnimations {
+  v4 rect[RENDERER_MAX_ANIMATIONS];
+  v4 step[RENDERER_MAX_ANIMATIONS];
+  float frame_time[RENDERER_MAX_ANIMATIONS];
+};
+
+/* Same as anim_sprite_vertex.glsl */
+static Rect render_animation_frame(RenderAnimations *a, int animation, float time) {
+  v4 rect = a->rect[animation], step = a->step[animation];
+  float frame_time = a->frame_time[animation];
+  int n = 0, columns = (int)step.z;
+  Rect r;
+
+  if (step.w > 0.0f && frame_time > 0.0f && columns > 0)
+    n = (int)(fmodf(max(time, 0.0f), step.w*frame_time) / frame_time);
+  r.x0 = rect.x + (n % max(columns, 1))*step.x;
+  r.y0 = rect.y - (n / max(columns, 1))*step.y;
+  r.x1 = r.x0 + rect.z;
+  r.y1 = r.y0 + rect.w;
+  return r;
+}
+
+/**
+ * Point lights, pushed by the game every frame, and binned into clusters by the platform (see flat_lights.cpp).
+ * They light everything with normals, as far as radius, falling off with the square of the distance.
+ */
+struct RenderLight {
+  v3 pos;
+  float radius;
+  v3 color;
+  float padding;
+};
+STATIC_ASSERT(sizeof(RenderLight) == 32, renderlight_is_32_bytes);
 
 struct Glyph {
   unsigned short x0, y0, x1, y1; /* Position in image */
   float offset_x, offset_y, advance; /* Glyph offset info */
+  u16 cell; /* in the glyph cache, for glyph_touch */
+};
+
+/* A rectangle of the RENDER_TEXTURE_TEXT layer that glyphs were rasterized into, see flat_glyphs.cpp */
+struct GlyphUpload {
+  u16 x, y, w, h;
+};
+
+/**
+ * Render commands
+ *
+ * The game writes vertices, and then pushes a command that refers to them.
+ * Before drawing, the platform sorts the commands on their key, and merges
+ * consecutive commands that share layer and shader into a single draw.
+ * Vertices say what texture they use, so the texture in the key only groups commands.
+ *
+ * Key layout, from most significant bit:
+ *
+ *   layer:   8 bits
+ *   shader:  8 bits, which also decides what vertex array the command refers to
+ *   texture: 16 bits
+ *   depth:   32 bits, back to front since everything is blended
+ */
+enum RenderLayer {
+  RENDER_LAYER_WORLD,
+  RENDER_LAYER_HUD,
+  RENDER_LAYER_COUNT
+};
+
+enum RenderShader {
+  RENDER_SHADER_SPRITE,
+  RENDER_SHADER_TEXT,
+  RENDER_SHADER_ANIM_SPRITE, /* refers to instances rather than vertices */
+  RENDER_SHADER_CUBE, /* refers to cubes, only pushed if Renderer::gpu_culling is set */
+  RENDER_SHADER_COUNT
+};
+
+/**
+ * Sprite atlas
+ *
+ * All sprite images are packed into a few atlas pages when the platform starts up (see flat_atlas.cpp).
+ * The game refers to sprites by id, and looks up which page they ended up on and where.
+ *
+ * The pages and the font are the layers of one texture array, indexed by RenderTexture,
+ * so the texture never splits a batch. All layers are RENDERER_ATLAS_PAGE_SIZE wide and
+ * Renderer::atlas_size high, which is at least RENDERER_ATLAS_MIN_HEIGHT for the font.
+ */
+#define RENDERER_ATLAS_PAGE_SIZE 2048
+#define RENDERER_ATLAS_MIN_HEIGHT 512
+#define RENDERER_MAX_ATLAS_PAGES 4
+
+enum SpriteId {
+  SPRITE_PLAYER,
+  SPRITE_COUNT
+};
+
+struct AtlasSprite {
+  int page;
+  Rect uv;
+};
+
+enum RenderTexture {
+  RENDER_TEXTURE_TEXT,
+  /* followed by the rest of the atlas pages */
+  RENDER_TEXTURE_SPRITES,
+  RENDER_TEXTURE_COUNT = RENDER_TEXTURE_SPRITES + RENDERER_MAX_ATLAS_PAGES
+};
+
+struct RenderCommand {
+  u64 key;
+  int first, count;
+  int arena; /* filled in by the platform */
+};
+
+#define render_key_batch(key) ((key) >> 48)
+#define render_key_layer(key) ((int)(((key) >> 56) & 0xff))
+#define render_key_shader(key) ((int)(((key) >> 48) & 0xff))
+#define render_key_texture(key) ((int)(((key) >> 32) & 0xffff))
+
+static u64 render_key(RenderLayer layer, RenderShader shader, RenderTexture texture, float depth) {
+  u32 d;
+
+  /* Flip the float bits so that they sort as unsigned ints, then invert for back to front */
+  memcpy(&d, &depth, sizeof(d));
+  d ^= (d & 0x80000000) ? 0xffffffff : 0x80000000;
+  d = ~d;
+
+  return ((u64)layer << 56) | ((u64)shader << 48) | ((u64)texture << 32) | d;
+}
+
+/**
+ * Each thread that generates vertices gets its own arena, so that they never
+ * have to synchronize. Commands refer to vertices in the arena they are pushed to.
+ * The platform concatenates the arenas in order before sorting.
+ */
+#define RENDERER_MAX_THREADS 8
+
+struct RenderArena {
+  SpriteVertex vertices[4096];
+  int num_vertices;
+  TextVertex text_vertices[1024];
+  int num_text_vertices;
+  SpriteInstance instances[1024];
+  int num_instances;
+  CubeInstance cubes[1024];
+  int num_cubes;
+  RenderLight lights[512];
+  int num_lights;
+  RenderCommand commands[512];
+  int num_commands;
 };
 
 struct Renderer {
   /* sprites */
-  GLuint
-    sprites_vertex_array, sprite_vertex_buffer,
-    sprite_shader,
-    /* locations */
-    sprite_camera_loc,
-    sprite_far_z_loc,
-    sprite_near_z_loc,
-    sprite_nearsize_loc
-    ;
-  Texture sprite_atlas;
+  GLuint sprites_vertex_array, sprite_vertex_buffer;
+  Shader sprite_shader;
+  int num_sprite_pages;
+  AtlasSprite sprites[SPRITE_COUNT];
 
-  SpriteVertex vertices[256];
-  int num_vertices;
+  /* all atlas pages and the font, see RenderTexture */
+  GLuint atlas_texture;
+  v2i atlas_size;
+
+  /* animated sprites, the game fills in the animation table */
+  GLuint anim_vertex_array, anim_instance_buffer;
+  Shader anim_shader;
+  RenderAnimations animations;
+  float time; /* seconds, what SpriteInstance::start_time is relative to */
 
-  /* text */
-  #define RENDERER_FIRST_CHAR 32
-  #define RENDERER_LAST_CHAR 128
-  #define RENDERER_FONT_SIZE 32.0f
+  /* text, the platform rasterizes glyphs into RENDER_TEXTURE_TEXT as the game asks for them (see flat_glyphs.cpp) */
+  #define RENDERER_FONT_SIZE 32.0f /* the size the distance fields are made at, text of any height is drawn from them */
+  #define RENDERER_MAX_GLYPH_SIZE 64
+  #define RENDERER_MAX_GLYPH_UPLOADS 128
   GLuint text_vertex_array, text_vertex_buffer;
-  TextVertex text_vertices[1024];
-  int num_text_vertices;
-  Texture text_atlas;
-  Glyph glyphs[RENDERER_LAST_CHAR - RENDERER_FIRST_CHAR];
+  Shader text_shader;
+  /* the font's vertical metrics at RENDERER_FONT_SIZE, ascent is above the baseline and descent below it, so it is negative */
+  float font_ascent, font_descent, font_line_gap;
+  /* what changed in the layer while this frame was simulated, and the platform's copy of it, one byte per pixel */
+  GlyphUpload glyph_uploads[RENDERER_MAX_GLYPH_UPLOADS];
+  int num_glyph_uploads;
+  const u8 *glyph_pixels;
+  /* changes whenever glyphs are evicted, so anything that remembers where glyphs were must be rebuilt */
+  u32 glyph_generation;
+  /* glyphs that had no room this frame, and were returned empty */
+  int num_glyphs_missing;
+
+  /* set by the platform, if it can cull and draw CubeInstances on the GPU */
+  bool gpu_culling;
+
+  /* one per thread */
+  RenderArena arenas[RENDERER_MAX_THREADS];
 
   /* camera */
   #define RENDERER_CAMERA_HEIGHT 5
+  #define RENDERER_FOV (PI/3.0f)
+  #define RENDERER_ASPECT (16.0f/9.0f)
+  #define RENDERER_NEAR_Z -2.0f
+  #define RENDERER_FAR_Z -50.0f
   v3 camera_pos;
 };
 
@@ -17,123 +17,56 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.hpp"
 
+#include "flat_lights.cpp"
+#include "flat_render.cpp"
+#include "flat_jobs.cpp"
+#include "flat_pack.cpp"
+#include "flat_atlas.cpp"
+#include "flat_glyphs.cpp"
+#include "flat_profile.cpp"
+
 /* ======= Platform api ======= */
 
 #define GL_FUN(ret, name, par) ret (GLAPI *name) par;
 #include "flat_glfuns.incl"
+#include "flat_glfuns_ext.incl"
+#include "flat_glfuns_shader.incl"
+#include "flat_glfuns_gpucull.incl"
 #undef GL_FUN
 
-static GLuint compile_shader(const char* vertex_filename, const char* fragment_filename) {
-  GLuint result = 0;
-  FILE *vertex_file = 0, *fragment_file = 0;
-  char shader_src[2048];
-  const char * const shader_src_list = shader_src;
-  char info_log[512];
-  int num_read;
-  GLint success;
-  GLuint vertex_shader, fragment_shader;
-
-  vertex_file = flat_fopen(vertex_filename, "r");
-  if (!vertex_file) die("Could not open vertex shader file %s: %s\n", vertex_filename, flat_strerror(errno));
-  num_read = fread(shader_src, 1, sizeof(shader_src), vertex_file);
-  shader_src[num_read] = 0;
-  if (!feof(vertex_file)) die("File larger than buffer\n");
-  else if (ferror(vertex_file)) die("While reading vertex shader %s: %s\n", vertex_filename, flat_strerror(errno));
-
-  vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vertex_shader, 1, &shader_src_list, 0);
-  glCompileShader(vertex_shader);
-  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(vertex_shader, sizeof(info_log), 0, info_log);
-    die("Could not compile vertex shader: %s\n", info_log);
-  }
-
-  fragment_file = flat_fopen(fragment_filename, "r");
-  if (!fragment_file) die("Could not open fragment shader file %s: %s\n", fragment_filename, flat_strerror(errno));
-  num_read = fread(shader_src, 1, sizeof(shader_src), fragment_file);
-  shader_src[num_read] = 0;
-  if (!feof(fragment_file)) die("File larger than buffer\n");
-  else if (ferror(fragment_file)) die("While reading fragment shader %s: %s\n", fragment_filename, flat_strerror(errno));
-
-  fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fragment_shader, 1, &shader_src_list, 0);
-  glCompileShader(fragment_shader);
-  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-    glGetShaderInfoLog(fragment_shader, sizeof(info_log), 0, info_log);
-    die("Could not compile fragment shader: %s\n", info_log);
-  }
-
-  result = glCreateProgram();
-  glAttachShader(result, vertex_shader);
-  glAttachShader(result, fragment_shader);
-  glLinkProgram(result);
-  glGetProgramiv(result, GL_LINK_STATUS, &success);
-  if (!success) {
-    glGetProgramInfoLog(result, 512, 0, info_log);
-    die("Could not link shader: %s\n", info_log);
-  }
-
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-  fclose(vertex_file);
-  fclose(fragment_file);
-  gl_ok_or_die;
-  return result;
-}
+#include "flat_glstate.cpp"
+#include "flat_gldebug.cpp"
+#include "flat_texload.cpp"
+#include "flat_shader.cpp"
+#include "flat_gltimer.cpp"
+#include "flat_dynres.cpp"
+#include "flat_gpucull.cpp"
+#include "flat_gllights.cpp"
 
+/* ======= Internals ======= */
 
-void load_image_texture_from_file(const char* filename, GLuint* result, int* w, int* h) {
-  glGenTextures(1, result);
-  glBindTexture(GL_TEXTURE_2D, *result);
-  gl_ok_or_die;
+static RenderQueue render_queue;
 
-  {
-    unsigned char *data;
-    stbi_set_flip_vertically_on_load(1);
-    data = stbi_load(filename, w, h, 0, 4);
-    if (!data) die("Failed to load image %s: %s\n", filename, flat_strerror(errno));
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, *w, *h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-    stbi_image_free(data);
-    gl_ok_or_die;
+static Shader* render_shader_get(Renderer *r, int shader) {
+  switch (shader) {
+    case RENDER_SHADER_SPRITE: return &r->sprite_shader;
+    case RENDER_SHADER_TEXT: return &r->text_shader;
+    case RENDER_SHADER_ANIM_SPRITE: return &r->anim_shader;
   }
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-  gl_ok_or_die;
+  die("Unknown shader %i\n", shader);
+  return 0;
 }
 
-void load_font_from_file(const char* filename, GLuint gl_texture, int tex_w, int tex_h, unsigned char first_char, unsigned char last_char, float height, Glyph *out_glyphs) {
-  #define BUFFER_SIZE 1024*1024
-  unsigned char* ttf_mem;
-  unsigned char* bitmap;
-  FILE* f;
-  int res;
-
-  ttf_mem = (unsigned char*)malloc(BUFFER_SIZE);
-  bitmap = (unsigned char*)malloc(tex_w * tex_h);
-  if (!ttf_mem || !bitmap) die("Failed to allocate memory for font: %s\n", flat_strerror(errno));
-
-  f = flat_fopen(filename, "rb");
-  if (!f) die("Failed to open ttf file %s: %s\n", filename, flat_strerror(errno));
-  fread(ttf_mem, 1, BUFFER_SIZE, f);
-
-  res = stbtt_BakeFontBitmap(ttf_mem, 0, height, bitmap, tex_w, tex_h, first_char, last_char - first_char, (stbtt_bakedchar*) out_glyphs);
-  if (res <= 0) die("Failed to bake font: %i\n", res);
-
-  glBindTexture(GL_TEXTURE_2D, gl_texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, tex_w, tex_h, 0, GL_RED, GL_UNSIGNED_BYTE, bitmap);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  gl_ok_or_die;
-
-  fclose(f);
-  free(ttf_mem);
-  free(bitmap);
+static GLuint render_vertex_array_get(Renderer *r, int shader) {
+  switch (shader) {
+    case RENDER_SHADER_SPRITE: return r->sprites_vertex_array;
+    case RENDER_SHADER_TEXT: return r->text_vertex_array;
+    case RENDER_SHADER_ANIM_SPRITE: return r->anim_vertex_array;
+  }
+  die("Unknown shader %i\n", shader);
+  return 0;
 }
 
-/* ======= Internals ======= */
-
 static Button key_to_button(Sint32 key) {
   switch (key) {
     case SDLK_RETURN: return BUTTON_START;
@@ -242,6 +175,402 @@ static bool gamedll_has_changed() {
   #endif
 }
 
+/* ======= GL backend ======= */
+
+/* Points the attributes of the bound vertex array at the instance buffer, starting at instance first */
+static void anim_instance_attribs(int first) {
+  size_t base = first*sizeof(SpriteInstance);
+  glVertexAttribIPointer(0, 4, GL_SHORT, sizeof(SpriteInstance), (void*) base);
+  glVertexAttribPointer(1, 2, GL_SHORT, GL_FALSE, sizeof(SpriteInstance), (void*) (base + offsetof(SpriteInstance, size)));
+  glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(SpriteInstance), (void*) (base + offsetof(SpriteInstance, start_time)));
+}
+
+/* data is the Renderer, for the GL objects */
+static void gl_begin_frame(void *data, RenderUniforms *u) {
+  Renderer *renderer = (Renderer*)data;
+  Shader *shaders[] = {&renderer->sprite_shader, &renderer->text_shader, &renderer->anim_shader, &gpucull.cull_shader, &gpucull.cube_shader};
+  int i, num_shaders = gpucull.enabled ? 5 : 3;
+
+  gpu_timer_begin_frame();
+  dynres_begin_frame();
+
+  /* the clear and the buffer uploads */
+  gpu_timer_pass(PROFILE_GPU_UPLOAD);
+  glClearColor(0.0, 0.0, 0.0, 1.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  /* every draw uses the atlas, the vertices pick the layer, and the lights */
+  gl_lights_bind();
+  gls_bind_texture(0, GL_TEXTURE_2D_ARRAY, renderer->atlas_texture);
+
+  /* The state cache skips whatever hasn't changed since last frame */
+  for (i = 0; i < num_shaders; ++i) {
+    gls_use_program(shaders[i]->program);
+    gls_uniform3f(shaders[i]->camera_loc, GET3(u->camera));
+    gls_uniform1f(shaders[i]->far_z_loc, u->far_z);
+    gls_uniform1f(shaders[i]->near_z_loc, u->near_z);
+    gls_uniform2f(shaders[i]->nearsize_loc, u->nearsize.x, u->nearsize.y);
+    gls_uniform1f(shaders[i]->time_loc, u->time);
+    gls_uniform4fv(shaders[i]->anim_rect_loc, RENDERER_MAX_ANIMATIONS, &u->animations.rect[0].x);
+    gls_uniform4fv(shaders[i]->anim_step_loc, RENDERER_MAX_ANIMATIONS, &u->animations.step[0].x);
+    gls_uniform1fv(shaders[i]->anim_frame_time_loc, RENDERER_MAX_ANIMATIONS, u->animations.frame_time);
+  }
+}
+
+static void gl_upload(void *data, int shader, const void *vertices, int num_vertices) {
+  Renderer *renderer = (Renderer*)data;
+
+  switch (shader) {
+    case RENDER_SHADER_SPRITE: gls_bind_buffer(GL_ARRAY_BUFFER, renderer->sprite_vertex_buffer); break;
+    case RENDER_SHADER_TEXT: gls_bind_buffer(GL_ARRAY_BUFFER, renderer->text_vertex_buffer); break;
+    case RENDER_SHADER_ANIM_SPRITE: gls_bind_buffer(GL_ARRAY_BUFFER, renderer->anim_instance_buffer); break;
+    case RENDER_SHADER_CUBE:
+      /* only a recording from a driver with GPU culling has cubes */
+      if (!gpucull.enabled && num_vertices)
+        die("Cubes need GPU culling, which this driver doesn't support\n");
+      if (gpucull.enabled)
+        gpucull_upload((const CubeInstance*)vertices, num_vertices);
+      return;
+    default: die("Unknown shader %i\n", shader);
+  }
+  glBufferSubData(GL_ARRAY_BUFFER, 0, num_vertices * render_shader_vertex_size(shader), vertices);
+}
+
+/**
+ * The text layer's mip chain, kept on the render thread and made on the CPU, so that a new glyph only
+ * updates the rectangles under it in every level, and glGenerateMipmap never runs over the sprite pages.
+ * The levels are box filtered like flat_packer's, and uploaded as GL_RED, which GL reads as (r,0,0,1)
+ */
+#define GL_TEXT_MAX_LEVELS 16
+
+struct GlTextMips {
+  u8 *levels[GL_TEXT_MAX_LEVELS];
+  int w[GL_TEXT_MAX_LEVELS], h[GL_TEXT_MAX_LEVELS];
+  int num_levels;
+};
+
+static GlTextMips gl_text_mips;
+
+/* Makes the rectangle [x0,x1) x [y0,y1) of the level from the one above it */
+static void gl_text_mips__downsample(int level, int x0, int y0, int x1, int y1) {
+  GlTextMips *m = &gl_text_mips;
+  const u8 *src = m->levels[level-1];
+  u8 *dst = m->levels[level];
+  int sw = m->w[level-1], sh = m->h[level-1], x, y;
+
+  for (y = y0; y < y1; ++y) {
+    for (x = x0; x < x1; ++x) {
+      int sx0 = min(2*x, sw-1), sx1 = min(2*x + 1, sw-1), sy0 = min(2*y, sh-1), sy1 = min(2*y + 1, sh-1);
+      int sum = src[sy0*sw + sx0] + src[sy0*sw + sx1] + src[sy1*sw + sx0] + src[sy1*sw + sx1];
+      dst[y*m->w[level] + x] = (u8)((sum + 2) / 4);
+    }
+  }
+}
+
+/* Remakes the levels under the rectangle [x0,x1) x [y0,y1) of level 0, and uploads it in every level */
+static void gl_text_mips__update(int x0, int y0, int x1, int y1) {
+  GlTextMips *m = &gl_text_mips;
+  int level;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (level = 0; level < m->num_levels; ++level) {
+    if (level) {
+      x0 >>= 1, y0 >>= 1;
+      x1 = min((x1 + 1) >> 1, m->w[level]);
+      y1 = min((y1 + 1) >> 1, m->h[level]);
+      gl_text_mips__downsample(level, x0, y0, x1, y1);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, m->w[level]);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, x0, y0, RENDER_TEXTURE_TEXT, x1 - x0, y1 - y0, 1, GL_RED, GL_UNSIGNED_BYTE,
+                    m->levels[level] + y0*m->w[level] + x0);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+/* Only happens when new glyphs show up */
+static void gl_upload_glyphs(void *data, const GlyphUpload *uploads, int num_uploads, const u8 *pixels) {
+  Renderer *renderer = (Renderer*)data;
+  GlTextMips *m = &gl_text_mips;
+  int i, row;
+
+  if (!num_uploads)
+    return;
+
+  gls_bind_texture(0, GL_TEXTURE_2D_ARRAY, renderer->atlas_texture);
+  for (i = 0; i < num_uploads; ++i) {
+    const GlyphUpload *up = uploads + i;
+
+    for (row = 0; row < up->h; ++row)
+      memcpy(m->levels[0] + (up->y + row)*m->w[0] + up->x, pixels + row*up->w, up->w);
+    pixels += up->w * up->h;
+    gl_text_mips__update(up->x, up->y, up->x + up->w, up->y + up->h);
+  }
+}
+
+/**
+ * Sets up the mip chain from the text layer as glyphs_init left it, and uploads all of it if there were baked glyphs.
+ * Runs during init, so the state cache isn't used
+ */
+static void gl_upload_glyph_layer(Renderer *renderer, bool baked) {
+  GlTextMips *m = &gl_text_mips;
+  int level;
+
+  m->num_levels = 0;
+  for (level = 0; level < GL_TEXT_MAX_LEVELS; ++level) {
+    m->w[level] = max(renderer->atlas_size.x >> level, 1);
+    m->h[level] = max(renderer->atlas_size.y >> level, 1);
+    m->levels[level] = (u8*)calloc(m->w[level] * m->h[level], 1);
+    if (!m->levels[level]) die("Failed to allocate memory for the text layer: %s\n", flat_strerror(errno));
+    ++m->num_levels;
+    if (m->w[level] == 1 && m->h[level] == 1)
+      break;
+  }
+  if (m->w[m->num_levels-1] != 1 || m->h[m->num_levels-1] != 1)
+    die("The atlas is too big for %i mip levels\n", GL_TEXT_MAX_LEVELS);
+  if (!baked)
+    return;
+
+  memcpy(m->levels[0], renderer->glyph_pixels, m->w[0] * m->h[0]);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, renderer->atlas_texture);
+  gl_text_mips__update(0, 0, m->w[0], m->h[0]);
+  gl_ok_or_die;
+}
+
+static void gl_upload_lights(void *data, const LightClusters *lights) {
+  gl_lights_upload(lights);
+}
+
+static void gl_draw(void *data, int shader, int texture, int first, int count) {
+  Renderer *renderer = (Renderer*)data;
+
+  switch (shader) {
+    case RENDER_SHADER_SPRITE: gpu_timer_pass(PROFILE_GPU_SPRITES); break;
+    case RENDER_SHADER_TEXT: gpu_timer_pass(PROFILE_GPU_TEXT); break;
+    case RENDER_SHADER_ANIM_SPRITE: gpu_timer_pass(PROFILE_GPU_ANIM_SPRITES); break;
+    case RENDER_SHADER_CUBE:
+      gpu_timer_pass(PROFILE_GPU_CUBES);
+      gpucull_draw(first, count);
+      return;
+  }
+
+  gls_use_program(render_shader_get(renderer, shader)->program);
+  gls_bind_vertex_array(render_vertex_array_get(renderer, shader));
+
+  if (shader == RENDER_SHADER_ANIM_SPRITE) {
+    /* There is no base instance in GL 3.3, so point the instance attributes at the first instance instead */
+    gls_bind_buffer(GL_ARRAY_BUFFER, renderer->anim_instance_buffer);
+    anim_instance_attribs(first);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, count);
+  }
+  else
+    glDrawArrays(GL_TRIANGLES, first, count);
+}
+
+/* Nothing in the frame checks for errors, see flat_gldebug.cpp */
+static void gl_end_frame(void *data) {
+  gpu_timer_pass(PROFILE_GPU_BLIT);
+  dynres_end_frame();
+  gpu_timer_end_frame();
+  gl_errors_sample();
+}
+
+static RenderBackend gl_backend_create(Renderer *renderer) {
+  RenderBackend b;
+  b.data = renderer;
+  b.begin_frame = gl_begin_frame;
+  b.upload = gl_upload;
+  b.upload_lights = gl_upload_lights;
+  b.upload_glyphs = gl_upload_glyphs;
+  b.draw = gl_draw;
+  b.end_frame = gl_end_frame;
+  return b;
+}
+
+/**
+ * The backend that frames are drawn with.
+ * Normally this is the GL backend, but if FLAT_RECORD is set to a filename
+ * the frames also get recorded to that file
+ */
+static RenderBackend gl_backend;
+static Recorder recorder;
+static RenderBackend recorder_backend;
+static RenderBackend *frame_backend;
+
+static void render_frame(Renderer *renderer) {
+  /* the frames all share the same GL objects, but we might as well use the right one */
+  gl_backend.data = renderer;
+
+  /* sort and batch the render commands */
+  render_queue_build(&render_queue, renderer);
+  render_queue_submit(&render_queue, frame_backend);
+}
+
+/**
+ * Replays a recording made with FLAT_RECORD into the GL backend, and prints how long each frame took.
+ * This measures the driver path on its own, without the game or the render queue
+ */
+static void replay_run(SDL_Window *window, Renderer *renderer, const char *filename) {
+  FILE *f;
+  int num_frames = 0;
+  double total_ms = 0.0;
+  Uint64 t0, t1;
+
+  f = replay_open(filename);
+  gl_backend = gl_backend_create(renderer);
+  gls_reset();
+
+  /* the first frames shouldn't be missing sprites, or pay for the uploads */
+  texload_finish(renderer);
+
+  for (;;) {
+    double start_ms = profile_now();
+
+    t0 = SDL_GetPerformanceCounter();
+    if (!replay_frame(f, &render_queue, &gl_backend))
+      break;
+    glFinish();
+    t1 = SDL_GetPerformanceCounter();
+    profile_record(PROFILE_RENDER, PROFILE_THREAD_RENDER, start_ms, profile_now() - start_ms);
+    SDL_GL_SwapWindow(window);
+
+    total_ms += (t1 - t0) * 1000.0 / SDL_GetPerformanceFrequency();
+    printf("frame %i: %.3f ms\n", num_frames, (t1 - t0) * 1000.0 / SDL_GetPerformanceFrequency());
+    ++num_frames;
+  }
+
+  if (num_frames)
+    printf("replayed %i frames, average %.3f ms\n", num_frames, total_ms / num_frames);
+  printf("GL state changes:\n");
+  gls_stats_print(stdout, &gls.stats);
+  printf("Frame timings:\n");
+  profile_stats_print(stdout);
+  profile_close();
+  fclose(f);
+}
+
+/**
+ * Lock-free single producer, single consumer queue
+ *
+ * The producer only ever writes head, and the consumer only ever writes tail.
+ * The semaphore counts the items in the queue, so that the consumer can sleep while it is empty.
+ */
+#define SPSC_QUEUE_SIZE 4
+STATIC_ASSERT((SPSC_QUEUE_SIZE & (SPSC_QUEUE_SIZE-1)) == 0, spsc_queue_size_is_pow2);
+
+struct SpscQueue {
+  void *items[SPSC_QUEUE_SIZE];
+  SDL_atomic_t head, tail;
+  SDL_sem *num_items;
+};
+
+static void spsc_init(SpscQueue *q) {
+  memset(q, 0, sizeof(*q));
+  q->num_items = SDL_CreateSemaphore(0);
+  if (!q->num_items)
+    sdl_abort();
+}
+
+static void spsc_push(SpscQueue *q, void *item) {
+  int head = SDL_AtomicGet(&q->head);
+
+  if (head - SDL_AtomicGet(&q->tail) >= SPSC_QUEUE_SIZE)
+    die("SPSC queue is full\n");
+
+  q->items[head & (SPSC_QUEUE_SIZE-1)] = item;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&q->head, head+1);
+  SDL_SemPost(q->num_items);
+}
+
+/* Blocks until there is an item */
+static void* spsc_pop(SpscQueue *q) {
+  int tail;
+  void *item;
+
+  SDL_SemWait(q->num_items);
+  SDL_MemoryBarrierAcquire();
+  tail = SDL_AtomicGet(&q->tail);
+  item = q->items[tail & (SPSC_QUEUE_SIZE-1)];
+  SDL_AtomicSet(&q->tail, tail+1);
+  return item;
+}
+
+/**
+ * Render thread
+ *
+ * Frames are handed back and forth between the main thread and the render thread.
+ * The main thread fills a frame from free_frames and pushes it to ready_frames,
+ * the render thread draws it and gives it back through free_frames.
+ * With two frames, one frame is simulated while the previous one is drawn and swapped.
+ *
+ * A null frame tells the render thread to exit.
+ */
+struct RenderThread {
+  SDL_Thread *thread;
+  SDL_Window *window;
+  SDL_GLContext gl_context;
+  SpscQueue ready_frames, free_frames;
+};
+
+static RenderThread render_thread;
+
+static int render_thread_main(void *data) {
+  RenderThread *t = (RenderThread*)data;
+  Renderer *frame;
+
+  sdl_try(SDL_GL_MakeCurrent(t->window, t->gl_context));
+  gls_reset();
+
+  while ((frame = (Renderer*)spsc_pop(&t->ready_frames))) {
+    double t0, t1, t2;
+
+    t0 = profile_now();
+    texload_poll(frame);
+    render_frame(frame);
+    t1 = profile_now();
+    SDL_GL_SwapWindow(t->window);
+    t2 = profile_now();
+    spsc_push(&t->free_frames, frame);
+
+    profile_record(PROFILE_RENDER, PROFILE_THREAD_RENDER, t0, t1 - t0);
+    profile_record(PROFILE_SWAP, PROFILE_THREAD_RENDER, t1, t2 - t1);
+  }
+
+  printf("GL state changes:\n");
+  gls_stats_print(stdout, &gls.stats);
+  printf("Frame timings:\n");
+  profile_stats_print(stdout);
+  if (gpu_timers.dropped)
+    printf("  %li frames of GPU timings weren't ready in time\n", gpu_timers.dropped);
+
+  return 0;
+}
+
+static void render_thread_start(RenderThread *t, SDL_Window *window, SDL_GLContext gl_context, Renderer **frames, int num_frames) {
+  int i;
+
+  t->window = window;
+  t->gl_context = gl_context;
+  spsc_init(&t->ready_frames);
+  spsc_init(&t->free_frames);
+  for (i = 0; i < num_frames; ++i)
+    spsc_push(&t->free_frames, frames[i]);
+
+  t->thread = SDL_CreateThread(render_thread_main, "render", t);
+  if (!t->thread)
+    sdl_abort();
+}
+
+static void render_thread_stop(RenderThread *t) {
+  spsc_push(&t->ready_frames, 0);
+  SDL_WaitThread(t->thread, 0);
+  texload_stop();
+  if (recorder.file)
+    recorder_close(&recorder);
+  profile_close();
+}
+
 #ifdef OS_WINDOWS
   int WINAPI wWinMain(HINSTANCE, HINSTANCE, PWSTR, int)
 #else
@@ -259,8 +588,12 @@ static bool gamedll_has_changed() {
   if (memory == NULL)
     die("Not enough memory");
 
-  /* Alloc renderer */
-  Renderer *renderer = (Renderer*)memory;
+  /* Alloc renderers, one for the frame being simulated and one for the frame being drawn */
+  Renderer *renderers[2];
+  Renderer *renderer;
+  renderers[0] = renderer = (Renderer*)memory;
+  memory += sizeof(*renderer);
+  renderers[1] = (Renderer*)memory;
   memory += sizeof(*renderer);
 
   /* Fix for some builds of SDL 2.0.4, see https://bugs.gentoo.org/show_bug.cgi?id=610326 */
@@ -275,6 +608,9 @@ static bool gamedll_has_changed() {
   sdl_try(SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE));
   sdl_try(SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3));
   sdl_try(SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3));
+  #ifdef DEBUG
+    sdl_try(SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG));
+  #endif
 
   /* SDL stuff */
   const int screen_w = 1280, screen_h = 720;
@@ -298,7 +634,16 @@ static bool gamedll_has_changed() {
     #undef GL_FUN
   }
 
+  gl_debug_init();
+  shader_cache_init();
+
+  /* Map the assets packed by flat_packer, if they have been, before anything is loaded */
+  pack_open("../../assets/assets.pack");
+
   glViewport(0, 0, screen_w, screen_h);
+  profile_init();
+  gpu_timer_init();
+  dynres_init(screen_w, screen_h);
 
   /* Init renderer */
   {
@@ -314,83 +659,144 @@ static bool gamedll_has_changed() {
     glGenBuffers(1, &renderer->sprite_vertex_buffer);
     glBindVertexArray(renderer->sprites_vertex_array);
     glBindBuffer(GL_ARRAY_BUFFER, renderer->sprite_vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(renderer->vertices), 0, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(render_queue.vertices), 0, GL_DYNAMIC_DRAW);
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
     glEnableVertexAttribArray(2);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex), (void*) 0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex), (void*) offsetof(SpriteVertex, tex));
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex), (void*) offsetof(SpriteVertex, normal));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, sizeof(SpriteVertex), (void*) 0);
+    glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(SpriteVertex), (void*) offsetof(SpriteVertex, tex));
+    glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, sizeof(SpriteVertex), (void*) offsetof(SpriteVertex, normal));
+    glVertexAttribIPointer(3, 1, GL_SHORT, sizeof(SpriteVertex), (void*) (3*sizeof(i16)));
 
     /* Allocate text buffer */
     glGenVertexArrays(1, &renderer->text_vertex_array);
     glGenBuffers(1, &renderer->text_vertex_buffer);
     glBindVertexArray(renderer->text_vertex_array);
     glBindBuffer(GL_ARRAY_BUFFER, renderer->text_vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(renderer->text_vertices), 0, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(render_queue.text_vertices), 0, GL_DYNAMIC_DRAW);
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(*renderer->text_vertices), (void*) 0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(*renderer->text_vertices), (void*) offsetof(SpriteVertex, tex));
-
-    /* Compile shaders */
-    renderer->sprite_shader = compile_shader("../../assets/shaders/sprite_vertex.glsl", "../../assets/shaders/sprite_fragment.glsl");
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*) 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*) offsetof(TextVertex, tex));
+
+    /* Allocate animated sprite buffer, with one instance per sprite and no vertex attributes */
+    glGenVertexArrays(1, &renderer->anim_vertex_array);
+    glGenBuffers(1, &renderer->anim_instance_buffer);
+    glBindVertexArray(renderer->anim_vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->anim_instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(render_queue.instances), 0, GL_DYNAMIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(0, 1);
+    glVertexAttribDivisor(1, 1);
+    glVertexAttribDivisor(2, 1);
+    anim_instance_attribs(0);
     gl_ok_or_die;
 
-    /* Get/set uniforms */
-    glUseProgram(renderer->sprite_shader);
-    gl_ok_or_die;
+    /* Allocate the light buffers */
+    gl_lights_init();
+
+    /* Let the GPU cull and draw the cubes, if it can */
+    renderer->gpu_culling = gpucull_init();
+
+    /* Compile shaders, all at once so the driver can work on them in parallel */
+    {
+      ShaderBuild builds[5];
+      int i, num_builds = 3;
+
+      shader_build_begin(&builds[0], &renderer->sprite_shader, "../../assets/shaders/sprite_vertex.glsl", "../../assets/shaders/sprite_fragment.glsl");
+      shader_build_begin(&builds[1], &renderer->text_shader, "../../assets/shaders/text_vertex.glsl", "../../assets/shaders/text_fragment.glsl");
+      shader_build_begin(&builds[2], &renderer->anim_shader, "../../assets/shaders/anim_sprite_vertex.glsl", "../../assets/shaders/sprite_fragment.glsl");
+      if (gpucull.enabled) {
+        gpucull_build_begin(&builds[3], &builds[4]);
+        num_builds = 5;
+      }
+      for (i = 0; i < num_builds; ++i)
+        shader_build_end(&builds[i]);
+    }
+
+    /* Set constant uniforms */
     glActiveTexture(GL_TEXTURE0);
     gl_ok_or_die;
-    glBindTexture(GL_TEXTURE_2D, renderer->sprite_atlas.id);
+    glUseProgram(renderer->sprite_shader.program);
+    glUniform1i(glGetUniformLocation(renderer->sprite_shader.program, "tex"), 0);
+    glUniform1f(glGetUniformLocation(renderer->sprite_shader.program, "pos_scale"), 1.0f / RENDERER_POS_SCALE);
     gl_ok_or_die;
-    glUniform1i(glGetUniformLocation(renderer->sprite_shader, "u_texture"), 0);
+    glUseProgram(renderer->text_shader.program);
+    glUniform1i(glGetUniformLocation(renderer->text_shader.program, "tex"), 0);
     gl_ok_or_die;
-    renderer->sprite_camera_loc = glGetUniformLocation(renderer->sprite_shader, "camera");
-    renderer->sprite_far_z_loc = glGetUniformLocation(renderer->sprite_shader, "far_z");
-    renderer->sprite_near_z_loc = glGetUniformLocation(renderer->sprite_shader, "near_z");
-    renderer->sprite_nearsize_loc = glGetUniformLocation(renderer->sprite_shader, "nearsize");
+    glUseProgram(renderer->anim_shader.program);
+    glUniform1i(glGetUniformLocation(renderer->anim_shader.program, "tex"), 0);
+    glUniform1f(glGetUniformLocation(renderer->anim_shader.program, "pos_scale"), 1.0f / RENDERER_POS_SCALE);
     gl_ok_or_die;
+    if (gpucull.enabled)
+      gpucull_shaders_init();
+    gl_lights_shader_init(renderer->sprite_shader.program);
+    gl_lights_shader_init(renderer->anim_shader.program);
+    if (gpucull.enabled)
+      gl_lights_shader_init(gpucull.cube_shader.program);
+
+    /* Start loading images into textures, the render thread finishes the uploads */
+    texload_start(renderer);
+
+    /* Load the glyphs baked by flat_fontbake, the rest are rasterized into their layer of the atlas as they are used */
+    gl_upload_glyph_layer(renderer, glyphs_init(renderer, "../../assets/Roboto-Regular.glyphs", "../../assets/Roboto-Regular.ttf", RENDERER_FONT_SIZE) > 0);
+  }
 
-    /* Load images into textures */
-    load_image_texture_from_file( "../../assets/spritesheet.png", &renderer->sprite_atlas.id, &renderer->sprite_atlas.size.x, &renderer->sprite_atlas.size.y);
-    glGenerateMipmap(GL_TEXTURE_2D);
 
-    /* Create font texture and read in font from file */
-    {
-      const int w = 512, h = 512;
-      glGenTextures(1, &renderer->text_atlas.id);
-      glBindTexture(GL_TEXTURE_2D, renderer->text_atlas.id);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-      gl_ok_or_die;
-      renderer->text_atlas.size.x = w;
-      renderer->text_atlas.size.y = h;
-
-      load_font_from_file( "../../assets/Roboto-Regular.ttf", renderer->text_atlas.id, renderer->text_atlas.size.x, renderer->text_atlas.size.y, RENDERER_FIRST_CHAR, RENDERER_LAST_CHAR, RENDERER_FONT_SIZE, renderer->glyphs);
-      glBindTexture(GL_TEXTURE_2D, renderer->text_atlas.id);
-      glGenerateMipmap(GL_TEXTURE_2D);
+  /* Replay a recording instead of running the game */
+  {
+    const char *replay_file = SDL_getenv("FLAT_REPLAY");
+    if (replay_file) {
+      replay_run(window, renderer, replay_file);
+      texload_stop();
+      return 0;
     }
   }
 
+  /* Set up the render backend */
+  {
+    const char *record_file = SDL_getenv("FLAT_RECORD");
+    gl_backend = gl_backend_create(renderer);
+    frame_backend = &gl_backend;
+    if (record_file) {
+      recorder_backend = recorder_create(&recorder, record_file, &gl_backend);
+      frame_backend = &recorder_backend;
+    }
+  }
 
   /* load game loop */
   MainLoop main_loop;
   Init init;
   gamedll_load(&main_loop, &init);
 
+  /* start worker threads */
+  jobs_init();
+
   /* call init */
   {
     Funs dfuns = {};
-    init(memory, MEMORY_SIZE, dfuns, renderer);
+    dfuns.parallel_for = jobs_parallel_for;
+    dfuns.glyph_get = glyph_get;
+    dfuns.glyph_kern = glyphs_kern;
+    dfuns.glyph_touch = glyphs_touch;
+    init(memory, MEMORY_SIZE - 2*sizeof(*renderer), dfuns, renderer);
   }
 
 
+  /* The render thread takes over the gl context */
+  *renderers[1] = *renderers[0];
+  SDL_GL_MakeCurrent(window, 0);
+  render_thread_start(&render_thread, window, gl_context, renderers, ARRAY_LEN(renderers));
+
   /* main loop */
   unsigned int loop_index = 0;
   for (;; ++loop_index) {
     int i;
     SDL_Event event;
+    Renderer *frame;
 
     for (i = 0; i < ARRAY_LEN(input.was_pressed); ++i)
       input.was_pressed[i] = false;
@@ -398,8 +804,10 @@ static bool gamedll_has_changed() {
     while (SDL_PollEvent(&event)) {
       switch (event.type) {
         case SDL_WINDOWEVENT:
-          if (event.window.event == SDL_WINDOWEVENT_CLOSE)
+          if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
+            render_thread_stop(&render_thread);
             return 0;
+          }
           break;
 
         case SDL_KEYDOWN: {
@@ -418,48 +826,22 @@ static bool gamedll_has_changed() {
       }
     }
 
-    glClearColor(0.0, 0.0, 0.0, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    gl_ok_or_die;
+    /* wait for a frame that the render thread is done with */
+    frame = (Renderer*)spsc_pop(&render_thread.free_frames);
 
-    static int last_time;
     if ((loop_index%100) == 0 && gamedll_has_changed())
       gamedll_load(&main_loop, &init);
-    err = main_loop(memory, SDL_GetTicks(), input, renderer);
-    if (err) return 0;
-
-
-    /* send camera position to shader */
+    glyphs_begin_frame(frame);
     {
-      float w,h, far_z,near_z, fov;
-      fov = PI/3.0f;
-      far_z = -50.0f;
-      near_z = -2.0f;
-      w = - 2.0f * near_z * (float)tan(fov/2.0f);
-      h = w * 9.0f / 16.0f;
-      glUniform3f(renderer->sprite_camera_loc, GET3(renderer->camera_pos));
-      glUniform1f(renderer->sprite_far_z_loc, far_z);
-      glUniform1f(renderer->sprite_near_z_loc, near_z);
-      glUniform2f(renderer->sprite_nearsize_loc, w, h);
+      double start_ms = profile_now();
+      err = main_loop(memory, SDL_GetTicks(), input, frame);
+      profile_record(PROFILE_GAME, PROFILE_THREAD_MAIN, start_ms, profile_now() - start_ms);
+    }
+    if (err) {
+      render_thread_stop(&render_thread);
+      return 0;
     }
-    gl_ok_or_die;
-
-    /* draw sprites */
-    glBindVertexArray(renderer->sprites_vertex_array);
-    glBindBuffer(GL_ARRAY_BUFFER, renderer->sprite_vertex_buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, renderer->num_vertices*sizeof(*renderer->vertices), renderer->vertices);
-    glBindTexture(GL_TEXTURE_2D, renderer->sprite_atlas.id);
-    glDrawArrays(GL_TRIANGLES, 0, renderer->num_vertices);
-    gl_ok_or_die;
-
-    /* draw text */
-    glBindVertexArray(renderer->text_vertex_array);
-    glBindBuffer(GL_ARRAY_BUFFER, renderer->text_vertex_buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, renderer->num_text_vertices*sizeof(*renderer->text_vertices), renderer->text_vertices);
-    glBindTexture(GL_TEXTURE_2D, renderer->text_atlas.id);
-    glDrawArrays(GL_TRIANGLES, 0, renderer->num_text_vertices);
-    gl_ok_or_die;
 
-    SDL_GL_SwapWindow(window);
+    spsc_push(&render_thread.ready_frames, frame);
   }
 }
@@ -0,0 +1,266 @@
+/**
+ * Shader compilation and program binary cache
+ *
+ * Programs are built in two steps, so that several can be compiled at once:
+ * shader_build_begin issues the compile and link without asking for the result,
+ * and shader_build_end waits for it. Compute programs start with shader_build_compute_begin instead.
+ * Sources are taken from the asset pack when it has them, and mapped from their files otherwise.
+ * With KHR_parallel_shader_compile the driver compiles
+ * on its own threads in between, and without it, many drivers still defer the work.
+ *
+ * With ARB_get_program_binary, linked programs are saved to shader_<key>.bin in the working
+ * directory. The key is a hash of both sources and of the vendor, renderer and version strings,
+ * so a new driver or a changed shader just misses the cache. A binary the driver refuses
+ * is compiled from source again, and the cache file is replaced.
+ */
+
+#define SHADER_CACHE_MAGIC 0x43484853 /* "SHHC" */
+#define SHADER_CACHE_VERSION 1
+
+struct ShaderCacheHeader {
+  u32 magic;
+  u32 version;
+  u64 key;
+  u32 format;
+  u32 length;
+};
+
+struct ShaderCache {
+  bool binaries;
+  u64 driver_hash;
+};
+
+static ShaderCache shader_cache;
+
+#define SHADER_MAX_STAGES 2
+
+struct ShaderBuild {
+  Shader *shader;
+  /* vertex and fragment, or just compute */
+  const char *filenames[SHADER_MAX_STAGES];
+  GLenum types[SHADER_MAX_STAGES];
+  GLuint shaders[SHADER_MAX_STAGES];
+  int num_stages;
+  u64 key;
+  bool from_cache;
+};
+
+static u64 shader__hash_string(u64 h, const char *s) {
+  /* the terminator separates the strings */
+  return fnv1a(h, s ? s : "", s ? (int)strlen(s) + 1 : 1);
+}
+
+/* Must be called with the context current, after the GL functions have been loaded */
+static void shader_cache_init() {
+  GLint num_formats = 0;
+
+  /* optional, so don't die if they are missing */
+  #define GL_FUN(ret, name, par) *(void**) (&name) = (void*)SDL_GL_GetProcAddress(#name);
+  #include "flat_glfuns_shader.incl"
+  #undef GL_FUN
+
+  if (SDL_GL_ExtensionSupported("GL_ARB_get_program_binary") && glGetProgramBinary && glProgramBinary && glProgramParameteri) {
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    shader_cache.binaries = num_formats > 0;
+  }
+
+  /* the KHR and ARB versions are the same function */
+  if (!glMaxShaderCompilerThreadsKHR)
+    *(void**) (&glMaxShaderCompilerThreadsKHR) = (void*)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+  if ((SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile") || SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile")) && glMaxShaderCompilerThreadsKHR)
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+
+  shader_cache.driver_hash = FNV1A_BASIS;
+  shader_cache.driver_hash = shader__hash_string(shader_cache.driver_hash, (const char*)glGetString(GL_VENDOR));
+  shader_cache.driver_hash = shader__hash_string(shader_cache.driver_hash, (const char*)glGetString(GL_RENDERER));
+  shader_cache.driver_hash = shader__hash_string(shader_cache.driver_hash, (const char*)glGetString(GL_VERSION));
+  gl_ok_or_die;
+}
+
+static void shader__cache_filename(char *buf, int size, u64 key) {
+  snprintf(buf, size, "shader_%016llx.bin", (unsigned long long)key);
+}
+
+/* Returns the program, or 0 if there is no usable binary */
+static GLuint shader__cache_load(u64 key) {
+  ShaderCacheHeader header;
+  char filename[64];
+  FILE *f;
+  void *binary = 0;
+  GLuint program = 0;
+  GLint success;
+
+  if (!shader_cache.binaries)
+    return 0;
+
+  shader__cache_filename(filename, sizeof(filename), key);
+  f = flat_fopen(filename, "rb");
+  if (!f)
+    return 0;
+
+  if (fread(&header, sizeof(header), 1, f) != 1)
+    goto done;
+  if (header.magic != SHADER_CACHE_MAGIC || header.version != SHADER_CACHE_VERSION || header.key != key)
+    goto done;
+
+  binary = malloc(header.length);
+  if (!binary || fread(binary, 1, header.length, f) != header.length)
+    goto done;
+
+  program = glCreateProgram();
+  glProgramBinary(program, header.format, binary, header.length);
+  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  if (!success) {
+    glDeleteProgram(program);
+    program = 0;
+  }
+
+  done:
+  free(binary);
+  fclose(f);
+  return program;
+}
+
+/* The cache is only an optimization, so failing to write it is not an error */
+static void shader__cache_save(u64 key, GLuint program) {
+  ShaderCacheHeader header;
+  char filename[64];
+  GLint length = 0;
+  GLenum format;
+  void *binary;
+  FILE *f;
+
+  if (!shader_cache.binaries)
+    return;
+
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+  binary = malloc(length);
+  if (!binary)
+    return;
+  glGetProgramBinary(program, length, &length, &format, binary);
+
+  header.magic = SHADER_CACHE_MAGIC;
+  header.version = SHADER_CACHE_VERSION;
+  header.key = key;
+  header.format = format;
+  header.length = length;
+
+  shader__cache_filename(filename, sizeof(filename), key);
+  f = flat_fopen(filename, "wb");
+  if (f) {
+    if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(binary, 1, length, f) != (size_t)length)
+      fprintf(get_log_file(), "Failed to write shader cache %s\n", filename);
+    fclose(f);
+  }
+  free(binary);
+}
+
+static GLuint shader__compile(GLenum type, const Asset *src) {
+  GLuint shader = glCreateShader(type);
+  const char *text = (const char*)src->data;
+  GLint length = (GLint)src->size;
+
+  glShaderSource(shader, 1, &text, &length);
+  glCompileShader(shader);
+  return shader;
+}
+
+static void shader__check(GLuint shader, const char *filename) {
+  char info_log[512];
+  GLint success;
+
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+  if (!success) {
+    glGetShaderInfoLog(shader, sizeof(info_log), 0, info_log);
+    die("Could not compile shader %s: %s\n", filename, info_log);
+  }
+}
+
+/* The stages must have been filled in. The sources come from the asset pack, or are mapped from their files */
+static void shader__build_begin(ShaderBuild *b, Shader *shader) {
+  Asset srcs[SHADER_MAX_STAGES];
+  int i;
+
+  b->shader = shader;
+  b->key = shader_cache.driver_hash;
+  for (i = 0; i < b->num_stages; ++i) {
+    b->shaders[i] = 0;
+    if (!asset_map(b->filenames[i], srcs + i))
+      die("Could not open shader file %s\n", b->filenames[i]);
+    /* the same as shader__hash_string, the sources just aren't terminated */
+    b->key = fnv1a(b->key, srcs[i].data, (int)srcs[i].size);
+    b->key = fnv1a(b->key, "", 1);
+  }
+
+  shader->program = shader__cache_load(b->key);
+  b->from_cache = shader->program != 0;
+
+  if (!b->from_cache) {
+    shader->program = glCreateProgram();
+    if (shader_cache.binaries)
+      glProgramParameteri(shader->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    for (i = 0; i < b->num_stages; ++i) {
+      b->shaders[i] = shader__compile(b->types[i], srcs + i);
+      glAttachShader(shader->program, b->shaders[i]);
+    }
+    glLinkProgram(shader->program);
+  }
+
+  /* the driver has its own copy of the sources once glShaderSource returns */
+  for (i = 0; i < b->num_stages; ++i)
+    asset_unmap(srcs + i);
+  gl_ok_or_die;
+}
+
+/* Starts building the program, from the cache if possible */
+static void shader_build_begin(ShaderBuild *b, Shader *shader, const char *vertex_filename, const char *fragment_filename) {
+  b->filenames[0] = vertex_filename;
+  b->types[0] = GL_VERTEX_SHADER;
+  b->filenames[1] = fragment_filename;
+  b->types[1] = GL_FRAGMENT_SHADER;
+  b->num_stages = 2;
+  shader__build_begin(b, shader);
+}
+
+/* Same as shader_build_begin, for a compute program. Needs GL 4.3 */
+static void shader_build_compute_begin(ShaderBuild *b, Shader *shader, const char *compute_filename) {
+  b->filenames[0] = compute_filename;
+  b->types[0] = GL_COMPUTE_SHADER;
+  b->num_stages = 1;
+  shader__build_begin(b, shader);
+}
+
+/* Waits for the program, dies if it didn't compile, and looks up the uniforms */
+static void shader_build_end(ShaderBuild *b) {
+  Shader *shader = b->shader;
+  char info_log[512];
+  GLint success;
+  int i;
+
+  if (!b->from_cache) {
+    for (i = 0; i < b->num_stages; ++i)
+      shader__check(b->shaders[i], b->filenames[i]);
+    glGetProgramiv(shader->program, GL_LINK_STATUS, &success);
+    if (!success) {
+      glGetProgramInfoLog(shader->program, sizeof(info_log), 0, info_log);
+      die("Could not link shader %s%s%s: %s\n", b->filenames[0], b->num_stages > 1 ? " + " : "", b->num_stages > 1 ? b->filenames[1] : "", info_log);
+    }
+    for (i = 0; i < b->num_stages; ++i)
+      glDeleteShader(b->shaders[i]);
+    shader__cache_save(b->key, shader->program);
+  }
+
+  shader->camera_loc = glGetUniformLocation(shader->program, "camera");
+  shader->far_z_loc = glGetUniformLocation(shader->program, "far_z");
+  shader->near_z_loc = glGetUniformLocation(shader->program, "near_z");
+  shader->nearsize_loc = glGetUniformLocation(shader->program, "nearsize");
+  shader->time_loc = glGetUniformLocation(shader->program, "time");
+  shader->anim_rect_loc = glGetUniformLocation(shader->program, "anim_rect");
+  shader->anim_step_loc = glGetUniformLocation(shader->program, "anim_step");
+  shader->anim_frame_time_loc = glGetUniformLocation(shader->program, "anim_frame_time");
+  shader->first_loc = glGetUniformLocation(shader->program, "first");
+  shader->count_loc = glGetUniformLocation(shader->program, "count");
+  gl_ok_or_die;
+}
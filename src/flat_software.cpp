@@ -0,0 +1,662 @@
+/**
+ * Software renderer
+ *
+ * A render backend that draws on the CPU into a memory framebuffer, so that frames can be
+ * rendered, compared and timed without a GPU or a display.
+ *
+ * It implements the projection in sprite_vertex.glsl, text_vertex.glsl and anim_sprite_vertex.glsl, the fragment
+ * shaders in sprite_fragment.glsl and text_fragment.glsl, and the depth and blend state set up in flat_sdl.cpp.
+ * Since the vertex shaders always output w = 1, attributes are interpolated linearly in
+ * screen space and clipping against the near and far planes is a per-pixel depth range test,
+ * both of which are exact.
+ *
+ * Triangles are set up and binned into tiles as they are drawn, and at the end of the frame the tiles are rasterized in parallel.
+ * A tile belongs to one thread, and draws its triangles in submission order, so no locking is needed
+ * and blending behaves like GL. Coverage and depth are evaluated four pixels at a time.
+ *
+ * Differences from GL: there is no mipmapping, so minified textures alias
+ */
+
+#define SWR_TILE_SIZE 64
+STATIC_ASSERT(SWR_TILE_SIZE % 4 == 0, swr_tiles_are_whole_quads);
+
+struct SwrTexture {
+  u8 *pixels;
+  int w, h;
+  /* single channel textures sample as (r,0,0,1), like GL_RED */
+  int channels;
+};
+
+struct SwrVertex {
+  float x, y, z; /* pixels, and normalized device depth */
+  float u, v;
+  v3 normal;
+  v3 pos; /* world */
+};
+
+struct SwrTriangle {
+  /* Edge functions and attributes are all planes: value(x,y) = a*x + b*y + c */
+  float edge_a[3], edge_b[3], edge_c[3];
+  bool edge_top_left[3];
+  float z[3], u[3], v[3], nx[3], ny[3], nz[3];
+  float px[3], py[3], pz[3];
+
+  int texture;
+  int x0, y0, x1, y1; /* pixel bounds, x1 and y1 exclusive */
+};
+
+/* Indices of the triangles that touch a tile, in draw order */
+struct SwrBin {
+  int *triangles;
+  int num, cap;
+};
+
+struct SoftwareRenderer {
+  int w, h, stride; /* stride is w rounded up to a multiple of 4 */
+  u32 *color; /* bytes are r,g,b,a, bottom row first */
+  float *depth;
+
+  SwrTexture textures[RENDER_TEXTURE_COUNT];
+
+  SwrTriangle *triangles;
+  int num_triangles, max_triangles;
+  int tiles_w, tiles_h;
+  SwrBin *bins;
+
+  /* current frame */
+  RenderUniforms uniforms;
+  const SpriteVertex *sprite_vertices;
+  const TextVertex *text_vertices;
+  const SpriteInstance *instances;
+  const CubeInstance *cubes;
+  const LightClusters *lights;
+};
+
+static void swr_init(SoftwareRenderer *s, int w, int h) {
+  memset(s, 0, sizeof(*s));
+  s->w = w;
+  s->h = h;
+  s->stride = ALIGN(w, 4);
+  s->tiles_w = (w + SWR_TILE_SIZE-1) / SWR_TILE_SIZE;
+  s->tiles_h = (h + SWR_TILE_SIZE-1) / SWR_TILE_SIZE;
+
+  s->color = (u32*)malloc(s->stride * h * sizeof(*s->color));
+  s->depth = (float*)malloc(s->stride * h * sizeof(*s->depth));
+  s->bins = (SwrBin*)calloc(s->tiles_w * s->tiles_h, sizeof(*s->bins));
+  s->max_triangles = (ARRAY_LEN(((RenderQueue*)0)->vertices) + ARRAY_LEN(((RenderQueue*)0)->text_vertices)) / 3;
+  s->triangles = (SwrTriangle*)malloc(s->max_triangles * sizeof(*s->triangles));
+  if (!s->color || !s->depth || !s->bins || !s->triangles)
+    die("Failed to allocate software framebuffer: %s\n", flat_strerror(errno));
+}
+
+/* Takes ownership of pixels, which must have been allocated with malloc */
+static void swr_texture_set(SoftwareRenderer *s, int texture, u8 *pixels, int w, int h, int channels) {
+  SwrTexture *t = s->textures + texture;
+
+  free(t->pixels);
+  t->pixels = pixels;
+  t->w = w;
+  t->h = h;
+  t->channels = channels;
+}
+
+/* GL_LINEAR filtering with GL_REPEAT wrapping */
+static v4 swr__sample(SwrTexture *t, float u, float v) {
+  v4 result = {};
+  float fx, fy, tx, ty;
+  int x0, y0, x1, y1, i, c;
+  const u8 *p[4];
+  float weight[4];
+
+  if (!t->pixels) {
+    result.w = 1.0f;
+    return result;
+  }
+
+  fx = u * t->w - 0.5f;
+  fy = v * t->h - 0.5f;
+  x0 = (int)floorf(fx);
+  y0 = (int)floorf(fy);
+  tx = fx - x0;
+  ty = fy - y0;
+  x0 = ((x0 % t->w) + t->w) % t->w;
+  y0 = ((y0 % t->h) + t->h) % t->h;
+  x1 = (x0 + 1) % t->w;
+  y1 = (y0 + 1) % t->h;
+
+  p[0] = t->pixels + (y0*t->w + x0) * t->channels;
+  p[1] = t->pixels + (y0*t->w + x1) * t->channels;
+  p[2] = t->pixels + (y1*t->w + x0) * t->channels;
+  p[3] = t->pixels + (y1*t->w + x1) * t->channels;
+  weight[0] = (1.0f-tx) * (1.0f-ty);
+  weight[1] = tx * (1.0f-ty);
+  weight[2] = (1.0f-tx) * ty;
+  weight[3] = tx * ty;
+
+  for (i = 0; i < 4; ++i) {
+    float f = weight[i] / 255.0f;
+    if (t->channels == 1) {
+      result.x += p[i][0] * f;
+      continue;
+    }
+    for (c = 0; c < 4; ++c)
+      (&result.x)[c] += p[i][c] * f;
+  }
+  if (t->channels == 1)
+    result.w = 1.0f;
+
+  return result;
+}
+
+static void swr__bin_push(SwrBin *b, int triangle) {
+  if (b->num == b->cap) {
+    b->cap = b->cap ? b->cap*2 : 64;
+    b->triangles = (int*)realloc(b->triangles, b->cap * sizeof(*b->triangles));
+    if (!b->triangles)
+      die("Failed to grow software renderer bin: %s\n", flat_strerror(errno));
+  }
+  b->triangles[b->num++] = triangle;
+}
+
+static float swr__clamp01(float x) {
+  return x < 0.0f ? 0.0f : x > 1.0f ? 1.0f : x;
+}
+
+/* Same as sprite_vertex.glsl */
+static void swr__project(SoftwareRenderer *s, v3 pos, SwrVertex *out) {
+  RenderUniforms *u = &s->uniforms;
+  v3 p;
+
+  out->pos = pos;
+  p = pos - u->camera;
+  p.x *= u->near_z / p.z / u->nearsize.x * 2;
+  p.y *= u->near_z / p.z / u->nearsize.y * 2;
+  p.z = (p.z - u->near_z) / (u->far_z - u->near_z) * 2 - 1;
+
+  /* viewport transform */
+  out->x = (p.x + 1.0f) * 0.5f * s->w;
+  out->y = (p.y + 1.0f) * 0.5f * s->h;
+  out->z = p.z;
+}
+
+static v3 swr__decode_normal(const i16 *e) {
+  v3 n;
+  n.x = max(e[0] / 32767.0f, -1.0f);
+  n.y = max(e[1] / 32767.0f, -1.0f);
+  n.z = 1.0f - abs(n.x) - abs(n.y);
+  if (n.z < 0.0f) {
+    float x = n.x;
+    n.x = (1.0f - abs(n.y)) * sign(x);
+    n.y = (1.0f - abs(x)) * sign(n.y);
+  }
+  return normalize(n);
+}
+
+static void swr__plane(const float *a, const float *ea, const float *eb, const float *ec, float inv_area, float *out) {
+  int i;
+  out[0] = out[1] = out[2] = 0.0f;
+  for (i = 0; i < 3; ++i) {
+    out[0] += a[i] * ea[i] * inv_area;
+    out[1] += a[i] * eb[i] * inv_area;
+    out[2] += a[i] * ec[i] * inv_area;
+  }
+}
+
+static void swr__triangle_add(SoftwareRenderer *s, SwrVertex *v0, SwrVertex *v1, SwrVertex *v2, int texture) {
+  SwrVertex *v[3];
+  SwrTriangle t;
+  float area, inv_area, x0, y0, x1, y1, attr[3];
+  int i, tx, ty, index;
+
+  /* There is no face culling, so just flip clockwise triangles */
+  area = (v1->x - v0->x) * (v2->y - v0->y) - (v1->y - v0->y) * (v2->x - v0->x);
+  if (area < 0.0f) {
+    SwrVertex *tmp = v1;
+    v1 = v2, v2 = tmp;
+    area = -area;
+  }
+  if (!(area > 0.0f) || !isfinite(area))
+    return;
+  v[0] = v0, v[1] = v1, v[2] = v2;
+
+  /* Edge i is the one opposite of vertex i, and is positive on the inside */
+  for (i = 0; i < 3; ++i) {
+    SwrVertex *a = v[(i+1)%3], *b = v[(i+2)%3];
+    t.edge_a[i] = a->y - b->y;
+    t.edge_b[i] = b->x - a->x;
+    t.edge_c[i] = a->x*b->y - a->y*b->x;
+    /* left edges increase with x, top edges (y is up) increase downwards */
+    t.edge_top_left[i] = t.edge_a[i] > 0.0f || (t.edge_a[i] == 0.0f && t.edge_b[i] < 0.0f);
+  }
+
+  inv_area = 1.0f / area;
+  #define SWR_PLANE(field, out) \
+    attr[0] = v0->field, attr[1] = v1->field, attr[2] = v2->field; \
+    swr__plane(attr, t.edge_a, t.edge_b, t.edge_c, inv_area, out);
+  SWR_PLANE(z, t.z);
+  SWR_PLANE(u, t.u);
+  SWR_PLANE(v, t.v);
+  SWR_PLANE(normal.x, t.nx);
+  SWR_PLANE(normal.y, t.ny);
+  SWR_PLANE(normal.z, t.nz);
+  SWR_PLANE(pos.x, t.px);
+  SWR_PLANE(pos.y, t.py);
+  SWR_PLANE(pos.z, t.pz);
+  #undef SWR_PLANE
+
+  x0 = min(v0->x, min(v1->x, v2->x));
+  y0 = min(v0->y, min(v1->y, v2->y));
+  x1 = max(v0->x, max(v1->x, v2->x));
+  y1 = max(v0->y, max(v1->y, v2->y));
+  if (x1 < 0.0f || y1 < 0.0f || x0 > s->w || y0 > s->h)
+    return;
+  /* clamp before converting, vertices close to the camera plane project very far away */
+  t.x0 = (int)floorf(max(x0, 0.0f));
+  t.y0 = (int)floorf(max(y0, 0.0f));
+  t.x1 = min((int)ceilf(min(x1, (float)s->w)) + 1, s->w);
+  t.y1 = min((int)ceilf(min(y1, (float)s->h)) + 1, s->h);
+  t.texture = texture;
+
+  /* instances and cubes expand to more triangles than the queue has vertices for, so grow like the bins */
+  if (s->num_triangles == s->max_triangles) {
+    s->max_triangles *= 2;
+    s->triangles = (SwrTriangle*)realloc(s->triangles, s->max_triangles * sizeof(*s->triangles));
+    if (!s->triangles)
+      die("Failed to grow software renderer triangles: %s\n", flat_strerror(errno));
+  }
+  index = s->num_triangles++;
+  s->triangles[index] = t;
+
+  for (ty = t.y0 / SWR_TILE_SIZE; ty <= (t.y1-1) / SWR_TILE_SIZE; ++ty)
+  for (tx = t.x0 / SWR_TILE_SIZE; tx <= (t.x1-1) / SWR_TILE_SIZE; ++tx)
+    swr__bin_push(s->bins + ty*s->tiles_w + tx, index);
+}
+
+/* Same as light in sprite_fragment.glsl */
+static v3 swr__light(SoftwareRenderer *s, v3 pos, v3 n) {
+  const LightClusters *c = s->lights;
+  RenderUniforms *u = &s->uniforms;
+  v3 p = pos - u->camera, sum = {};
+  float d = -p.z, near_d = -u->near_z, far_d = -u->far_z;
+  const LightCluster *cluster;
+  int tx, ty, tz;
+  u32 i;
+
+  if (!c || !c->num_indices)
+    return sum;
+
+  tx = (int)clamp((p.x / d * 2.0f * near_d / u->nearsize.x + 1.0f) * 0.5f * LIGHT_CLUSTERS_X, 0.0f, LIGHT_CLUSTERS_X - 0.5f);
+  ty = (int)clamp((p.y / d * 2.0f * near_d / u->nearsize.y + 1.0f) * 0.5f * LIGHT_CLUSTERS_Y, 0.0f, LIGHT_CLUSTERS_Y - 0.5f);
+  tz = clamp((int)(log(d / near_d) / log(far_d / near_d) * LIGHT_CLUSTERS_Z), 0, LIGHT_CLUSTERS_Z - 1);
+  cluster = c->clusters + (tz*LIGHT_CLUSTERS_Y + ty)*LIGHT_CLUSTERS_X + tx;
+
+  for (i = 0; i < cluster->count; ++i) {
+    const RenderLight *l = c->lights + c->indices[cluster->first + i];
+    v3 to_light = l->pos - pos;
+    float dist = max(length(to_light), 0.0001f);
+    float falloff = swr__clamp01(1.0f - dist / l->radius);
+    sum = sum + l->color * (max(n * (to_light / dist), 0.0f) * falloff*falloff);
+  }
+  return sum;
+}
+
+/* GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA */
+static void swr__blend(u32 *dst, v4 c) {
+  u8 *d = (u8*)dst;
+  float a = c.w;
+
+  d[0] = (u8)((c.x*a + d[0]/255.0f*(1.0f-a)) * 255.0f + 0.5f);
+  d[1] = (u8)((c.y*a + d[1]/255.0f*(1.0f-a)) * 255.0f + 0.5f);
+  d[2] = (u8)((c.z*a + d[2]/255.0f*(1.0f-a)) * 255.0f + 0.5f);
+  d[3] = (u8)((a*a + d[3]/255.0f*(1.0f-a)) * 255.0f + 0.5f);
+}
+
+/* Same as sprite_fragment.glsl */
+static void swr__shade(SoftwareRenderer *s, SwrTriangle *t, int x, int y, u32 *dst) {
+  float px = x + 0.5f, py = y + 0.5f;
+  v3 n, pos, light;
+  v4 c;
+
+  n.x = t->nx[0]*px + t->nx[1]*py + t->nx[2];
+  n.y = t->ny[0]*px + t->ny[1]*py + t->ny[2];
+  n.z = t->nz[0]*px + t->nz[1]*py + t->nz[2];
+  pos.x = t->px[0]*px + t->px[1]*py + t->px[2];
+  pos.y = t->py[0]*px + t->py[1]*py + t->py[2];
+  pos.z = t->pz[0]*px + t->pz[1]*py + t->pz[2];
+  c = swr__sample(s->textures + t->texture, t->u[0]*px + t->u[1]*py + t->u[2], t->v[0]*px + t->v[1]*py + t->v[2]);
+  light = swr__light(s, pos, n);
+
+  c.x = swr__clamp01(c.x + n.x + light.x);
+  c.y = swr__clamp01(c.y + n.y + light.y);
+  c.z = swr__clamp01(c.z + n.z + light.z);
+  c.w = swr__clamp01(c.w + 1.0f);
+  swr__blend(dst, c);
+}
+
+/* signed distance to the outline in texels, like dist in text_fragment.glsl */
+static float swr__text_dist(SwrTexture *tex, float u, float v) {
+  return (swr__sample(tex, u, v).x - GLYPH_SDF_ONEDGE/255.0f) / (GLYPH_SDF_SCALE/255.0f);
+}
+
+/* Same as text_fragment.glsl, where fwidth is exact since the texture coordinates are planes */
+static void swr__shade_text(SoftwareRenderer *s, SwrTriangle *t, int x, int y, u32 *dst) {
+  const v4 text_color = {1.0f, 1.0f, 1.0f, 1.0f}, outline_color = {0.0f, 0.0f, 0.0f, 1.0f}, shadow_color = {0.0f, 0.0f, 0.0f, 0.5f};
+  const float outline_width = 1.5f, shadow_offset = 1.5f;
+  SwrTexture *tex = s->textures + RENDER_TEXTURE_TEXT;
+  float px = x + 0.5f, py = y + 0.5f, u, v, aa, d, fill, outline, shadow;
+  v4 body, c;
+
+  if (!tex->pixels)
+    return;
+
+  u = t->u[0]*px + t->u[1]*py + t->u[2];
+  v = t->v[0]*px + t->v[1]*py + t->v[2];
+  aa = max(max((fabsf(t->u[0]) + fabsf(t->u[1])) * tex->w, (fabsf(t->v[0]) + fabsf(t->v[1])) * tex->h), 0.0001f);
+  d = swr__text_dist(tex, u, v);
+
+  fill = swr__clamp01(d / aa + 0.5f);
+  outline = swr__clamp01((d + outline_width) / aa + 0.5f);
+  shadow = swr__clamp01((swr__text_dist(tex, u - shadow_offset / tex->w, v - shadow_offset / tex->h) + outline_width) / aa + 0.5f) * shadow_color.w;
+
+  body.x = outline_color.x + (text_color.x - outline_color.x) * fill;
+  body.y = outline_color.y + (text_color.y - outline_color.y) * fill;
+  body.z = outline_color.z + (text_color.z - outline_color.z) * fill;
+  body.w = outline * (outline_color.w + (text_color.w - outline_color.w) * fill);
+
+  c.w = body.w + shadow * (1.0f - body.w);
+  c.x = (body.x * body.w + shadow_color.x * shadow * (1.0f - body.w)) / max(c.w, 0.0001f);
+  c.y = (body.y * body.w + shadow_color.y * shadow * (1.0f - body.w)) / max(c.w, 0.0001f);
+  c.z = (body.z * body.w + shadow_color.z * shadow * (1.0f - body.w)) / max(c.w, 0.0001f);
+  swr__blend(dst, c);
+}
+
+static void swr__raster_tile(void *data, int index, int thread) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+  SwrBin *bin = s->bins + index;
+  int tile_x0, tile_y0, tile_x1, tile_y1, i, x, y;
+  (void)thread;
+
+  tile_x0 = (index % s->tiles_w) * SWR_TILE_SIZE;
+  tile_y0 = (index / s->tiles_w) * SWR_TILE_SIZE;
+  tile_x1 = min(tile_x0 + SWR_TILE_SIZE, s->w);
+  tile_y1 = min(tile_y0 + SWR_TILE_SIZE, s->h);
+
+  for (i = 0; i < bin->num; ++i) {
+    SwrTriangle *t = s->triangles + bin->triangles[i];
+    int x0 = max(t->x0, tile_x0) & ~3, x1 = min(t->x1, tile_x1);
+    int y0 = max(t->y0, tile_y0), y1 = min(t->y1, tile_y1);
+
+    for (y = y0; y < y1; ++y) {
+      float py = y + 0.5f;
+      u32 *color = s->color + y*s->stride;
+      float *depth = s->depth + y*s->stride;
+
+      for (x = x0; x < x1; x += 4) {
+        int mask, j;
+#ifdef HAS_SSE
+        __m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+        __m128 inside = _mm_cmplt_ps(px, _mm_set1_ps((float)x1));
+        __m128 z, d;
+
+        for (j = 0; j < 3; ++j) {
+          __m128 e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->edge_a[j]), px), _mm_set1_ps(t->edge_b[j]*py + t->edge_c[j]));
+          __m128 covered = _mm_cmpgt_ps(e, _mm_setzero_ps());
+          if (t->edge_top_left[j])
+            covered = _mm_or_ps(covered, _mm_cmpeq_ps(e, _mm_setzero_ps()));
+          inside = _mm_and_ps(inside, covered);
+        }
+
+        /* clip to the depth range, then depth test */
+        z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->z[0]), px), _mm_set1_ps(t->z[1]*py + t->z[2]));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(z, _mm_set1_ps(-1.0f)));
+        inside = _mm_and_ps(inside, _mm_cmple_ps(z, _mm_set1_ps(1.0f)));
+        z = _mm_mul_ps(_mm_add_ps(z, _mm_set1_ps(1.0f)), _mm_set1_ps(0.5f));
+        d = _mm_loadu_ps(depth + x);
+        inside = _mm_and_ps(inside, _mm_cmplt_ps(z, d));
+
+        mask = _mm_movemask_ps(inside);
+        if (!mask)
+          continue;
+        _mm_storeu_ps(depth + x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, d)));
+#else
+        float z[4];
+        mask = 0;
+        for (j = 0; j < 4; ++j) {
+          float px = x + j + 0.5f;
+          int k;
+          bool in = x + j < x1;
+          for (k = 0; k < 3 && in; ++k) {
+            float e = t->edge_a[k]*px + t->edge_b[k]*py + t->edge_c[k];
+            in = e > 0.0f || (e == 0.0f && t->edge_top_left[k]);
+          }
+          z[j] = t->z[0]*px + t->z[1]*py + t->z[2];
+          in = in && z[j] >= -1.0f && z[j] <= 1.0f;
+          z[j] = (z[j] + 1.0f) * 0.5f;
+          if (in && z[j] < depth[x+j]) {
+            depth[x+j] = z[j];
+            mask |= 1 << j;
+          }
+        }
+        if (!mask)
+          continue;
+#endif
+
+        for (j = 0; j < 4; ++j) {
+          if (!(mask & (1 << j)))
+            continue;
+          if (t->texture == RENDER_TEXTURE_TEXT)
+            swr__shade_text(s, t, x+j, y, color + x + j);
+          else
+            swr__shade(s, t, x+j, y, color + x + j);
+        }
+      }
+    }
+  }
+}
+
+/* ======= Backend ======= */
+
+static void swr_begin_frame(void *data, RenderUniforms *u) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+  int i, num_tiles;
+
+  for (i = 0; i < s->stride * s->h; ++i) {
+    s->color[i] = 0;
+    ((u8*)(s->color + i))[3] = 255;
+    s->depth[i] = 1.0f;
+  }
+
+  num_tiles = s->tiles_w * s->tiles_h;
+  for (i = 0; i < num_tiles; ++i)
+    s->bins[i].num = 0;
+  s->num_triangles = 0;
+  s->uniforms = *u;
+}
+
+/* The vertices are only read in draw, so we can hold on to the pointer */
+static void swr_upload(void *data, int shader, const void *vertices, int num_vertices) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+
+  switch (shader) {
+    case RENDER_SHADER_SPRITE: s->sprite_vertices = (const SpriteVertex*)vertices; break;
+    case RENDER_SHADER_TEXT: s->text_vertices = (const TextVertex*)vertices; break;
+    case RENDER_SHADER_ANIM_SPRITE: s->instances = (const SpriteInstance*)vertices; break;
+    case RENDER_SHADER_CUBE: s->cubes = (const CubeInstance*)vertices; break;
+    default: die("Unknown shader %i\n", shader);
+  }
+}
+
+/* The layer from a vertex, GL clamps it to the texture array the same way */
+static int swr__texture(int layer) {
+  return clamp(layer, 0, RENDER_TEXTURE_COUNT - 1);
+}
+
+/* Same as sprite_vertex.glsl, returns the texture */
+static int swr__sprite_vertex(SoftwareRenderer *s, const SpriteVertex *sv, SwrVertex *v) {
+  v3 pos = {sv->pos[0] / RENDERER_POS_SCALE, sv->pos[1] / RENDERER_POS_SCALE, sv->pos[2] / RENDERER_POS_SCALE};
+  swr__project(s, pos, v);
+  v->u = sv->tex[0] / 65535.0f;
+  v->v = sv->tex[1] / 65535.0f;
+  v->normal = swr__decode_normal(sv->normal);
+  return swr__texture(sv->pos[3]);
+}
+
+/* Only in recordings made with GPU culling. Expanded the same way the game does without it, and not culled */
+static void swr__draw_cubes(SoftwareRenderer *s, int first, int count) {
+  SpriteVertex vertices[CUBE_VERTICES];
+  int i, j;
+
+  for (i = first; i < first + count; ++i) {
+    cubeinstance_expand(s->cubes + i, vertices);
+    for (j = 0; j < CUBE_VERTICES; j += 3) {
+      SwrVertex v[3];
+      int texture = swr__sprite_vertex(s, vertices + j, v);
+      swr__sprite_vertex(s, vertices + j+1, v+1);
+      swr__sprite_vertex(s, vertices + j+2, v+2);
+      swr__triangle_add(s, v, v+1, v+2, texture);
+    }
+  }
+}
+
+/* The text texture is the single channel layer, so the pixels go straight in */
+static void swr_upload_glyphs(void *data, const GlyphUpload *uploads, int num_uploads, const u8 *pixels) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+  SwrTexture *t = s->textures + RENDER_TEXTURE_TEXT;
+  int i, y;
+
+  for (i = 0; i < num_uploads; ++i) {
+    const GlyphUpload *up = uploads + i;
+
+    if (!t->pixels || t->channels != 1 || up->x + up->w > t->w || up->y + up->h > t->h)
+      die("Glyph upload doesn't fit the text texture\n");
+    for (y = 0; y < up->h; ++y)
+      memcpy(t->pixels + (up->y + y)*t->w + up->x, pixels + y*up->w, up->w);
+    pixels += up->w * up->h;
+  }
+}
+
+/* The lights are only read in end_frame, like the vertices */
+static void swr_upload_lights(void *data, const LightClusters *lights) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+  s->lights = lights;
+}
+
+/* Same as anim_sprite_vertex.glsl */
+static void swr__draw_instances(SoftwareRenderer *s, int first, int count) {
+  static const int corners[6] = {0, 1, 2, 0, 2, 3};
+  static const float offsets[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+  const float r = 0.70710678f;
+  const v3 normals[4] = {{-r, 0, r}, {0, -r, r}, {r, 0, r}, {0, r, r}};
+  int i, k;
+
+  for (i = first; i < first + count; ++i) {
+    const SpriteInstance *inst = s->instances + i;
+    Rect frame = render_animation_frame(&s->uniforms.animations, inst->animation, s->uniforms.time - inst->start_time);
+    float w = inst->size[0] / RENDERER_POS_SCALE, h = inst->size[1] / RENDERER_POS_SCALE;
+    int texture = swr__texture(inst->texture);
+    SwrVertex v[6];
+
+    for (k = 0; k < 6; ++k) {
+      int c = corners[k];
+      v3 pos = {inst->pos[0] / RENDERER_POS_SCALE, inst->pos[1] / RENDERER_POS_SCALE, inst->pos[2] / RENDERER_POS_SCALE};
+      pos.x += (offsets[c][0] - 0.5f) * w;
+      pos.y += (offsets[c][1] - 0.5f) * h;
+      swr__project(s, pos, v+k);
+      v[k].u = frame.x0 + offsets[c][0] * (frame.x1 - frame.x0);
+      v[k].v = frame.y0 + offsets[c][1] * (frame.y1 - frame.y0);
+      v[k].normal = normals[c];
+    }
+    swr__triangle_add(s, v, v+1, v+2, texture);
+    swr__triangle_add(s, v+3, v+4, v+5, texture);
+  }
+}
+
+/* Sets up and bins the triangles, in draw order */
+static void swr_draw(void *data, int shader, int texture, int first, int count) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+  int j, k;
+
+  if (shader == RENDER_SHADER_ANIM_SPRITE) {
+    swr__draw_instances(s, first, count);
+    return;
+  }
+  if (shader == RENDER_SHADER_CUBE) {
+    swr__draw_cubes(s, first, count);
+    return;
+  }
+
+  /* like the GL backend, the vertices say which texture they are on */
+  for (j = 0; j + 2 < count; j += 3) {
+    SwrVertex v[3];
+
+    for (k = 0; k < 3; ++k) {
+      switch (shader) {
+        case RENDER_SHADER_SPRITE:
+          texture = swr__sprite_vertex(s, s->sprite_vertices + first + j + k, v+k);
+          break;
+
+        case RENDER_SHADER_TEXT: {
+          const TextVertex *tv = s->text_vertices + first + j + k;
+          swr__project(s, tv->pos, v+k);
+          v[k].u = tv->tex.x;
+          v[k].v = tv->tex.y;
+          v[k].normal = v3{0.0f, 0.0f, 0.0f};
+          texture = RENDER_TEXTURE_TEXT;
+        } break;
+
+        default:
+          die("Unknown shader %i\n", shader);
+      }
+    }
+    swr__triangle_add(s, v, v+1, v+2, texture);
+  }
+}
+
+static void swr_end_frame(void *data) {
+  SoftwareRenderer *s = (SoftwareRenderer*)data;
+  jobs_parallel_for(swr__raster_tile, s, s->tiles_w * s->tiles_h);
+}
+
+static RenderBackend swr_backend_create(SoftwareRenderer *s) {
+  RenderBackend b;
+  b.data = s;
+  b.begin_frame = swr_begin_frame;
+  b.upload = swr_upload;
+  b.upload_lights = swr_upload_lights;
+  b.upload_glyphs = swr_upload_glyphs;
+  b.draw = swr_draw;
+  b.end_frame = swr_end_frame;
+  return b;
+}
+
+/* Uncompressed 32 bit TGA, which is stored bottom row first just like the framebuffer */
+static bool swr_write_tga(SoftwareRenderer *s, const char *filename) {
+  u8 header[18] = {};
+  FILE *f;
+  int x, y;
+  bool ok;
+
+  f = flat_fopen(filename, "wb");
+  if (!f)
+    return false;
+
+  header[2] = 2; /* uncompressed true color */
+  header[12] = s->w & 0xff;
+  header[13] = (s->w >> 8) & 0xff;
+  header[14] = s->h & 0xff;
+  header[15] = (s->h >> 8) & 0xff;
+  header[16] = 32;
+  header[17] = 8; /* alpha bits */
+  fwrite(header, 1, sizeof(header), f);
+
+  for (y = 0; y < s->h; ++y)
+  for (x = 0; x < s->w; ++x) {
+    u8 *c = (u8*)(s->color + y*s->stride + x);
+    u8 bgra[4] = {c[2], c[1], c[0], c[3]};
+    fwrite(bgra, 1, 4, f);
+  }
+
+  ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
@@ -0,0 +1,295 @@
+/**
+ * Background texture loading
+ *
+ * The sprite atlas is packed up front, which only needs the image headers, so the game
+ * can start with all its uv rectangles known. Then the atlas texture array is created with
+ * all its mip levels, cleared on the GPU, and every page gets a pixel buffer object, which is mapped
+ * and handed to loader threads that decode the sprites straight into it. The thread that decodes
+ * the last sprite of a page also makes the page's mip chain, after level 0 in the same buffer.
+ *
+ * The render thread polls the pages once a frame. When a page's mip chain is done, the buffer is unmapped
+ * and every level is copied into the page's layer with glTexSubImage3D, which reads from the bound
+ * GL_PIXEL_UNPACK_BUFFER and so returns without waiting on the copy. No other layer is touched, so
+ * there is no glGenerateMipmap over the whole array, which would also redo the text layer's mips.
+ * A fence then tells us when the copy is done, so the buffer can go. Until then the layer
+ * is transparent, and sprites on it pop in once it arrives.
+ *
+ * Nothing ever blocks on the GPU, except texload_finish, for when we can't do without the textures.
+ *
+ * The decoding runs on threads of its own rather than on the job system, since parallel_for blocks its caller
+ * until all jobs are done, and the point is for the game to start before the sprites are. texload_stop joins them.
+ *
+ * With an asset pack (see flat_pack.cpp), all of the above is skipped: the pack has the atlas
+ * already packed, decoded and mipmapped, so every level of every page is handed to glTexSubImage3D
+ * straight from the mapping, before the first frame, and there is nothing left to poll.
+ */
+
+#define TEXLOAD_MAX_THREADS 4
+
+enum TexloadState {
+  TEXLOAD_FILLING,
+  TEXLOAD_UPLOADING,
+  TEXLOAD_READY
+};
+
+struct TexloadPage {
+  GLuint buffer;
+  int w, h;
+  TexloadState state;
+
+  /* FILLING: the mapped buffer, with level 0 first and then the rest of the mip chain,
+     and the number of sprites that haven't been decoded into it yet, plus one for the mip chain */
+  u8 *pixels;
+  SDL_atomic_t pending;
+
+  /* UPLOADING */
+  GLsync fence;
+};
+
+struct Texloader {
+  AtlasLayout layout;
+  TexloadPage pages[RENDERER_MAX_ATLAS_PAGES];
+  int num_pages, num_levels;
+  SDL_atomic_t next_sprite;
+
+  SDL_Thread *threads[TEXLOAD_MAX_THREADS];
+  int num_threads;
+};
+
+static Texloader texloader;
+
+/* Bytes of level 0 and all the levels after it, of one page */
+static long texload__mips_size(TexloadPage *p) {
+  long size = 0;
+  int l;
+
+  for (l = 0; l < texloader.num_levels; ++l)
+    size += (long)max(p->w >> l, 1) * max(p->h >> l, 1) * 4;
+  return size;
+}
+
+/* Makes every level after the first from the one before it */
+static void texload__mips(TexloadPage *p) {
+  u8 *level = p->pixels;
+  int l, w, h;
+
+  for (l = 1; l < texloader.num_levels; ++l) {
+    w = max(p->w >> (l-1), 1);
+    h = max(p->h >> (l-1), 1);
+    atlas_downsample(level, w, h, level + (long)w*h*4);
+    level += (long)w*h*4;
+  }
+}
+
+/* Creates the atlas texture array with every mip level, and clears the first num_cleared layers in all of them */
+static void texload__create_texture(Renderer *renderer, int num_layers, int num_levels, int num_cleared) {
+  int i, level, w, h;
+  GLuint framebuffer;
+
+  glGenTextures(1, &renderer->atlas_texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, renderer->atlas_texture);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
+  /* new storage is undefined, so clear it on the GPU rather than upload zeroes */
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  for (level = 0; level < num_levels; ++level) {
+    w = max(renderer->atlas_size.x >> level, 1);
+    h = max(renderer->atlas_size.y >> level, 1);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, w, h, num_layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    for (i = 0; i < num_cleared; ++i) {
+      glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, renderer->atlas_texture, level, i);
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteFramebuffers(1, &framebuffer);
+  gl_ok_or_die;
+}
+
+static int texload__worker(void *data) {
+  int i;
+
+  while ((i = SDL_AtomicAdd(&texloader.next_sprite, 1)) < SPRITE_COUNT) {
+    TexloadPage *p = texloader.pages + texloader.layout.images[i].page;
+
+    atlas_load_sprite(&texloader.layout, i, p->pixels);
+    SDL_MemoryBarrierRelease();
+    if (SDL_AtomicAdd(&p->pending, -1) != 2)
+      continue;
+
+    /* the last sprite of the page, so its mips can be made */
+    SDL_MemoryBarrierAcquire();
+    texload__mips(p);
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&p->pending, -1);
+  }
+  return 0;
+}
+
+/* Allocates every level of the atlas, uploads the pages from the pack, and clears the text layer */
+static void texload__start_packed(Renderer *renderer, const PackAtlas *a) {
+  int level;
+
+  memcpy(renderer->sprites, a->sprites, sizeof(a->sprites));
+  renderer->num_sprite_pages = a->num_pages;
+  renderer->atlas_size.x = a->w;
+  renderer->atlas_size.y = a->h;
+  texloader.num_pages = 0;
+
+  texload__create_texture(renderer, RENDER_TEXTURE_SPRITES + a->num_pages, a->num_levels, RENDER_TEXTURE_SPRITES);
+  for (level = 0; level < a->num_levels; ++level)
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, RENDER_TEXTURE_SPRITES, max(a->w >> level, 1), max(a->h >> level, 1), a->num_pages,
+                    GL_RGBA, GL_UNSIGNED_BYTE, pack_atlas_level(a, level));
+  gl_ok_or_die;
+}
+
+/**
+ * Packs the sprites, creates the atlas texture array, and starts decoding the sprites in the background.
+ * If the asset pack has the atlas, it is uploaded from there instead, and is ready when this returns.
+ * The text layer is left to the caller.
+ * Must be called with the context current, before the frames are copied for the render thread
+ */
+static void texload_start(Renderer *renderer) {
+  AtlasLayout *l = &texloader.layout;
+  const PackAtlas *packed = pack_atlas(atlas_hash());
+  int i, num_threads, num_layers;
+
+  if (packed) {
+    texload__start_packed(renderer, packed);
+    return;
+  }
+
+  atlas_pack(l, renderer->sprites);
+  renderer->num_sprite_pages = l->num_pages;
+  texloader.num_pages = l->num_pages;
+
+  /* storage only, the pixels come later */
+  num_layers = RENDER_TEXTURE_SPRITES + l->num_pages;
+  renderer->atlas_size.x = RENDERER_ATLAS_PAGE_SIZE;
+  renderer->atlas_size.y = l->h;
+  texloader.num_levels = atlas_num_levels(renderer->atlas_size.x, renderer->atlas_size.y);
+  texload__create_texture(renderer, num_layers, texloader.num_levels, num_layers);
+
+  for (i = 0; i < l->num_pages; ++i) {
+    TexloadPage *p = texloader.pages + i;
+    GLsizeiptr size;
+
+    p->w = l->pages[i].w;
+    p->h = l->pages[i].h;
+    p->state = TEXLOAD_FILLING;
+    SDL_AtomicSet(&p->pending, 1);
+    size = texload__mips_size(p);
+
+    glGenBuffers(1, &p->buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, p->buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, 0, GL_STREAM_DRAW);
+    p->pixels = (u8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!p->pixels)
+      die("Failed to map pixel buffer for atlas page %i\n", i);
+
+    /* the space between the sprites */
+    memset(p->pixels, 0, (size_t)p->w * p->h * 4);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  gl_ok_or_die;
+
+  for (i = 0; i < SPRITE_COUNT; ++i)
+    SDL_AtomicAdd(&texloader.pages[l->images[i].page].pending, 1);
+
+  /* stb_image keeps this in a global, so set it before any loader is running */
+  stbi_set_flip_vertically_on_load(1);
+  SDL_AtomicSet(&texloader.next_sprite, 0);
+
+  num_threads = min(clamp(SDL_GetCPUCount() - 1, 1, TEXLOAD_MAX_THREADS), (int)SPRITE_COUNT);
+  for (i = 0; i < num_threads; ++i) {
+    texloader.threads[i] = SDL_CreateThread(texload__worker, "texload", 0);
+    if (!texloader.threads[i])
+      die("%s\n", SDL_GetError());
+  }
+  texloader.num_threads = num_threads;
+}
+
+/**
+ * Waits for the loader threads, after they finish the sprites they are decoding, and leaves the rest.
+ * Call before exiting, so no thread is still writing into a pixel buffer
+ */
+static void texload_stop() {
+  int i;
+
+  SDL_AtomicSet(&texloader.next_sprite, SPRITE_COUNT);
+  for (i = 0; i < texloader.num_threads; ++i)
+    SDL_WaitThread(texloader.threads[i], 0);
+  texloader.num_threads = 0;
+}
+
+/* Moves the pages along as their sprites are decoded and their uploads finish. Call once per frame */
+static void texload_poll(Renderer *renderer) {
+  size_t offset;
+  int i, level;
+
+  for (i = 0; i < texloader.num_pages; ++i) {
+    TexloadPage *p = texloader.pages + i;
+
+    switch (p->state) {
+      case TEXLOAD_FILLING:
+        if (SDL_AtomicGet(&p->pending))
+          break;
+        SDL_MemoryBarrierAcquire();
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, p->buffer);
+        if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+          die("Pixel buffer for atlas page %i was lost\n", i);
+        p->pixels = 0;
+
+        /* every level, from the pixel buffer rather than client memory, into this page's layer only */
+        gls_bind_texture(0, GL_TEXTURE_2D_ARRAY, renderer->atlas_texture);
+        for (level = 0, offset = 0; level < texloader.num_levels; ++level) {
+          int w = max(p->w >> level, 1), h = max(p->h >> level, 1);
+          glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, RENDER_TEXTURE_SPRITES + i, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, (void*)offset);
+          offset += (size_t)w * h * 4;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        p->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        p->state = TEXLOAD_UPLOADING;
+        break;
+
+      case TEXLOAD_UPLOADING: {
+        GLenum status = glClientWaitSync(p->fence, 0, 0);
+
+        if (status == GL_TIMEOUT_EXPIRED)
+          break;
+        if (status == GL_WAIT_FAILED)
+          die("Waiting for atlas page %i failed\n", i);
+
+        glDeleteSync(p->fence);
+        glDeleteBuffers(1, &p->buffer);
+        p->fence = 0;
+        p->buffer = 0;
+        p->state = TEXLOAD_READY;
+      } break;
+
+      case TEXLOAD_READY:
+        break;
+    }
+  }
+}
+
+/* Blocks until all textures are ready */
+static void texload_finish(Renderer *renderer) {
+  int i;
+
+  for (;;) {
+    texload_poll(renderer);
+    for (i = 0; i < texloader.num_pages && texloader.pages[i].state == TEXLOAD_READY; ++i);
+    if (i == texloader.num_pages)
+      break;
+
+    /* fences only signal once the commands before them have been sent */
+    glFlush();
+    SDL_Delay(1);
+  }
+}
@@ -0,0 +1,148 @@
+#ifndef FLAT_TEXTCACHE_H
+#define FLAT_TEXTCACHE_H
+
+/**
+ * Text mesh cache
+ *
+ * Most strings are drawn the same way frame after frame, so render_text keeps the vertices it
+ * generates, keyed by a hash of the string and of everything that goes into laying it out.
+ * Next time the string costs one pass over it for the hash, and one memcpy into the arena.
+ *
+ * The vertices live in one fixed pool of TEXTCACHE_BUDGET bytes. When a new mesh doesn't fit,
+ * the least recently used ones are evicted until it does, and if the free space is in holes
+ * the survivors are moved down to close them, which is rare and cheap at this size.
+ *
+ * The meshes point at glyphs in the text layer, so they are all dropped when the platform evicts
+ * glyphs (see Renderer::glyph_generation), which is rare once the glyphs in use have been rasterized.
+ * Every quad remembers the glyph cell it was made from, and a hit hands them to glyph_touch,
+ * so the glyphs of cached strings stay as recently used as if they had been asked for again.
+ *
+ * Keys are 64 bit FNV-1a hashes, which are trusted not to collide.
+ * Nothing is locked, so only one thread may use a cache.
+ */
+
+#define TEXTCACHE_BUDGET (256*1024)
+#define TEXTCACHE_QUAD_VERTICES 6 /* every glyph is two triangles */
+#define TEXTCACHE_MAX_VERTICES ((int)(TEXTCACHE_BUDGET / sizeof(TextVertex)) / TEXTCACHE_QUAD_VERTICES * TEXTCACHE_QUAD_VERTICES)
+#define TEXTCACHE_MAX_ENTRIES 256
+
+struct TextCacheEntry {
+  u64 key;
+  int first, count; /* vertices, always whole quads */
+  u32 last_used;
+};
+
+struct TextCache {
+  TextVertex vertices[TEXTCACHE_MAX_VERTICES];
+  u16 cells[TEXTCACHE_MAX_VERTICES / TEXTCACHE_QUAD_VERTICES]; /* the glyph cell of every quad */
+  int num_vertices; /* the end of the last mesh */
+  int used_vertices; /* num_vertices, without the holes */
+
+  TextCacheEntry entries[TEXTCACHE_MAX_ENTRIES];
+  int num_entries;
+  u32 tick;
+  u32 glyph_generation;
+
+  /* stats */
+  long hits, misses, evictions;
+};
+
+/* Hashes the string, and the layout it is drawn with */
+static u64 textcache_key(const char *str, float x, float y, float z, float height, float max_width, int align) {
+  float layout[5] = {x, y, z, height, max_width};
+  u64 h = fnv1a(FNV1A_BASIS, str, (int)strlen(str));
+
+  h = fnv1a(h, layout, sizeof(layout));
+  return fnv1a(h, &align, sizeof(align));
+}
+
+static void textcache_clear(TextCache *c) {
+  c->num_entries = 0;
+  c->num_vertices = 0;
+  c->used_vertices = 0;
+}
+
+/* Drops everything if glyphs have moved since the meshes were made */
+static void textcache_validate(TextCache *c, u32 glyph_generation) {
+  if (c->glyph_generation == glyph_generation)
+    return;
+  textcache_clear(c);
+  c->glyph_generation = glyph_generation;
+}
+
+/* Returns the mesh for the key, or 0 if it isn't cached */
+static TextCacheEntry* textcache_find(TextCache *c, u64 key) {
+  int i;
+
+  for (i = 0; i < c->num_entries; ++i) {
+    if (c->entries[i].key == key) {
+      c->entries[i].last_used = ++c->tick;
+      ++c->hits;
+      return c->entries + i;
+    }
+  }
+  ++c->misses;
+  return 0;
+}
+
+static void textcache__evict_lru(TextCache *c) {
+  int i, lru = 0;
+
+  for (i = 1; i < c->num_entries; ++i)
+    if (c->entries[i].last_used < c->entries[lru].last_used)
+      lru = i;
+
+  c->used_vertices -= c->entries[lru].count;
+  c->entries[lru] = c->entries[--c->num_entries];
+  ++c->evictions;
+}
+
+static int textcache__cmp_first(const void *a, const void *b) {
+  return ((const TextCacheEntry*)a)->first - ((const TextCacheEntry*)b)->first;
+}
+
+/* Moves the meshes down over the holes, keeping their order */
+static void textcache__compact(TextCache *c) {
+  int i, end = 0;
+
+  qsort(c->entries, c->num_entries, sizeof(*c->entries), textcache__cmp_first);
+  for (i = 0; i < c->num_entries; ++i) {
+    TextCacheEntry *e = c->entries + i;
+    if (e->first != end) {
+      memmove(c->vertices + end, c->vertices + e->first, e->count * sizeof(*c->vertices));
+      memmove(c->cells + end / TEXTCACHE_QUAD_VERTICES, c->cells + e->first / TEXTCACHE_QUAD_VERTICES, e->count / TEXTCACHE_QUAD_VERTICES * sizeof(*c->cells));
+    }
+    e->first = end;
+    end += e->count;
+  }
+  c->num_vertices = end;
+}
+
+/**
+ * Makes room for count vertices under key, evicting as needed, and returns them for the caller to fill,
+ * along with the cells of their glyphs, one per quad.
+ * Returns 0 if the mesh is bigger than the whole cache
+ */
+static TextVertex* textcache_insert(TextCache *c, u64 key, int count, u16 **cells) {
+  TextCacheEntry *e;
+
+  if (count > TEXTCACHE_MAX_VERTICES)
+    return 0;
+
+  while (c->num_entries == TEXTCACHE_MAX_ENTRIES || c->used_vertices + count > TEXTCACHE_MAX_VERTICES)
+    textcache__evict_lru(c);
+  if (c->num_vertices + count > TEXTCACHE_MAX_VERTICES)
+    textcache__compact(c);
+
+  e = c->entries + c->num_entries++;
+  e->key = key;
+  e->first = c->num_vertices;
+  e->count = count;
+  e->last_used = ++c->tick;
+  c->num_vertices += count;
+  c->used_vertices += count;
+  *cells = c->cells + e->first / TEXTCACHE_QUAD_VERTICES;
+  return c->vertices + e->first;
+}
+
+#endif /* FLAT_TEXTCACHE_H */
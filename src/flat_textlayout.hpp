@@ -0,0 +1,183 @@
+#ifndef FLAT_TEXTLAYOUT_H
+#define FLAT_TEXTLAYOUT_H
+
+/**
+ * Text layout
+ *
+ * Lays a UTF-8 string out in one pass: every codepoint is decoded, looked up and kerned against
+ * the one before it exactly once. The result is a list of runs, one per line, each with its glyphs
+ * positioned along it, which render_text turns straight into quads.
+ *
+ *   - '\n' starts a new line
+ *   - with a max_width, lines wrap at the last space that keeps them inside it. A word that is wider
+ *     than max_width on its own is broken between glyphs. The glyphs that move down a line are
+ *     shifted rather than laid out again, so wrapping doesn't cost another pass
+ *   - the alignment picks which point of the text the origin is, left, center or right of every line,
+ *     and the top, middle or baseline of the first line of the block
+ *
+ * Everything is in pixels at RENDERER_FONT_SIZE, with y going down from the origin,
+ * so the caller scales it to the height it draws at.
+ *
+ * Spaces only advance the pen, they have no glyphs, and trailing spaces don't count towards the width of a line.
+ *
+ * Strings that are drawn again the same way aren't laid out again, render_text copies their quads from the text cache.
+ */
+
+#define TEXTLAYOUT_MAX_GLYPHS 4096
+#define TEXTLAYOUT_MAX_RUNS 256
+
+enum TextAlign {
+  /* horizontal */
+  TEXT_ALIGN_LEFT = 0,
+  TEXT_ALIGN_CENTER = 1,
+  TEXT_ALIGN_RIGHT = 2,
+  /* vertical */
+  TEXT_ALIGN_BASELINE = 0,
+  TEXT_ALIGN_TOP = 4,
+  TEXT_ALIGN_MIDDLE = 8,
+
+  TEXT_ALIGN_HORIZONTAL = TEXT_ALIGN_CENTER | TEXT_ALIGN_RIGHT
+};
+
+struct TextGlyph {
+  Glyph glyph;
+  float x; /* of the pen, from the start of the run */
+};
+
+/* A line of glyphs */
+struct TextRun {
+  int first, count;
+  float x, y; /* of the pen at the start of the run, y is the baseline */
+  float width;
+};
+
+struct TextLayout {
+  TextGlyph glyphs[TEXTLAYOUT_MAX_GLYPHS];
+  int num_glyphs;
+  TextRun runs[TEXTLAYOUT_MAX_RUNS];
+  int num_runs;
+
+  /* the box around all runs, from the top of the first line to the bottom of the last */
+  float x0, y0, x1, y1;
+  /* set if glyphs or runs ran out, and the end of the string is missing */
+  bool truncated;
+};
+
+/* Closes the current run, from first to end, and returns false if there is no room for another */
+static bool textlayout__end_run(TextLayout *l, int first, int end, float width) {
+  TextRun *run = l->runs + l->num_runs++;
+
+  run->first = first;
+  run->count = end - first;
+  run->width = width;
+  return l->num_runs < TEXTLAYOUT_MAX_RUNS;
+}
+
+/* Positions the runs and finds the box, once the lines are known */
+static void textlayout__align(TextLayout *l, Renderer *r, int align) {
+  float line_height = r->font_ascent - r->font_descent + r->font_line_gap;
+  float top, x;
+  int i;
+
+  switch (align & ~TEXT_ALIGN_HORIZONTAL) {
+    case TEXT_ALIGN_TOP: top = 0.0f; break;
+    case TEXT_ALIGN_MIDDLE: top = -((l->num_runs - 1) * line_height + r->font_ascent - r->font_descent) / 2.0f; break;
+    default: top = -r->font_ascent; break;
+  }
+
+  l->x0 = l->x1 = 0.0f;
+  for (i = 0; i < l->num_runs; ++i) {
+    TextRun *run = l->runs + i;
+
+    switch (align & TEXT_ALIGN_HORIZONTAL) {
+      case TEXT_ALIGN_CENTER: x = -run->width / 2.0f; break;
+      case TEXT_ALIGN_RIGHT: x = -run->width; break;
+      default: x = 0.0f; break;
+    }
+    run->x = x;
+    run->y = top + r->font_ascent + i * line_height;
+    l->x0 = i ? min(l->x0, x) : x;
+    l->x1 = i ? max(l->x1, x + run->width) : x + run->width;
+  }
+  l->y0 = top;
+  l->y1 = top + l->num_runs * line_height - r->font_line_gap;
+}
+
+/**
+ * Lays out str, wrapping lines at max_width if it is above 0.
+ * align is a horizontal and a vertical TextAlign or'ed together
+ */
+static void textlayout_build(TextLayout *l, Renderer *r, const Funs *funs, const char *str, float max_width, int align) {
+  float pen = 0.0f, ink = 0.0f, break_ink = 0.0f, shift;
+  int line = 0, breakpoint = -1, i;
+  u32 prev = 0, cp;
+  bool room = true;
+
+  l->num_glyphs = 0;
+  l->num_runs = 0;
+
+  while (*str && room) {
+    Glyph g;
+
+    cp = utf8_decode(&str);
+    if (cp == '\n') {
+      room = textlayout__end_run(l, line, l->num_glyphs, ink);
+      line = l->num_glyphs;
+      pen = ink = 0.0f;
+      breakpoint = -1;
+      prev = 0;
+      continue;
+    }
+
+    g = funs->glyph_get(r, cp);
+    if (prev)
+      pen += funs->glyph_kern(prev, cp);
+    prev = cp;
+
+    if (cp == ' ') {
+      /* the next word may go on the next line */
+      breakpoint = l->num_glyphs;
+      break_ink = ink;
+      pen += g.advance;
+      continue;
+    }
+
+    if (max_width > 0.0f && pen + g.advance > max_width) {
+      if (breakpoint > line) {
+        /* move the word since the last space down */
+        room = textlayout__end_run(l, line, breakpoint, break_ink);
+        shift = breakpoint < l->num_glyphs ? l->glyphs[breakpoint].x : pen;
+        for (i = breakpoint; i < l->num_glyphs; ++i)
+          l->glyphs[i].x -= shift;
+        pen -= shift;
+        ink -= shift;
+        line = breakpoint;
+      } else if (l->num_glyphs > line) {
+        /* one long word, break it here */
+        room = textlayout__end_run(l, line, l->num_glyphs, ink);
+        pen = ink = 0.0f;
+        line = l->num_glyphs;
+      }
+      breakpoint = -1;
+      if (!room)
+        break;
+    }
+
+    if (l->num_glyphs == TEXTLAYOUT_MAX_GLYPHS) {
+      room = false;
+      break;
+    }
+    l->glyphs[l->num_glyphs].glyph = g;
+    l->glyphs[l->num_glyphs].x = pen;
+    ++l->num_glyphs;
+    pen += g.advance;
+    ink = pen;
+  }
+
+  l->truncated = !room || *str;
+  if (l->num_runs < TEXTLAYOUT_MAX_RUNS)
+    textlayout__end_run(l, line, l->num_glyphs, ink);
+  textlayout__align(l, r, align);
+}
+
+#endif /* FLAT_TEXTLAYOUT_H */
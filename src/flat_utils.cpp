@@ -4,6 +4,11 @@
   #define OS_LINUX 1
 #endif
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+  #define HAS_SSE 1
+  #include <xmmintrin.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -119,6 +124,25 @@ STATIC_ASSERT(sizeof(u64) == 8, u64_is_8_bytes);
 
 
 
+/****************/
+/*** @HASHING ***/
+/****************/
+#define FNV1A_BASIS 14695981039346656037ULL
+
+/* 64 bit FNV-1a of data, continued from h. Start from FNV1A_BASIS */
+static u64 fnv1a(u64 h, const void *data, int size) {
+  const u8 *p = (const u8*)data;
+  int i;
+
+  for (i = 0; i < size; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+
 /*******************/
 /*** @ALLOCATION ***/
 /*******************/
@@ -481,6 +505,130 @@ static const char* flat_strerror(int err) {
 }
 
 
+/***************/
+/*** @MAPPING ***/
+/***************/
+#ifndef OS_WINDOWS
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+/* A whole file, mapped read only */
+struct MappedFile {
+  const u8 *data;
+  long size;
+#ifdef OS_WINDOWS
+  HANDLE file, mapping;
+#endif
+};
+
+/* Returns false if the file can't be mapped, in which case f is left empty */
+static bool file_map(const char *filename, MappedFile *f) {
+  memset(f, 0, sizeof(*f));
+#ifdef OS_WINDOWS
+  {
+    LARGE_INTEGER size;
+
+    f->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (f->file == INVALID_HANDLE_VALUE)
+      return false;
+    if (!GetFileSizeEx(f->file, &size) || !size.QuadPart || size.QuadPart > 0x7fffffff)
+      goto err;
+    f->mapping = CreateFileMappingA(f->file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!f->mapping)
+      goto err;
+    f->data = (const u8*)MapViewOfFile(f->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!f->data)
+      goto err;
+    f->size = (long)size.QuadPart;
+    return true;
+
+    err:
+    if (f->mapping) CloseHandle(f->mapping);
+    CloseHandle(f->file);
+    memset(f, 0, sizeof(*f));
+    return false;
+  }
+#else
+  {
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+      return false;
+    if (fstat(fd, &st) || !st.st_size) {
+      close(fd);
+      return false;
+    }
+    /* the mapping keeps the file alive */
+    p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    f->data = (const u8*)p;
+    f->size = (long)st.st_size;
+    return true;
+  }
+#endif
+}
+
+static void file_unmap(MappedFile *f) {
+  if (!f->data)
+    return;
+#ifdef OS_WINDOWS
+  UnmapViewOfFile(f->data);
+  CloseHandle(f->mapping);
+  CloseHandle(f->file);
+#else
+  munmap((void*)f->data, f->size);
+#endif
+  memset(f, 0, sizeof(*f));
+}
+
+
+/************/
+/*** @UTF8 ***/
+/************/
+#define UTF8_REPLACEMENT 0xFFFD
+
+/**
+ * Decodes the codepoint at *s, and moves *s past it.
+ * Malformed sequences, overlong encodings and surrogates decode to UTF8_REPLACEMENT, one byte at a time
+ */
+static u32 utf8_decode(const char **s) {
+  const u8 *p = (const u8*)*s;
+  u32 c, min_c;
+  int n, i;
+
+  if (p[0] < 0x80) n = 0, c = p[0], min_c = 0;
+  else if ((p[0] & 0xe0) == 0xc0) n = 1, c = p[0] & 0x1f, min_c = 0x80;
+  else if ((p[0] & 0xf0) == 0xe0) n = 2, c = p[0] & 0x0f, min_c = 0x800;
+  else if ((p[0] & 0xf8) == 0xf0) n = 3, c = p[0] & 0x07, min_c = 0x10000;
+  else {
+    ++*s;
+    return UTF8_REPLACEMENT;
+  }
+
+  /* stops at the terminator too, since it isn't a continuation byte */
+  for (i = 1; i <= n; ++i) {
+    if ((p[i] & 0xc0) != 0x80) {
+      ++*s;
+      return UTF8_REPLACEMENT;
+    }
+    c = (c << 6) | (p[i] & 0x3f);
+  }
+
+  *s += n + 1;
+  if (c < min_c || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    return UTF8_REPLACEMENT;
+  return c;
+}
+
+
 /***************/
 /*** @LOGGING ***/
 /***************/
@@ -504,7 +652,19 @@ static void _die(const char* fmt, ...) {
   abort();
 }
 
-#define gl_ok_or_die _gl_ok_or_die(__FILE__, __LINE__)
+/**
+ * glGetError makes many drivers wait for the GPU, so it is only called in debug builds,
+ * and not even there if the driver reports errors through KHR_debug instead (see flat_gldebug.cpp).
+ * In release builds this compiles to nothing.
+ */
+static bool gl_debug_output;
+
+#ifdef DEBUG
+  #define gl_ok_or_die (gl_debug_output ? (void)0 : _gl_ok_or_die(__FILE__, __LINE__))
+#else
+  #define gl_ok_or_die ((void)0)
+#endif
+
 static void _gl_ok_or_die(const char* file, int line) {
   GLenum error_code;
   const char* error;